@@ -56,7 +56,10 @@ uint8_t x86_regs_for_func_args[] = {
 };
 
 
-uint8_t *emit_move_reg_to_reg(uint8_t *p_pos, uint8_t src, uint8_t dst, uint8_t mode)
+//
+// The following two functions move / exchange values between two registers.
+//
+static uint8_t *emit_reg_reg(uint8_t *p_pos, uint8_t opcode, uint8_t src, uint8_t dst, uint8_t mode)
 {
     uint8_t prefix = 0;
     if (mode == MODE_64) {
@@ -79,7 +82,7 @@ uint8_t *emit_move_reg_to_reg(uint8_t *p_pos, uint8_t src, uint8_t dst, uint8_t
     if (prefix != 0) {
         WRITE_BYTE(p_pos, prefix);
     }
-    WRITE_BYTE(p_pos, OPCODE_MOV_REG_REG);
+    WRITE_BYTE(p_pos, opcode);
     // MOD-REG-R/M byte with register numbers, mode = 11 (register only), source register goes into REG part,
     // destination register into R/M part
     WRITE_BYTE(p_pos, 0xc0 | (src << 3) | dst);
@@ -87,6 +90,90 @@ uint8_t *emit_move_reg_to_reg(uint8_t *p_pos, uint8_t src, uint8_t dst, uint8_t
 }
 
 
+uint8_t *emit_move_reg_to_reg(uint8_t *p_pos, uint8_t src, uint8_t dst, uint8_t mode)
+{
+    return emit_reg_reg(p_pos, OPCODE_MOV_REG_REG, src, dst, mode);
+}
+
+
+uint8_t *emit_exchange_regs(uint8_t *p_pos, uint8_t reg1, uint8_t reg2, uint8_t mode)
+{
+    return emit_reg_reg(p_pos, OPCODE_XCHG_REG_REG, reg1, reg2, mode);
+}
+
+
+//
+// The following two functions move a 64-bit value between a register and the stack at
+// RSP + offset (with an offset of up to 127 bytes).
+//
+static uint8_t *emit_move_stack_reg(uint8_t *p_pos, uint8_t opcode, uint8_t reg, uint8_t offset)
+{
+    uint8_t prefix = PREFIX_REXW;
+    if (reg < 8) {
+        // extended registers R8..R15
+        prefix |= PREFIX_REXR;
+    }
+    else {
+        reg -= 8;
+    }
+    WRITE_BYTE(p_pos, prefix);
+    WRITE_BYTE(p_pos, opcode);
+    // MOD-REG-R/M byte with mode = 01 (8-bit displacement), register and R/M = 100 (SIB byte follows)
+    WRITE_BYTE(p_pos, 0x44 | (reg << 3));
+    // SIB byte with RSP as base and no index
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, offset);
+    return p_pos;
+}
+
+
+uint8_t *emit_move_stack_to_reg(uint8_t *p_pos, uint8_t offset, uint8_t reg)
+{
+    return emit_move_stack_reg(p_pos, OPCODE_MOV_MEM_REG, reg, offset);
+}
+
+
+uint8_t *emit_move_reg_to_stack(uint8_t *p_pos, uint8_t reg, uint8_t offset)
+{
+    return emit_move_stack_reg(p_pos, OPCODE_MOV_REG_MEM, reg, offset);
+}
+
+
+//
+// The following two functions move a 32-bit value between a register and memory at an
+// absolute address (which needs to be below 2GB because it gets sign-extended).
+//
+static uint8_t *emit_move_abs_reg(uint8_t *p_pos, uint8_t opcode, uint8_t reg, uint32_t addr)
+{
+    if (reg < 8) {
+        // extended registers R8D..R15D
+        WRITE_BYTE(p_pos, PREFIX_REXR);
+    }
+    else {
+        reg -= 8;
+    }
+    WRITE_BYTE(p_pos, opcode);
+    // MOD-REG-R/M byte with mode = 00, register and R/M = 100 (SIB byte follows)
+    WRITE_BYTE(p_pos, 0x04 | (reg << 3));
+    // SIB byte with no base and no index, which means a 32-bit displacement follows
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, addr);
+    return p_pos;
+}
+
+
+uint8_t *emit_move_abs_to_reg(uint8_t *p_pos, uint32_t addr, uint8_t reg)
+{
+    return emit_move_abs_reg(p_pos, OPCODE_MOV_MEM_REG, reg, addr);
+}
+
+
+uint8_t *emit_move_reg_to_abs(uint8_t *p_pos, uint8_t reg, uint32_t addr)
+{
+    return emit_move_abs_reg(p_pos, OPCODE_MOV_REG_MEM, reg, addr);
+}
+
+
 uint8_t *emit_move_imm_to_reg(uint8_t *p_pos, uint64_t value, uint8_t reg, uint8_t mode)
 {
     uint8_t prefix = 0;
@@ -17,11 +17,20 @@
 #define OPCODE_JMP_REL32        0xe9
 #define OPCODE_JMP_ABS64        0xff
 #define OPCODE_CALL_ABS64       0xff
+#define OPCODE_CALL_REL32       0xe8
 #define OPCODE_MOV_REG_REG      0x89
+#define OPCODE_XCHG_REG_REG     0x87
+#define OPCODE_MOV_REG_MEM      0x89
+#define OPCODE_MOV_MEM_REG      0x8b
 #define OPCODE_MOV_IMM_REG      0xb8
+#define OPCODE_TEST_REG_REG     0x85
+#define OPCODE_JNZ_REL8         0x75
+#define OPCODE_JRCXZ_REL8       0xe3
+#define OPCODE_LEA              0x8d
 #define OPCODE_RET              0xc3
 #define OPCODE_AND_IMM8         0x83
 #define OPCODE_PUSH_REG         0x50
+#define OPCODE_PUSH_IMM32       0x68
 #define OPCODE_POP_REG          0x58
 #define OPCODE_PUSHFQ           0x9c
 #define OPCODE_POPFQ            0x9d
@@ -29,6 +38,13 @@
 #define PREFIX_REXB             0x41
 #define PREFIX_REXR             0x44
 #define PREFIX_REXW             0x48
+#define PREFIX_0F               0x0f
+#define OPCODE_UD2              0x0b            // second byte after PREFIX_0F
+#define OPCODE_MOVZX_WORD       0xb7            // second byte after PREFIX_0F
+#define OPCODE_MOVSX_WORD       0xbf            // second byte after PREFIX_0F
+
+// number of bytes pushed onto the stack by emit_save_program_state()
+#define PROGRAM_STATE_SIZE      80
 
 // helper macros
 #define WRITE_BYTE(p_pos, val) {*p_pos++ = (val);}
@@ -59,6 +75,11 @@ uint8_t *emit_push_reg(uint8_t *p_pos, uint8_t reg);
 uint8_t *emit_pop_reg(uint8_t *p_pos, uint8_t reg);
 uint8_t *emit_move_imm_to_reg(uint8_t *p_pos, uint64_t value, uint8_t reg, uint8_t mode);
 uint8_t *emit_move_reg_to_reg(uint8_t *p_pos, uint8_t src, uint8_t dst, uint8_t mode);
+uint8_t *emit_exchange_regs(uint8_t *p_pos, uint8_t reg1, uint8_t reg2, uint8_t mode);
+uint8_t *emit_move_stack_to_reg(uint8_t *p_pos, uint8_t offset, uint8_t reg);
+uint8_t *emit_move_reg_to_stack(uint8_t *p_pos, uint8_t reg, uint8_t offset);
+uint8_t *emit_move_abs_to_reg(uint8_t *p_pos, uint32_t addr, uint8_t reg);
+uint8_t *emit_move_reg_to_abs(uint8_t *p_pos, uint8_t reg, uint32_t addr);
 uint8_t *emit_abs_call_to_func(uint8_t *p_pos, void (*p_func)());
 uint8_t *emit_save_amigaos_registers(uint8_t *p_pos);
 uint8_t *emit_restore_amigaos_registers(uint8_t *p_pos);
@@ -6,60 +6,156 @@
 // 
 
 
+#include <signal.h>
+
 #include "codegen.h"
 #include "execute.h"
+#include "tlcache.h"
 #include "translate.h"
 #include "vadm.h"
 #include "util.h"
 
 
-static void log_func_name(const char *p_func_name)
+// log a call of a library routine, called by the trace stub with the return address of the trace site
+// at the start of the thunk, which is preceded by the pointer to the name of the routine
+static void log_lib_call(const uint8_t *p_return_addr)
 {
-    DEBUG("guest called library function %s()", p_func_name);
+    TRACE("guest called library function %s()", *((const char **) (p_return_addr - TRACE_SITE_SIZE - sizeof(const char *))));
 }
 
 
-static uint8_t *emit_call_to_log_func_name(uint8_t *p_pos, const char *p_func_name)
+// emit the code the trace sites at the start of the thunks call when tracing is enabled (one per
+// library because the calls need to be within reach of a 32-bit offset), it makes the call of
+// log_lib_call() completely transparent to the guest
+static uint8_t *emit_trace_stub(uint8_t *p_pos)
 {
-    // move pointer to function name to register for first function argument = RDI
-    p_pos = emit_move_imm_to_reg(p_pos, (uint64_t) p_func_name, REG_RDI, MODE_64);
-    // call function to log the name
-    p_pos = emit_abs_call_to_func(p_pos, (void (*)()) log_func_name);
+    p_pos = emit_save_program_state(p_pos);
+    // the return address pushed by the trace site is the argument
+    p_pos = emit_move_stack_to_reg(p_pos, PROGRAM_STATE_SIZE, REG_RDI);
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    p_pos = emit_abs_call_to_func(p_pos, (void (*)()) log_lib_call);
+#pragma GCC diagnostic pop
+    p_pos = emit_restore_program_state(p_pos);
+    WRITE_BYTE(p_pos, OPCODE_RET);
     return p_pos;
 }
 
 
-static uint8_t *emit_thunk_for_func(uint8_t *p_pos, const char *p_func_name, void (*p_func)(), const char *p_arg_regs)
+// registers that need to be preserved in AmigaOS (all but D0/D1 and A0/A1), see Amiga Guru book, page 45...
+#define AMIGAOS_PRESERVED_REGS  0xfcfc
+// ... and the guest registers mapped to x86 registers the called function may change according to the
+// x86-64 ABI (D0-D3 = R8D-R11D, A0-A2 = EAX/ECX/EDX, A4 = EDI, A6 = ESI), the others (D4-D7, A3, A5
+// and A7) are preserved by the called function
+#define X86_CLOBBERED_REGS      0x570f
+
+// decode one hex digit of the string from the pragma, returns -1 if it isn't one
+static int decode_hex_digit(char c)
 {
-    // log the function name
-    p_pos = emit_save_program_state(p_pos);
-    p_pos = emit_call_to_log_func_name(p_pos, p_func_name);
-    p_pos = emit_restore_program_state(p_pos);
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+// compile the string taken from the libcall / syscall pragma into a descriptor, returns false if the
+// string is malformed or the routine has more arguments than can be passed in registers
+// The string contains the register numbers of the arguments in reverse order, with D0 = 0 and A0 = 8,
+// the register number of the return value and the number of arguments (one hex digit each).
+static bool compile_thunk_desc(const char *p_arg_regs, ThunkDesc *p_desc)
+{
+    size_t len = strlen(p_arg_regs);
+    int nargs, regnum;
+
+    if ((len < 2) || ((nargs = decode_hex_digit(p_arg_regs[len - 1])) == -1) || ((size_t) nargs != len - 2) || (nargs > MAX_FUNC_ARGS))
+        return false;
+    p_desc->td_nargs = nargs;
+    for (int i = 0; i < nargs; i++) {
+        if ((regnum = decode_hex_digit(p_arg_regs[i])) == -1)
+            return false;
+        p_desc->td_arg_regs[nargs - i - 1] = regnum;
+    }
+    if ((regnum = decode_hex_digit(p_arg_regs[nargs])) == -1)
+        return false;
+    p_desc->td_ret_reg = regnum;
+    // The called function only changes the registers the x86-64 ABI allows it to change, so only those
+    // need to be saved that must be preserved in AmigaOS as well (except the one with the return value).
+    p_desc->td_regs_to_save = AMIGAOS_PRESERVED_REGS & X86_CLOBBERED_REGS & ~(1 << p_desc->td_ret_reg);
+    return true;
+}
+
 
-    // save all registers that need to be preserved in AmigaOS because they could be altered by the called function
-    p_pos = emit_save_amigaos_registers(p_pos);
+// move the arguments from the guest registers to the registers specified by the x86-64 ABI
+// The registers overlap (e.g. the 4th argument goes into ECX = A1, which may hold another
+// argument itself), so the moves are ordered such that no register is overwritten before it
+// has been read, and cycles are resolved with XCHG.
+static uint8_t *emit_arg_moves(uint8_t *p_pos, const ThunkDesc *p_desc)
+{
+    uint8_t srcs[MAX_FUNC_ARGS], dsts[MAX_FUNC_ARGS];
+    int nmoves = 0, i, j;
+
+    for (i = 0; i < p_desc->td_nargs; i++) {
+        if (x86_reg_for_m68k_reg[p_desc->td_arg_regs[i]] != x86_regs_for_func_args[i]) {
+            srcs[nmoves] = x86_reg_for_m68k_reg[p_desc->td_arg_regs[i]];
+            dsts[nmoves] = x86_regs_for_func_args[i];
+            ++nmoves;
+        }
+    }
+    while (nmoves > 0) {
+        // find a move whose destination is not read by any of the remaining moves
+        for (i = 0; i < nmoves; i++) {
+            for (j = 0; (j < nmoves) && ((j == i) || (srcs[j] != dsts[i])); j++)
+                ;
+            if (j == nmoves)
+                break;
+        }
+        if (i < nmoves)
+            p_pos = emit_move_reg_to_reg(p_pos, srcs[i], dsts[i], MODE_32);
+        else {
+            // only cycles are left => exchange the registers of the first move, afterwards its
+            // source holds the value the other moves expect in its destination
+            i = 0;
+            p_pos = emit_exchange_regs(p_pos, srcs[i], dsts[i], MODE_32);
+            for (j = 1; j < nmoves; j++) {
+                if (srcs[j] == dsts[i])
+                    srcs[j] = srcs[i];
+            }
+        }
+        --nmoves;
+        srcs[i] = srcs[nmoves];
+        dsts[i] = dsts[nmoves];
+    }
+    return p_pos;
+}
+
+
+// emit the thunk for a library routine, specialized according to its descriptor
+// (the trace site at the start of the thunk is written by the caller)
+static uint8_t *emit_thunk_for_func(uint8_t *p_pos, void (*p_func)(), const ThunkDesc *p_desc)
+{
+    int regnum;
 
-    // move the arguments to the correct registers according to the x86-64 ABI
-    // p_arg_regs is the string taken from the libcall / syscall pragmas specifying the
-    // registers which are used for function arguments and the return value (usually R8D = D0).
-    // It contains the register number of the arguments in reverse order, with D0 = 0 and A0 = 8,
-    // the register number of the return value and the number of arguments.
-    uint8_t argnum, nargs, regnum;
-    sscanf(p_arg_regs + strlen(p_arg_regs) - 1, "%1hhx", &nargs);
-    for (argnum = 0; argnum < nargs; argnum++) {
-        sscanf(p_arg_regs + argnum, "%1hhx", &regnum);
-        p_pos = emit_move_reg_to_reg(p_pos, x86_reg_for_m68k_reg[regnum], x86_regs_for_func_args[nargs - argnum - 1], MODE_32);
+    // save the registers that need to be preserved in AmigaOS and could be altered by the called function
+    for (regnum = 0; regnum < 16; regnum++) {
+        if (p_desc->td_regs_to_save & (1 << regnum))
+            p_pos = emit_push_reg(p_pos, x86_reg_for_m68k_reg[regnum]);
     }
 
-    // call function
+    p_pos = emit_arg_moves(p_pos, p_desc);
     p_pos = emit_abs_call_to_func(p_pos, p_func);
 
-    // move return value from EAX to the register specified by the libcall / syscall pragama (usually R8D = D0)
-    sscanf(p_arg_regs + argnum, "%1hhx", &regnum);
-    p_pos = emit_move_reg_to_reg(p_pos, REG_EAX, regnum, MODE_32);
+    // move return value from EAX to the register specified by the pragma (usually R8D = D0)
+    if (x86_reg_for_m68k_reg[p_desc->td_ret_reg] != REG_EAX)
+        p_pos = emit_move_reg_to_reg(p_pos, REG_EAX, x86_reg_for_m68k_reg[p_desc->td_ret_reg], MODE_32);
 
     // restore registers
-    p_pos = emit_restore_amigaos_registers(p_pos);
+    for (regnum = 15; regnum >= 0; regnum--) {
+        if (p_desc->td_regs_to_save & (1 << regnum))
+            p_pos = emit_pop_reg(p_pos, x86_reg_for_m68k_reg[regnum]);
+    }
 
     // return
     WRITE_BYTE(p_pos, OPCODE_RET);
@@ -67,7 +163,87 @@ static uint8_t *emit_thunk_for_func(uint8_t *p_pos, const char *p_func_name, voi
 }
 
 
-static void setup_jump_tables(uint8_t *p_lib_base, const FuncInfo *p_func_info_tbl)
+// registry of the loaded libraries with their jump tables (the thunks are generated when the functions
+// are called for the first time)
+static Library libraries[MAX_LIBRARIES];
+static int num_registry_hits = 0;          // number of opens that got a library already loaded
+static int num_libraries_loaded = 0;       // number of times a library has been loaded into a slot
+
+// generate the thunk for a library function upon its first call and patch the entry in the first
+// table to jump there directly from now on, called by the resolver stub with the return address of
+// the CALL in the entry, returns the address of the thunk or NULL on error
+static uint8_t *resolve_lib_func(const uint8_t *p_return_addr)
+{
+    const uint8_t *p_entry = p_return_addr - 5;
+    Library *p_lib;
+    const FuncInfo *p_func_info = NULL;
+    ThunkDesc desc;
+
+    for (p_lib = libraries; p_lib < libraries + MAX_LIBRARIES; p_lib++) {
+        if ((p_lib->refcount > 0) && (p_entry >= p_lib->jump_tbl.p_base) && (p_entry < p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE))
+            break;
+    }
+    if (p_lib == libraries + MAX_LIBRARIES) {
+        ERROR("resolver called from address %p, which is not in any jump table", p_entry);
+        return NULL;
+    }
+    JumpTable *p_tbl = &p_lib->jump_tbl;
+    // the last entry in the function info table with this offset is the one the entry has been set up for
+    for (const FuncInfo *pfi = p_tbl->p_func_info_tbl; pfi->offset != 0; ++pfi) {
+        if (pfi->offset == p_tbl->p_base + LIB_JUMP_TBL_SIZE - p_entry)
+            p_func_info = pfi;
+    }
+    if ((p_func_info == NULL) || !compile_thunk_desc(p_func_info->p_arg_regs, &desc)) {
+        ERROR("no function for entry at address %p in jump table", p_entry);
+        return NULL;
+    }
+    // the first table starts at the largest offset, the second table must not grow into it
+    if (p_tbl->p_next_thunk + MAX_THUNK_SIZE > p_tbl->p_base + LIB_JUMP_TBL_SIZE - p_tbl->max_offset) {
+        ERROR("no space left for thunk of function %s()", p_func_info->p_name);
+        return NULL;
+    }
+
+    DEBUG("generating thunk for function %s()", p_func_info->p_name);
+    uint8_t *p_thunk = p_tbl->p_next_thunk + sizeof(const char *);
+    *((const char **) (p_tbl->p_next_thunk + p_tbl->writable_offset)) = p_func_info->p_name;
+    if (!add_trace_site(p_thunk, p_thunk + p_tbl->writable_offset, p_tbl->p_trace_stub))
+        WARN("calls of function %s() will not be traced", p_func_info->p_name);
+    p_tbl->p_next_thunk = emit_thunk_for_func(p_thunk + TRACE_SITE_SIZE + p_tbl->writable_offset, p_func_info->p_func, &desc) - p_tbl->writable_offset;
+    // CALL <resolver stub> => JMP <thunk>
+    uint8_t *p_writable_entry = (uint8_t *) p_entry + p_tbl->writable_offset;
+    *((int32_t *) (p_writable_entry + 1)) = p_thunk - (p_entry + 5);
+    *p_writable_entry = OPCODE_JMP_REL32;
+    return p_thunk;
+}
+
+
+// emit the code the entries in the first table call for functions without a thunk yet, it makes the
+// call of resolve_lib_func() completely transparent to the guest and then continues with the thunk
+// (the return address pushed by the entry gets replaced by the address of the thunk, the return
+// address pushed by the guest is below it)
+static uint8_t *emit_resolver_stub(uint8_t *p_pos)
+{
+    p_pos = emit_save_program_state(p_pos);
+    p_pos = emit_move_stack_to_reg(p_pos, PROGRAM_STATE_SIZE, REG_RDI);
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    p_pos = emit_abs_call_to_func(p_pos, (void (*)()) resolve_lib_func);
+#pragma GCC diagnostic pop
+    // terminate the guest with an invalid opcode exception if the thunk couldn't be generated
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_TEST_REG_REG);
+    WRITE_BYTE(p_pos, 0xc0);                        // MOD-REG-R/M byte with RAX as both operands
+    WRITE_BYTE(p_pos, OPCODE_JNZ_REL8);
+    WRITE_BYTE(p_pos, 2);
+    WRITE_BYTE(p_pos, PREFIX_0F);
+    WRITE_BYTE(p_pos, OPCODE_UD2);
+    p_pos = emit_move_reg_to_stack(p_pos, REG_RAX, PROGRAM_STATE_SIZE);
+    p_pos = emit_restore_program_state(p_pos);
+    WRITE_BYTE(p_pos, OPCODE_RET);
+    return p_pos;
+}
+
+
+static void setup_jump_tables(Library *p_lib, const FuncInfo *p_func_info_tbl)
 {
     // There are two jump tables to create. The first is the one that is used by the programs
     // that use the library to call the functions. The offsets in this table are specified in
@@ -83,53 +259,268 @@ static void setup_jump_tables(uint8_t *p_lib_base, const FuncInfo *p_func_info_t
     // in x86-64 code). This second tables lives at the start of the memory block. For the functions
     // that are not implemented, the first table contains interrupt instructions to inform the
     // supervisor process that an unimplemented function has been called by the program.
-    uint8_t *p_entry_in_1st, *p_entry_in_2nd = p_lib_base;
+    // The tables are written through the writable view of the memory block (at p_writable_base),
+    // while all offsets refer to the executable view (at p_lib_base).
+    // Like the PLT of an ELF executable, the thunks are only generated when the functions are
+    // called for the first time. Until then, the entries in the first table call the resolver stub
+    // (relative call with a 32-bit offset, so the resolver knows the entry from the return address),
+    // which generates the thunk and patches the entry into a jump to it. The second table starts
+    // with the resolver and the trace stub, each thunk starts with a trace site calling the latter,
+    // preceded by the pointer to the name of the function.
+    JumpTable *p_tbl = &p_lib->jump_tbl;
+    uint8_t *p_lib_base = p_tbl->p_base;
+    p_tbl->writable_offset = p_lib->p_writable_base - p_lib_base;
+    p_tbl->p_func_info_tbl = p_func_info_tbl;
+    p_tbl->max_offset = 0;
+    uint8_t *p_resolver_stub = p_lib_base;
+    p_tbl->p_trace_stub = emit_resolver_stub(p_resolver_stub + p_tbl->writable_offset) - p_tbl->writable_offset;
+    p_tbl->p_next_thunk = emit_trace_stub(p_tbl->p_trace_stub + p_tbl->writable_offset) - p_tbl->writable_offset;
+
+    ThunkDesc desc;
+    uint8_t *p_entry;
     for (const FuncInfo *pfi = p_func_info_tbl; pfi->offset != 0; ++pfi) {
-        p_entry_in_1st = p_lib_base + LIB_JUMP_TBL_SIZE - pfi->offset;
+        p_entry = p_lib_base + LIB_JUMP_TBL_SIZE - pfi->offset;
+        if (pfi->offset > p_tbl->max_offset)
+            p_tbl->max_offset = pfi->offset;
         if (pfi->p_func == NULL) {
             // function not implemented => interrupt
 //            DEBUG("creating entry with interrupt for function %s()", pfi->p_name);
-            *p_entry_in_1st = OPCODE_INT_3;
+            *(p_entry + p_tbl->writable_offset) = OPCODE_INT_3;
+        }
+        else if (!compile_thunk_desc(pfi->p_arg_regs, &desc)) {
+            ERROR("invalid register specification '%s' for function %s() - treating it as not implemented", pfi->p_arg_regs, pfi->p_name);
+            *(p_entry + p_tbl->writable_offset) = OPCODE_INT_3;
         }
         else {
-            // function implemented => relative jump to 2nd table
-            // offset = address of entry in 2nd table - address after JMP instruction including offset
-            DEBUG("creating entry with jump and thunk for function %s()", pfi->p_name);
-            *p_entry_in_1st = OPCODE_JMP_REL32;
-            *((int32_t *) (p_entry_in_1st + 1)) = p_entry_in_2nd - (p_entry_in_1st + 5);
-            p_entry_in_2nd = emit_thunk_for_func(p_entry_in_2nd, pfi->p_name, pfi->p_func, pfi->p_arg_regs);
+            // function implemented => relative call to the resolver stub
+            // offset = address of the stub - address after CALL instruction including offset
+            DEBUG("creating entry with call to resolver for function %s()", pfi->p_name);
+            *(p_entry + p_tbl->writable_offset) = OPCODE_CALL_REL32;
+            *((int32_t *) (p_entry + p_tbl->writable_offset + 1)) = p_resolver_stub - (p_entry + 5);
+        }
+    }
+}
+
+
+// get a free slot in the registry and map its memory block if this hasn't been done yet, returns NULL on error
+// (the slots are used from the lowest one, so the mapped blocks are always adjacent)
+static Library *get_free_library_slot()
+{
+    Library *p_lib;
+    for (p_lib = libraries; (p_lib < libraries + MAX_LIBRARIES) && (p_lib->refcount > 0); p_lib++)
+        ;
+    if (p_lib == libraries + MAX_LIBRARIES) {
+        ERROR("too many libraries");
+        return NULL;
+    }
+    if (p_lib->p_writable_base == NULL) {
+        uint8_t *p_lib_base = (uint8_t *) LIB_BASE_START_ADDRESS + (p_lib - libraries) * LIB_JUMP_TBL_SIZE;
+        if ((p_lib->jump_tbl.p_base = create_dual_mapping(p_lib_base, LIB_JUMP_TBL_SIZE, false, &p_lib->p_writable_base)) == NULL) {
+            ERROR("could not create memory mapping for library jump tables: %s", strerror(errno));
+            return NULL;
         }
+        // so that calls of the library routines can be bound directly to the entries in the jump tables
+        register_jump_table(p_lib->jump_tbl.p_base, p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE);
     }
+    return p_lib;
 }
 
 
-uint8_t *load_library(const char *p_lib_name)
+// libraries compiled into the program, they don't need to be loaded with dlopen()
+static const struct
+{
+    const char     *p_name;
+    const FuncInfo *p_func_info_tbl;
+} builtin_libraries[] = {
+    {"exec.library", g_exec_func_info_tbl},
+    {"dos.library", g_dos_func_info_tbl},
+};
+
+// get the function info table of a library, either of a built-in one or from the shared object
+// libs/lib<name>.so (with the extension .library removed from the name), returns NULL on error
+// (only the latter depends on the current directory)
+static const FuncInfo *find_func_info_tbl(const char *p_lib_name, void **pp_handle)
 {
-    DEBUG("dlopen()ing library '%s'", p_lib_name);
+    *pp_handle = NULL;
+    for (size_t i = 0; i < sizeof(builtin_libraries) / sizeof(builtin_libraries[0]); i++) {
+        if (strcmp(builtin_libraries[i].p_name, p_lib_name) == 0)
+            return builtin_libraries[i].p_func_info_tbl;
+    }
+
+    char lib_path_name[MAX_LIB_NAME_LEN + 16];
+    const char *p_ext = strchr(p_lib_name, '.');
+    int len = p_ext != NULL ? p_ext - p_lib_name : (int) strlen(p_lib_name);
+    snprintf(lib_path_name, sizeof(lib_path_name), "libs/lib%.*s.so", len, p_lib_name);
+    DEBUG("dlopen()ing library '%s'", lib_path_name);
     void *lh;
-    if ((lh = dlopen(p_lib_name, RTLD_NOW)) == NULL) {
+    const FuncInfo *p_func_info_tbl;
+    if ((lh = dlopen(lib_path_name, RTLD_NOW)) == NULL) {
         ERROR("dlopen() failed");
         return NULL;
     }
-    if (dlsym(lh, "g_func_info_tbl") == NULL) {
+    if ((p_func_info_tbl = dlsym(lh, "g_func_info_tbl")) == NULL) {
         ERROR("library does not contain function info table");
+        dlclose(lh);
         return NULL;
     }
+    *pp_handle = lh;
+    return p_func_info_tbl;
+}
 
-    DEBUG("setting up library jump tables");
-    static uint8_t *p_lib_base = (uint8_t *) LIB_BASE_START_ADDRESS;
-    if ((p_lib_base = mmap(p_lib_base,
-                           LIB_JUMP_TBL_SIZE,
-                           PROT_READ | PROT_WRITE | PROT_EXEC,
-                           MAP_FIXED | MAP_ANON | MAP_PRIVATE,
-                           -1,
-                           0)) == MAP_FAILED) {
-        ERROR("could not create memory mapping for library jump tables: %s", strerror(errno));
+
+// open a library (e.g. dos.library), returns its base address or NULL on error
+// Libraries are registered by name and version, so opening a library that is already open only
+// increments its reference count and returns the same base address.
+uint8_t *open_library(const char *p_lib_name, uint32_t version)
+{
+    Library *p_lib;
+    for (p_lib = libraries; p_lib < libraries + MAX_LIBRARIES; p_lib++) {
+        if ((p_lib->refcount > 0) && (strcmp(p_lib->name, p_lib_name) == 0) && (p_lib->version == version)) {
+            DEBUG("library '%s' version %d is already open", p_lib_name, version);
+            ++p_lib->refcount;
+            ++num_registry_hits;
+            return p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE;
+        }
+    }
+    if (strlen(p_lib_name) >= MAX_LIB_NAME_LEN) {
+        ERROR("library name '%s' is too long", p_lib_name);
+        return NULL;
+    }
+
+    void *lh;
+    const FuncInfo *p_func_info_tbl;
+    if ((p_func_info_tbl = find_func_info_tbl(p_lib_name, &lh)) == NULL)
+        return NULL;
+    if ((p_lib = get_free_library_slot()) == NULL) {
+        if (lh != NULL)
+            dlclose(lh);
         return NULL;
     }
-    setup_jump_tables(p_lib_base, dlsym(lh, "g_func_info_tbl"));
-    p_lib_base += LIB_JUMP_TBL_SIZE;
-    return p_lib_base;
+
+    DEBUG("setting up library jump tables");
+    setup_jump_tables(p_lib, p_func_info_tbl);
+    strcpy(p_lib->name, p_lib_name);
+    p_lib->version = version;
+    p_lib->refcount = 1;
+    p_lib->p_handle = lh;
+    ++num_libraries_loaded;
+    return p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE;
+}
+
+
+// close a library opened with open_library(), the last close unloads it and frees its slot
+void close_library(uint8_t *p_lib_base)
+{
+    Library *p_lib;
+    for (p_lib = libraries; p_lib < libraries + MAX_LIBRARIES; p_lib++) {
+        if ((p_lib->refcount > 0) && (p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE == p_lib_base))
+            break;
+    }
+    if (p_lib == libraries + MAX_LIBRARIES) {
+        WARN("library with base address %p is not open", p_lib_base);
+        return;
+    }
+    if (--p_lib->refcount > 0)
+        return;
+
+    DEBUG("unloading library '%s'", p_lib->name);
+    // The memory block is kept for the next library loaded into the slot, but its contents are
+    // discarded, so that it looks like a new one (the pages are zero-filled when touched again).
+    // Translated code may still contain direct calls of the entries, which behave just like
+    // calls via A6 with this base address.
+    remove_trace_sites(p_lib->jump_tbl.p_base, p_lib->jump_tbl.p_base + LIB_JUMP_TBL_SIZE);
+    if (madvise(p_lib->p_writable_base, LIB_JUMP_TBL_SIZE, MADV_REMOVE) == -1)
+        memset(p_lib->p_writable_base, 0, LIB_JUMP_TBL_SIZE);
+    if (p_lib->p_handle != NULL) {
+        dlclose(p_lib->p_handle);
+        p_lib->p_handle = NULL;
+    }
+}
+
+
+static void log_library_stats()
+{
+    INFO("library registry: %d libraries loaded, %d opens of libraries already loaded", num_libraries_loaded, num_registry_hits);
+}
+
+
+// handler for SIGSEGV in the guest process, lets the translation cache handle writes to
+// write-protected guest code (self-modifying code)
+// The handler runs on an alternate stack because RSP is the stack pointer of the guest (A7). Everything
+// it calls is async-signal-safe: the translator lock is a futex, and tc_handle_write() doesn't log
+// anything but records the write, which gets logged when the guest enters the dispatcher next time.
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void handle_segv(int signum, siginfo_t *p_info, void *p_context)
+{
+    int saved_errno = errno;
+    // the speculative translator may read unmapped memory, it just gives up on the TU then
+    recover_from_translation_fault();
+    if (is_write_fault(p_context)) {
+        lock_translator();
+        bool is_handled = tc_handle_write(gp_tlcache, p_info->si_addr);
+        // the shadow stack may point into the code of the TUs that have been invalidated
+        if (is_handled)
+            reset_shadow_stack();
+        unlock_translator();
+        if (is_handled) {
+            // return and repeat the write, which succeeds now
+            errno = saved_errno;
+            return;
+        }
+    }
+    // genuine access violation => restore default action, so that the guest gets terminated
+    // when the instruction is repeated
+    struct sigaction action;
+    action.sa_handler = SIG_DFL;
+    action.sa_flags = 0;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    errno = saved_errno;
+}
+#pragma GCC diagnostic pop
+
+
+// handler for SIGUSR1 in the guest process, switches tracing on / off while the guest is running
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void handle_usr1(int signum)
+{
+    // wait until the speculative translator is idle, it must not execute code while it's patched
+    lock_translator();
+    set_tracing(!is_tracing_enabled());
+    unlock_translator();
+}
+#pragma GCC diagnostic pop
+
+
+static bool setup_signal_handlers()
+{
+    stack_t stack;
+    struct sigaction action;
+
+    if ((stack.ss_sp = malloc(SIGSTKSZ)) == NULL) {
+        ERROR("could not allocate memory");
+        return false;
+    }
+    stack.ss_size = SIGSTKSZ;
+    stack.ss_flags = 0;
+    if (sigaltstack(&stack, NULL) == -1) {
+        ERROR("could not set up alternate stack for signal handler: %s", strerror(errno));
+        return false;
+    }
+    action.sa_sigaction = handle_segv;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, NULL) == -1) {
+        ERROR("could not install signal handler: %s", strerror(errno));
+        return false;
+    }
+    action.sa_handler = handle_usr1;
+    action.sa_flags = SA_ONSTACK;
+    if (sigaction(SIGUSR1, &action, NULL) == -1) {
+        ERROR("could not install signal handler: %s", strerror(errno));
+        return false;
+    }
+    return true;
 }
 
 
@@ -141,13 +532,13 @@ bool exec_program(int (*p_code)())
     DEBUG("loading Exec library");
     uint8_t *p_exec_base;
     uint32_t *p_abs_exec_base;
-    if ((p_exec_base = load_library("libs/libexec.so")) == NULL) {
+    if ((p_exec_base = open_library("exec.library", 0)) == NULL) {
         ERROR("could not load Exec library");
         return false;
     }
     if ((p_abs_exec_base = mmap((void *) ABS_EXEC_BASE,
                            4,
-                           PROT_READ | PROT_WRITE | PROT_EXEC,
+                           PROT_READ | PROT_WRITE,
                            MAP_FIXED | MAP_ANON | MAP_PRIVATE,
                            -1,
                            0)) == MAP_FAILED) {
@@ -155,15 +546,23 @@ bool exec_program(int (*p_code)())
         return false;
     }
     #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
-    *p_abs_exec_base = (uint32_t) p_exec_base;
+    *p_abs_exec_base = htonl((uint32_t) p_exec_base);      // big-endian, like everything in guest memory
     #pragma GCC diagnostic pop
 
     // create separate process for the program
     switch ((pid = fork())) {
         case 0:     // child
+            if (!setup_signal_handlers())
+                exit(1);
+            if (!start_spec_translation())
+                exit(1);
             DEBUG("guest is starting...");
             p_code();
             DEBUG("guest is terminating...");
+            stop_spec_translation();
+            tc_log_stats(gp_tlcache);
+            log_library_stats();
+            tc_save_file(gp_tlcache);
             // TODO: capture and return actual return value (in register R8D)
             exit(0);
 
@@ -209,23 +608,119 @@ bool exec_program(int (*p_code)())
 #ifdef TEST
 int main()
 {
+    // The guest passes pointers in 32-bit registers, so the strings are copied to the lower 4GB.
+    char *p_strings;
+    if ((p_strings = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_32BIT | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for strings: %s", strerror(errno));
+        return 1;
+    }
+    strcpy(p_strings, "dos.library");
+    strcpy(p_strings + 16, "So a scheener Dog\n");
 
-    // call library functions via the jump tables
-    register uint8_t *p_lib_base asm("rsi");    // library base address
-    register char *p_lib_name asm("rcx");       // argument for OpenLibrary()
-    register char *p_str asm("r9");             // argument for PutStr()
-    p_lib_base = load_library("libs/libexec.so");
-    p_lib_name = "dos.library";
-    asm(
-        "add    $-552, %esi\n"
-        "call   *%rsi\n"
-        "mov    %r8d, %esi"
+    // call library functions via the jump tables, the thunks only change registers the x86-64 ABI
+    // allows to be changed (D0/D1 and A0/A1 included), and the red zone of main() is skipped
+    register uint64_t lib_base asm("rsi");      // library base address
+    register uint64_t arg1 asm("rcx");          // argument for OpenLibrary() (A1)
+    register uint64_t arg2 asm("r8");           // argument for OpenLibrary() (D0), result
+    register uint64_t arg3 asm("r9");           // argument for PutStr() (D1)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+    lib_base = (uint32_t) open_library("exec.library", 0);
+    arg1 = (uint32_t) p_strings;
+    arg2 = 0;
+    asm volatile(
+        "sub    $128, %%rsp\n"
+        "add    $-552, %%esi\n"
+        "call   *%%rsi\n"
+        "mov    %%r8d, %%esi\n"
+        "add    $128, %%rsp"
+        : "+r" (lib_base), "+r" (arg1), "+r" (arg2)
+        :
+        : "rax", "rdx", "rdi", "r9", "r10", "r11", "memory", "cc"
     );
-    p_str = "So a scheener Dog\n";
-    asm(
-        "add    $-948, %esi\n"
-        "call   *%rsi\n"
+    if (lib_base == 0) {
+        ERROR("could not open DOS library");
+        return 1;
+    }
+    arg3 = (uint32_t) (p_strings + 16);
+    #pragma GCC diagnostic pop
+    asm volatile(
+        "sub    $128, %%rsp\n"
+        "add    $-948, %%esi\n"
+        "call   *%%rsi\n"
+        "add    $128, %%rsp"
+        : "+r" (lib_base), "+r" (arg3)
+        :
+        : "rax", "rcx", "rdx", "rdi", "r8", "r10", "r11", "memory", "cc"
     );
     return 0;
 }
 #endif
+
+
+//
+// benchmarks measuring the cost of a round trip from the guest through the jump table and the thunk
+// to a library routine and back (with tracing disabled, so the trace site in the thunk is a NOP), and
+// the startup cost of the libraries a guest needs (opening Exec and DOS library when they aren't open)
+//
+#ifdef BENCHMARK
+#define NUM_BENCH_CALLS     10000000
+#define NUM_BENCH_OPENS     1000
+#define NUM_BENCH_ROUNDS    10
+#define BENCH_FUNC_OFFSET   0x1e
+
+static uint32_t bench_func(uint32_t a, uint32_t b)
+{
+    return a + b;
+}
+
+
+int main()
+{
+#pragma GCC diagnostic ignored "-Wcast-function-type"
+    static FuncInfo func_info_tbl[] = {
+        {BENCH_FUNC_OFFSET, "BenchFunc", "1002", (void (*)()) bench_func},
+        {0, NULL, NULL, NULL}
+    };
+#pragma GCC diagnostic pop
+    Library *p_lib;
+    if ((p_lib = get_free_library_slot()) == NULL)
+        return 1;
+    setup_jump_tables(p_lib, func_info_tbl);
+    p_lib->refcount = 1;
+    uint8_t *p_lib_base = p_lib->jump_tbl.p_base;
+    // The thunk only changes registers the x86-64 ABI allows to be changed (those preserved in
+    // AmigaOS are saved, D0/D1 and A0/A1 are scratch registers in both worlds), so it can be called
+    // like a C function.
+    void (*p_entry)() = (void (*)()) (p_lib_base + LIB_JUMP_TBL_SIZE - BENCH_FUNC_OFFSET);
+
+    uint64_t best_time = UINT64_MAX;
+    for (int round = 0; round < NUM_BENCH_ROUNDS; round++) {
+        uint64_t start = get_time_ns();
+        for (int i = 0; i < NUM_BENCH_CALLS; i++)
+            p_entry();
+        uint64_t elapsed = get_time_ns() - start;
+        if (elapsed < best_time)
+            best_time = elapsed;
+    }
+    INFO("round trip through jump table and thunk: %.1f ns", (double) best_time / NUM_BENCH_CALLS);
+
+    best_time = UINT64_MAX;
+    for (int round = 0; round < NUM_BENCH_ROUNDS; round++) {
+        uint64_t start = get_time_ns();
+        for (int i = 0; i < NUM_BENCH_OPENS; i++) {
+            uint8_t *p_exec_base = open_library("exec.library", 0);
+            uint8_t *p_dos_base = open_library("dos.library", 0);
+            if ((p_exec_base == NULL) || (p_dos_base == NULL))
+                return 1;
+            close_library(p_dos_base);
+            close_library(p_exec_base);
+        }
+        uint64_t elapsed = get_time_ns() - start;
+        if (elapsed < best_time)
+            best_time = elapsed;
+    }
+    INFO("opening and closing Exec and DOS library: %.1f us", (double) best_time / NUM_BENCH_OPENS / 1000);
+    return 0;
+}
+#endif
@@ -8,6 +8,7 @@
 
 #include <dlfcn.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/errno.h>
@@ -18,6 +19,8 @@
 
 #define LIB_BASE_START_ADDRESS 0x00200000
 #define LIB_JUMP_TBL_SIZE 0x10000
+#define MAX_LIBRARIES 16                // maximum number of libraries loaded at the same time
+#define MAX_THUNK_SIZE 128              // maximum size of a thunk (including the name and the trace site)
 
 typedef struct
 {
@@ -27,10 +30,51 @@ typedef struct
     void     (*p_func)();
 } FuncInfo;
 
+// structure describing the jump tables of a library
+typedef struct
+{
+    uint8_t  *p_base;                   // start of the memory block with the tables (executable view)
+    ptrdiff_t writable_offset;          // offset of the writable view of the block to the executable view
+    const FuncInfo *p_func_info_tbl;    // functions of the library
+    uint16_t max_offset;                // largest offset of a function = size of the first table
+    uint8_t  *p_trace_stub;             // code the trace sites in the thunks call
+    uint8_t  *p_next_thunk;             // where the next thunk goes in the second table (executable view)
+} JumpTable;
+
+// structure describing a library in the registry, which has one slot of LIB_JUMP_TBL_SIZE bytes
+// for the jump tables of each library (slot i starts at LIB_BASE_START_ADDRESS + i * LIB_JUMP_TBL_SIZE)
+#define MAX_LIB_NAME_LEN 256
+typedef struct
+{
+    char     name[MAX_LIB_NAME_LEN];    // name of the library, e.g. dos.library (key together with the version)...
+    uint32_t version;                   // ... and the version requested by OpenLibrary()
+    int      refcount;                  // number of opens not closed yet, 0 = slot is free
+    void     *p_handle;                 // handle of the shared object from dlopen(), NULL for built-in libraries
+    uint8_t  *p_writable_base;          // start of the writable view of the slot, NULL = not mapped yet
+    JumpTable jump_tbl;
+} Library;
+
+// descriptor of the calling convention of a library routine, compiled from the string taken from the
+// libcall / syscall pragma when the jump tables are set up (see compile_thunk_desc())
+#define MAX_FUNC_ARGS 6                 // arguments passed in registers according to the x86-64 ABI
+typedef struct
+{
+    uint8_t  td_nargs;                  // number of arguments...
+    uint8_t  td_arg_regs[MAX_FUNC_ARGS];    // ... and the guest registers holding them (first argument first)
+    uint8_t  td_ret_reg;                // guest register receiving the return value
+    uint16_t td_regs_to_save;           // guest registers the thunk needs to save (bit mask, D0 = bit 0)
+} ThunkDesc;
+
+// function info tables of the libraries compiled into the program (libs/lib*.c), other libraries are
+// loaded from shared objects in libs/ with dlopen() and provide their table as g_func_info_tbl
+extern FuncInfo g_exec_func_info_tbl[];
+extern FuncInfo g_dos_func_info_tbl[];
+
 // see https://stackoverflow.com/questions/52719364/how-to-use-the-attribute-visibilitydefault and
 // https://stackoverflow.com/questions/36692315/what-exactly-does-rdynamic-do-and-when-exactly-is-it-needed
 // for details on how to export certain symbols only
-__attribute__ ((visibility("default"))) uint8_t *load_library(const char *p_lib_name);
+__attribute__ ((visibility("default"))) uint8_t *open_library(const char *p_lib_name, uint32_t version);
+__attribute__ ((visibility("default"))) void close_library(uint8_t *p_lib_base);
 bool exec_program(int (*p_code)());
 
 #endif  // EXECUTE_H_INCLUDED
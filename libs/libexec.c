@@ -6,42 +6,24 @@
 // 
 
 
-#include <bsd/string.h>
+#include "../execute.h"  // for open_library() and close_library()
 
-#include "../execute.h"  // for load_library()
 
-
-#define MAX_PATH_LEN 256
-
-
-#pragma GCC diagnostic ignored "-Wunused-parameter"
 uint8_t *exec_open_library(const char *p_lib_name, uint32_t lib_version)
 {
-    char lib_path_name[MAX_PATH_LEN];
-
-    // build actual path name from library name
-    strlcpy(lib_path_name, "libs/lib", MAX_PATH_LEN);   // prefix with directory where the libraries live and 'lib'
-    if (strlcat(lib_path_name, p_lib_name, MAX_PATH_LEN) > MAX_PATH_LEN) {
-        // library name is too long
-        return NULL;
-    }
-    strtok(lib_path_name, ".");                         // remove extension .library (overwrite . with NUL)
-    strlcat(lib_path_name, ".so", MAX_PATH_LEN);        // add extension .so
-
-    return load_library(lib_path_name);
+    return open_library(p_lib_name, lib_version);
 }
 
 void exec_close_library(uint8_t *p_lib_base)
 {
-    // TODO: call dlclose(), but how do we get the library handle?
+    close_library(p_lib_base);
 }
-#pragma GCC diagnostic pop
 
 
 // lines below have been generated with the following command:
 // grep syscall /opt/m68k-amigaos//m68k-amigaos/ndk/include/pragmas/exec_pragmas.h | perl -nale 'print "    {0x$F[3], \"$F[2]\", \"$F[4]\", NULL},"'
 #pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
-FuncInfo g_func_info_tbl[] = {
+FuncInfo g_exec_func_info_tbl[] = {
     {0x1e, "Supervisor", "D01", NULL},
     {0x48, "InitCode", "1002", NULL},
     {0x4e, "InitStruct", "0A903", NULL},
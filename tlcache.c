@@ -6,6 +6,10 @@
 // 
 
 
+#include <elf.h>
+#include <stdatomic.h>
+
+#include "codegen.h"
 #include "tlcache.h"
 #include "vadm.h"
 #include "util.h"
@@ -14,102 +18,1165 @@
 TranslationCache *gp_tlcache;
 
 
-// The cache is implemented as a binary search tree and stores the mapping of source addresses
-// (Motorola 680x0 code) to destination addresses (Intel x86 code). The bits of the source address
-// are encoded as path through the tree, from the root node to the final node. The final node
-// stores the destination address, either as left or right "successor", depending on the value
-// of the LSB.
+// The cache stores the mapping of source addresses (Motorola 680x0 code) to destination
+// addresses (Intel x86 code) in a two-level page table, similar to the one used by an MMU.
+// As 680x0 instructions are always aligned on a 16-bit boundary, the LSB of the source address
+// is dropped and the remaining bits are used as slot number. The upper NUM_PAGE_DIR_BITS bits
+// of the slot number select the page table in the page directory, the lower NUM_PAGE_TBL_BITS
+// bits select the slot in the page table, which stores the destination address. This way, a
+// lookup costs just two dependent loads. Page tables are allocated when the first address in
+// their range is put into the cache.
+
+// The memory for the translated code is a large address range that is reserved when the
+// cache is initialized, but committed only in chunks of CODE_COMMIT_SIZE bytes when it is
+// actually used. It is mapped twice, an executable view the code runs in and a writable view
+// the code is generated / patched through (see create_dual_mapping()), so that no page is ever
+// writable and executable at the same time. If the amount of translated code would exceed the configured size of the
+// cache, allocations fail. The caller is therefore expected to check with tc_has_space()
+// that the code it is about to generate fits into the cache, and to flush the cache with
+// tc_flush() otherwise (which discards all translated code except the permanent part).
+
+// remove all entries from the cache for the targets of indirect branches
+static void clear_indirect_cache(TranslationCache *p_tc)
+{
+    for (int i = 0; i < NUM_INDIRECT_ENTRIES; i++)
+        p_tc->p_indirect_cache[i] = (IndirectCacheEntry) {1, 0};
+}
+
 
 // initialize TranslationCache object
-TranslationCache *tc_init()
+TranslationCache *tc_init(size_t code_cache_size)
 {
     TranslationCache *p_tc;
-    if ((p_tc = malloc(sizeof(TranslationCache))) == NULL) {
-        ERROR("could not allocate memory");
+    if (code_cache_size > MAX_CODE_SIZE) {
+        ERROR("size of translation cache must not exceed %d bytes", MAX_CODE_SIZE);
         return NULL;
     }
-    if ((p_tc->p_root_node = malloc(sizeof(TranslationCacheNode))) == NULL) {
+    // calloc() so that all entries in the page directory are NULL
+    if ((p_tc = calloc(1, sizeof(TranslationCache))) == NULL) {
         ERROR("could not allocate memory");
         return NULL;
     }
-    if ((p_tc->p_first_code_block = mmap(
-        NULL,
-        MAX_CODE_SIZE,
-        PROT_READ | PROT_WRITE | PROT_EXEC,
-        MAP_ANON | MAP_PRIVATE,
+    uint8_t *p_writable_view;
+    if ((p_tc->p_code_area = create_dual_mapping((void *) CODE_AREA_ADDRESS, MAX_CODE_SIZE, true, &p_writable_view)) == NULL) {
+        ERROR("could not create memory mapping for translated code: %s", strerror(errno));
+        return NULL;
+    }
+    p_tc->writable_offset = p_writable_view - p_tc->p_code_area;
+    if ((p_tc->p_counters = mmap(
+        (void *) COUNTER_AREA_ADDRESS,
+        MAX_COUNTERS * sizeof(uint32_t),
+        PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
         -1,
         0
     )) == MAP_FAILED) {
-        ERROR("could not create memory mapping for translated code: %s", strerror(errno));
+        ERROR("could not create memory mapping for execution counters: %s", strerror(errno));
+        return NULL;
+    }
+    if ((p_tc->p_indirect_cache = mmap(
+        (void *) INDIRECT_CACHE_ADDRESS,
+        NUM_INDIRECT_ENTRIES * sizeof(IndirectCacheEntry),
+        PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+        -1,
+        0
+    )) == MAP_FAILED) {
+        ERROR("could not create memory mapping for the cache for the targets of indirect branches: %s", strerror(errno));
         return NULL;
     }
-    p_tc->p_next_code_block = p_tc->p_first_code_block;
+    clear_indirect_cache(p_tc);
+    p_tc->p_next_free_byte = p_tc->p_code_area;
+    p_tc->p_first_flushable_byte = p_tc->p_code_area;
+    p_tc->p_committed_end = p_tc->p_code_area;
+    p_tc->code_cache_size = code_cache_size;
     return p_tc;
 }
 
 
-// get next free code block from cache
-uint8_t *tc_get_code_block(TranslationCache *p_tc)
+// allocate a block of the given size for translated code from the cache
+// The blocks are handed out one after the other (bump allocation), so that every TU and
+// every stub uses only as much memory as it actually needs. Each block starts on a
+// CODE_ALIGNMENT boundary.
+uint8_t *tc_alloc_code(TranslationCache *p_tc, size_t size)
 {
-    if ((p_tc->p_next_code_block + MAX_CODE_BLOCK_SIZE) <= (p_tc->p_first_code_block + MAX_CODE_SIZE)) {
-        p_tc->p_next_code_block += MAX_CODE_BLOCK_SIZE;
-        return p_tc->p_next_code_block - MAX_CODE_BLOCK_SIZE;
+    uint8_t *p_block = p_tc->p_next_free_byte;
+    size = (size + CODE_ALIGNMENT - 1) & ~(CODE_ALIGNMENT - 1);
+    if ((p_block + size) > (p_tc->p_code_area + p_tc->code_cache_size)) {
+        ERROR("no more free memory available in translation cache (%lu bytes requested)", size);
+        return NULL;
     }
-    else {
-        ERROR("no more free code blocks available in translation cache");
+    if ((p_block + size) > p_tc->p_committed_end) {
+        size_t commit_size = (p_block + size - p_tc->p_committed_end + CODE_COMMIT_SIZE - 1) & ~(CODE_COMMIT_SIZE - 1);
+        DEBUG("committing %lu bytes of memory at %p for translated code", commit_size, p_tc->p_committed_end);
+        if (!commit_dual_mapping(p_tc->p_committed_end, TC_WRITABLE(p_tc, p_tc->p_committed_end), commit_size)) {
+            ERROR("could not commit memory for translated code: %s", strerror(errno));
+            return NULL;
+        }
+        p_tc->p_committed_end += commit_size;
+    }
+    p_tc->p_next_free_byte += size;
+    return p_block;
+}
+
+
+// check if there is enough space left in the cache for blocks with the given total size
+bool tc_has_space(TranslationCache *p_tc, size_t size)
+{
+    return (p_tc->p_next_free_byte + size) <= (p_tc->p_code_area + p_tc->code_cache_size);
+}
+
+
+// allocate consecutive execution counters with the given initial value, returns NULL if there are no more counters
+// The counters live in a separate memory area and not next to the code because writing to a page
+// that also contains code being executed is extremely slow on x86 (the CPU assumes the code has
+// been modified).
+uint32_t *tc_alloc_counters(TranslationCache *p_tc, uint32_t num, uint32_t value)
+{
+    if (p_tc->num_counters + num > MAX_COUNTERS)
         return NULL;
+    uint32_t *p_counters = &p_tc->p_counters[p_tc->num_counters];
+    p_tc->counter_start_value = value;
+    for (uint32_t i = 0; i < num; i++)
+        p_counters[i] = value;
+    p_tc->num_counters += num;
+    return p_counters;
+}
+
+
+// add an indirect branch to the branches whose probes of the cache for their targets are counted, with
+// the two counters for the hits and misses (only the first MAX_INDIRECT_SITES branches are logged by
+// tc_log_stats(), but all of them get counters)
+void tc_add_indirect_site(TranslationCache *p_tc, const uint8_t *p_src_addr, uint32_t *p_counts)
+{
+    if (p_tc->num_indirect_sites < MAX_INDIRECT_SITES)
+        p_tc->indirect_sites[p_tc->num_indirect_sites++] = (IndirectSite) {p_src_addr, p_counts};
+}
+
+
+// make all code allocated so far permanent, that is exclude it from flushes
+void tc_make_permanent(TranslationCache *p_tc)
+{
+    p_tc->p_first_flushable_byte = p_tc->p_next_free_byte;
+}
+
+
+// let the part of the code area that gets flushed start on a new page (called right after tc_make_permanent()),
+// so that the translated code can be mapped from an image, see tc_save_image()
+bool tc_align_flushable(TranslationCache *p_tc)
+{
+    assert(p_tc->p_next_free_byte == p_tc->p_first_flushable_byte);
+    size_t padding = -(uintptr_t) p_tc->p_next_free_byte & (TC_IMAGE_PAGE_SIZE - 1);
+    if ((padding > 0) && (tc_alloc_code(p_tc, padding) == NULL))
+        return false;
+    tc_make_permanent(p_tc);
+    return true;
+}
+
+
+// count the TUs translated by the speculative translator that have been executed (as far as their
+// execution counters tell, the TUs are not counted again afterwards)
+static void count_spec_hits(TranslationCache *p_tc)
+{
+    for (TranslationUnit *p_tu = p_tc->p_first_tu; p_tu != NULL; p_tu = p_tu->p_next) {
+        if (p_tu->is_speculative && (p_tu->p_counter != NULL) && (*p_tu->p_counter != p_tc->counter_start_value))
+            ++p_tc->num_spec_hits;
+        p_tu->is_speculative = false;
     }
 }
 
 
-// put mapping of source address to destination address into cache (creates a new mapping or overwrite an existing mapping)
+// flush the cache, that is remove all mappings and discard all code that is not permanent
+// The memory stays committed, it will be reused for the code translated from now on.
+void tc_flush(TranslationCache *p_tc)
+{
+    DEBUG("flushing translation cache (%lu bytes of translated code)", p_tc->p_next_free_byte - p_tc->p_first_flushable_byte);
+    count_spec_hits(p_tc);
+    // the counters of the indirect branches are reused, so only their totals are kept
+    for (uint32_t i = 0; i < p_tc->num_indirect_sites; i++) {
+        p_tc->num_indirect_hits += p_tc->indirect_sites[i].p_counts[0];
+        p_tc->num_indirect_misses += p_tc->indirect_sites[i].p_counts[1];
+    }
+    p_tc->num_indirect_sites = 0;
+    clear_indirect_cache(p_tc);
+    for (int i = 0; i < PAGE_DIR_SIZE; i++) {
+        free(p_tc->p_page_dir[i]);
+        p_tc->p_page_dir[i] = NULL;
+    }
+    p_tc->num_page_tbls = 0;
+    // The jumps between the TUs don't need to be unchained because all the code is discarded,
+    // we just put the TUs and their lists of jumps onto the free lists.
+    TranslationUnit *p_tu = p_tc->p_first_tu, *p_next_tu;
+    while (p_tu != NULL) {
+        TranslationUnitLink *p_link = p_tu->p_links, *p_next_link;
+        while (p_link != NULL) {
+            p_next_link = p_link->p_next;
+            p_link->p_next = p_tc->p_free_links;
+            p_tc->p_free_links = p_link;
+            p_link = p_next_link;
+        }
+        p_next_tu = p_tu->p_next;
+        p_tu->p_next = p_tc->p_free_tus;
+        p_tc->p_free_tus = p_tu;
+        p_tu = p_next_tu;
+    }
+    p_tc->p_first_tu = NULL;
+    // The guest pages stay write-protected, a write to one of them just removes the protection.
+    for (int i = 0; i < NUM_GUEST_PAGES; i++) {
+        TranslationUnitRef *p_ref = p_tc->p_page_tus[i], *p_next_ref;
+        while (p_ref != NULL) {
+            p_next_ref = p_ref->p_next;
+            p_ref->p_next = p_tc->p_free_refs;
+            p_tc->p_free_refs = p_ref;
+            p_ref = p_next_ref;
+        }
+        p_tc->p_page_tus[i] = NULL;
+    }
+    p_tc->p_next_free_byte = p_tc->p_first_flushable_byte;
+    p_tc->num_counters = 0;
+    p_tc->num_published_tus = 0;
+    ++p_tc->num_flushes;
+}
+
+
+// log statistics about the usage of the cache
+void tc_log_stats(TranslationCache *p_tc)
+{
+    INFO("translation cache: %lu of %lu bytes used, %lu bytes committed, %d flushes, %d TUs translated",
+         p_tc->p_next_free_byte - p_tc->p_code_area,
+         p_tc->code_cache_size,
+         p_tc->p_committed_end - p_tc->p_code_area,
+         p_tc->num_flushes,
+         p_tc->num_translated_tus);
+    for (int i = 0; i < NUM_TIERS; i++)
+        INFO("tier %d: %d TUs, %d bytes of translated code", i, p_tc->num_tier_tus[i], p_tc->tier_code_size[i]);
+    if (p_tc->num_tier_tus[1] > 0)
+        INFO("tier 1 has eliminated %d instructions", p_tc->num_eliminated_insns);
+    if (p_tc->num_tier_tus[0] + p_tc->num_tier_tus[1] > 0)
+        INFO("peephole optimizer has saved %d bytes (%.1f per TU) and %d x86 instructions",
+             p_tc->num_peephole_bytes,
+             (double) p_tc->num_peephole_bytes / (p_tc->num_tier_tus[0] + p_tc->num_tier_tus[1]),
+             p_tc->num_peephole_insns);
+    if (p_tc->num_bound_calls > 0)
+        INFO("%d library calls bound to direct calls, %d of them guarded", p_tc->num_bound_calls, p_tc->num_guarded_calls);
+    tc_log_smc_writes(p_tc);
+    if (p_tc->num_smc_faults > 0)
+        INFO("self-modifying code: %d writes to translated code, %d TUs invalidated", p_tc->num_smc_faults, p_tc->num_invalidated_tus);
+    if (p_tc->num_spec_tus + p_tc->num_spec_discarded + p_tc->num_spec_dropped > 0) {
+        count_spec_hits(p_tc);
+        INFO("speculative translation: %d TUs translated ahead of execution, %d of them executed, %d translations discarded, %d TUs dropped",
+             p_tc->num_spec_tus, p_tc->num_spec_hits, p_tc->num_spec_discarded, p_tc->num_spec_dropped);
+        INFO("speculative translation: guest had to wait for the translation of %d TUs", p_tc->num_guest_translations);
+    }
+    if (p_tc->num_return_misses > 0)
+        INFO("shadow stack: %d returns not predicted, %d of them matched an older call", p_tc->num_return_misses, p_tc->num_return_resyncs);
+    uint64_t num_indirect_hits = p_tc->num_indirect_hits, num_indirect_misses = p_tc->num_indirect_misses;
+    for (uint32_t i = 0; i < p_tc->num_indirect_sites; i++) {
+        num_indirect_hits += p_tc->indirect_sites[i].p_counts[0];
+        num_indirect_misses += p_tc->indirect_sites[i].p_counts[1];
+    }
+    if (num_indirect_hits + num_indirect_misses > 0) {
+        INFO("indirect branches: %lu hits, %lu misses in the cache for their targets (%.1f%% hit rate)",
+             num_indirect_hits, num_indirect_misses, 100.0 * num_indirect_hits / (num_indirect_hits + num_indirect_misses));
+        // only the branches executed often whose targets change often (hit rate below 90%) are worth a closer look
+        for (uint32_t i = 0; i < p_tc->num_indirect_sites; i++) {
+            const IndirectSite *p_site = &p_tc->indirect_sites[i];
+            if ((p_site->p_counts[0] + p_site->p_counts[1] >= 100) && (p_site->p_counts[1] > p_site->p_counts[0] / 9))
+                INFO("indirect branch at %p: %u hits, %u misses", p_site->p_src_addr, p_site->p_counts[0], p_site->p_counts[1]);
+        }
+    }
+    if (p_tc->p_fname != NULL)
+        INFO("persistent translation cache: %d hits, %d misses", p_tc->num_file_hits, p_tc->num_file_misses);
+}
+
+
+// get the slot for a source address, optionally allocating the page table for it,
+// returns NULL if the address is not aligned, out of range or the page table does not exist
 // Treating p_src_addr as 32-bit integer is safe because the loader specifically allocates
 // memory below the 4GB boundary for all segments (and NUM_SOURCE_ADDR_BITS is less than 32).
 #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+static TranslationCacheSlot *get_slot(TranslationCache *p_tc, const uint8_t *p_src_addr, bool create)
+{
+    uint32_t slot = (uint32_t) p_src_addr >> 1;
+    TranslationCachePageTbl **pp_page_tbl;
+
+    if (((uint32_t) p_src_addr & 1) || (((uint64_t) p_src_addr >> NUM_SOURCE_ADDR_BITS) != 0))
+        return NULL;
+    pp_page_tbl = &(p_tc->p_page_dir[slot >> NUM_PAGE_TBL_BITS]);
+    if (*pp_page_tbl == NULL) {
+        if (!create)
+            return NULL;
+        if ((*pp_page_tbl = calloc(1, sizeof(TranslationCachePageTbl))) == NULL) {
+            ERROR("could not allocate memory");
+            return NULL;
+        }
+        ++p_tc->num_page_tbls;
+    }
+    return &((*pp_page_tbl)->slots[slot & (PAGE_TBL_SIZE - 1)]);
+}
+
+
+// get the entry of the cache for the targets of indirect branches a source address maps to (the translated
+// code uses bits 0-15 of the address, multiplied by 4, as offset of the entry)
+static inline IndirectCacheEntry *get_indirect_entry(TranslationCache *p_tc, const uint8_t *p_src_addr)
+{
+    return &p_tc->p_indirect_cache[((uint32_t) p_src_addr >> 1) & (NUM_INDIRECT_ENTRIES - 1)];
+}
+
+
+// set the destination address of the slot for a source address
+static void set_slot_addr(TranslationCache *p_tc, TranslationCacheSlot *p_slot, const uint8_t *p_src_addr, const uint8_t *p_dst_addr)
+{
+    p_slot->p_dst_addr = (uint8_t *) p_dst_addr;
+    // keep the cache for the targets of indirect branches consistent (the TU may have been translated
+    // again or invalidated, then the indirect branches go to the new code or to the stub)
+    IndirectCacheEntry *p_entry = get_indirect_entry(p_tc, p_src_addr);
+    if (p_entry->ie_src_addr == (uint32_t) p_src_addr)
+        p_entry->ie_dst_addr = (uint32_t) p_dst_addr;
+}
+
+
+// put mapping of source address to destination address into cache (creates a new mapping or overwrite an existing mapping)
 bool tc_put_addr(TranslationCache *p_tc, const uint8_t *p_src_addr, const uint8_t *p_dst_addr)
 {
-    uint32_t curr_bit = 1 << (NUM_SOURCE_ADDR_BITS - 1);
-    TranslationCacheNode **pp_curr_node = &(p_tc->p_root_node);
+    TranslationCacheSlot *p_slot;
 
     assert((((uint64_t) p_src_addr) & 0xffffffff00000000) == 0);
-    while (curr_bit > 1) {
-        pp_curr_node = ((uint32_t) p_src_addr & curr_bit) ? &((*pp_curr_node)->p_left_node) : &((*pp_curr_node)->p_right_node);
-        if (*pp_curr_node == NULL) {
-            if ((*pp_curr_node = malloc(sizeof(TranslationCacheNode))) == NULL) {
-                ERROR("could not allocate memory");
-                return false;
-            }
-            (*pp_curr_node)->p_left_node = NULL;
-            (*pp_curr_node)->p_right_node = NULL;
-        }
-        curr_bit >>= 1;
+    if ((p_slot = get_slot(p_tc, p_src_addr, true)) == NULL) {
+        ERROR("could not get slot for source address %p (not aligned on a 16-bit boundary or out of range?)", p_src_addr);
+        return false;
     }
     DEBUG("putting mapping %p -> %p into cache", p_src_addr, p_dst_addr);
-    if ((uint32_t) p_src_addr & 1)
-        (*pp_curr_node)->p_left_node = (TranslationCacheNode *) p_dst_addr;
-    else
-        (*pp_curr_node)->p_right_node = (TranslationCacheNode *) p_dst_addr;
+    set_slot_addr(p_tc, p_slot, p_src_addr, p_dst_addr);
     return true;
 }
 
 
+// put mapping of source address to destination address into the cache for the targets of indirect
+// branches (replacing the entry for another source address with the same index)
+void tc_put_indirect(TranslationCache *p_tc, const uint8_t *p_src_addr, const uint8_t *p_dst_addr)
+{
+    // odd addresses would be looked up at the wrong position, they never hit
+    if ((uint32_t) p_src_addr & 1)
+        return;
+    DEBUG("putting mapping %p -> %p into cache for indirect branches", p_src_addr, p_dst_addr);
+    *get_indirect_entry(p_tc, p_src_addr) = (IndirectCacheEntry) {(uint32_t) p_src_addr, (uint32_t) p_dst_addr};
+}
+
+
 // lookup source address in the cache and return the corresponding destination address,
 // or NULL if the source address does not exist
 uint8_t *tc_get_addr(TranslationCache *p_tc, const uint8_t *p_src_addr)
 {
-    uint32_t curr_bit = 1 << (NUM_SOURCE_ADDR_BITS - 1);
-    TranslationCacheNode **pp_curr_node = &(p_tc->p_root_node);
-    while (curr_bit) {
-        pp_curr_node = ((uint32_t) p_src_addr & curr_bit) ? &((*pp_curr_node)->p_left_node) : &((*pp_curr_node)->p_right_node);
-        if (*pp_curr_node == NULL)
-                return NULL;
-        curr_bit >>= 1;
+    uint32_t slot = (uint32_t) p_src_addr >> 1;
+    const TranslationCachePageTbl *p_page_tbl;
+
+    if (((uint32_t) p_src_addr & 1) || (((uint64_t) p_src_addr >> NUM_SOURCE_ADDR_BITS) != 0))
+        return NULL;
+    if ((p_page_tbl = p_tc->p_page_dir[slot >> NUM_PAGE_TBL_BITS]) == NULL)
+        return NULL;
+    return p_page_tbl->slots[slot & (PAGE_TBL_SIZE - 1)].p_dst_addr;
+}
+
+
+//
+// The following functions manage the TUs in the cache and the jumps between them. Initially,
+// all jumps to a TU go to its stub. When the TU has been translated, the offsets of all these
+// jumps are changed so that they go directly to the translated code (chaining). For this, each
+// TU keeps a list of the jumps to it (the back pointers), which also allows redirecting the
+// jumps back to the stub if the translated code gets discarded (unchaining).
+//
+
+// take a record from a free list or allocate a new one if the list is empty
+// (the records are never given back to the C library, they are only put onto the free lists again)
+#define ALLOC_RECORD(pp_free_list, p_record) \
+    do { \
+        if (*(pp_free_list) != NULL) { \
+            (p_record) = *(pp_free_list); \
+            *(pp_free_list) = (p_record)->p_next; \
+        } \
+        else if (((p_record) = malloc(sizeof(*(p_record)))) == NULL) \
+            ERROR("could not allocate memory"); \
+    } while (0)
+
+// create TU starting at the source address with the given stub and map the source address to the stub
+TranslationUnit *tc_add_tu(TranslationCache *p_tc, const uint8_t *p_src_addr, uint8_t *p_stub)
+{
+    TranslationCacheSlot *p_slot;
+    TranslationUnit *p_tu;
+
+    if (!tc_put_addr(p_tc, p_src_addr, p_stub))
+        return NULL;
+    ALLOC_RECORD(&p_tc->p_free_tus, p_tu);
+    if (p_tu == NULL)
+        return NULL;
+    *p_tu = (TranslationUnit) {0};
+    p_tu->p_src_addr = p_src_addr;
+    p_tu->p_stub = p_stub;
+    p_tu->p_next = p_tc->p_first_tu;
+    p_tc->p_first_tu = p_tu;
+    p_slot = get_slot(p_tc, p_src_addr, false);
+    p_slot->p_tu = p_tu;
+    return p_tu;
+}
+
+
+// get TU starting at the source address, or NULL if there is no such TU in the cache
+TranslationUnit *tc_get_tu(TranslationCache *p_tc, const uint8_t *p_src_addr)
+{
+    TranslationCacheSlot *p_slot;
+    if ((p_slot = get_slot(p_tc, p_src_addr, false)) == NULL)
+        return NULL;
+    return p_slot->p_tu;
+}
+
+
+// set offset of a jump instruction so that it jumps to the given address
+static void set_jump_target(TranslationCache *p_tc, int32_t *p_offset, const uint8_t *p_target)
+{
+    // offset = target address - address after the jump instruction including offset
+    *((int32_t *) TC_WRITABLE(p_tc, p_offset)) = p_target - ((uint8_t *) p_offset + 4);
+}
+
+
+// add jump to the list of jumps to a TU and let it jump to the TU
+// (to the translated code if the TU has already been translated, to the stub otherwise)
+bool tc_add_link(TranslationCache *p_tc, TranslationUnit *p_tu, int32_t *p_offset)
+{
+    TranslationUnitLink *p_link;
+    ALLOC_RECORD(&p_tc->p_free_links, p_link);
+    if (p_link == NULL)
+        return false;
+    p_link->p_offset = p_offset;
+    p_link->p_next = p_tu->p_links;
+    p_tu->p_links = p_link;
+    set_jump_target(p_tc, p_offset, p_tu->p_x86_code ? p_tu->p_x86_code : p_tu->p_stub);
+    return true;
+}
+
+
+// write the first 8 bytes of the stub of a TU in one go (the stub is aligned, so this is atomic
+// even if the stub is executing right now, see tc_publish_tu())
+static void write_stub_entry(TranslationCache *p_tc, TranslationUnit *p_tu, uint8_t opcode, int32_t operand)
+{
+    uint64_t *p_entry = (uint64_t *) TC_WRITABLE(p_tc, p_tu->p_stub);
+    uint64_t entry = *p_entry;
+
+    assert(((uint64_t) p_tu->p_stub & 7) == 0);
+    ((uint8_t *) &entry)[0] = opcode;
+    memcpy((uint8_t *) &entry + 1, &operand, sizeof(operand));
+    __atomic_store_n(p_entry, entry, __ATOMIC_RELEASE);
+}
+
+
+// let the stub of a published TU jump to the dispatcher again (with the PUSH of the source address
+// written by setup_tu(), the JMP to the dispatcher following it has been left alone)
+static void restore_stub(TranslationCache *p_tc, TranslationUnit *p_tu)
+{
+    write_stub_entry(p_tc, p_tu, OPCODE_PUSH_IMM32, (uint32_t) p_tu->p_src_addr);
+    p_tu->is_published = false;
+    --p_tc->num_published_tus;
+}
+
+
+// chain TU, that is let all jumps to the TU go directly to its translated code
+// and map the source address to the translated code from now on
+bool tc_chain_tu(TranslationCache *p_tc, TranslationUnit *p_tu, uint8_t *p_x86_code)
+{
+    DEBUG("chaining TU with source address %p to translated code at %p", p_tu->p_src_addr, p_x86_code);
+    if (p_tu->is_published)
+        restore_stub(p_tc, p_tu);
+    p_tu->p_x86_code = p_x86_code;
+    ++p_tc->num_translated_tus;
+    for (TranslationUnitLink *p_link = p_tu->p_links; p_link != NULL; p_link = p_link->p_next)
+        set_jump_target(p_tc, p_link->p_offset, p_x86_code);
+    return tc_put_addr(p_tc, p_tu->p_src_addr, p_x86_code);
+}
+
+
+// publish the translated code of a TU while the guest is running (used by the speculative translator),
+// that is map the source address to the translated code and let the stub jump there, by changing
+// its PUSH into a JMP with a single atomic write
+// The jumps to the TU are not chained because they may be in code that is executing right now, they
+// go through the stub until tc_chain_published_tus() is called while the guest is stopped.
+bool tc_publish_tu(TranslationCache *p_tc, TranslationUnit *p_tu, uint8_t *p_x86_code)
+{
+    DEBUG("publishing TU with source address %p with translated code at %p", p_tu->p_src_addr, p_x86_code);
+    p_tu->p_x86_code = p_x86_code;
+    ++p_tc->num_translated_tus;
+    if (!tc_put_addr(p_tc, p_tu->p_src_addr, p_x86_code))
+        return false;
+    // the translated code has been written before, so it is complete when the guest sees the JMP
+    write_stub_entry(p_tc, p_tu, OPCODE_JMP_REL32, p_x86_code - (p_tu->p_stub + 5));
+    p_tu->is_published = true;
+    ++p_tc->num_published_tus;
+    return true;
+}
+
+
+// chain all TUs published with tc_publish_tu(), and let their stubs jump to the dispatcher again
+// (only while the guest is stopped, in the dispatcher)
+void tc_chain_published_tus(TranslationCache *p_tc)
+{
+    for (TranslationUnit *p_tu = p_tc->p_first_tu; (p_tu != NULL) && (p_tc->num_published_tus > 0); p_tu = p_tu->p_next) {
+        if (p_tu->is_published) {
+            DEBUG("chaining published TU with source address %p", p_tu->p_src_addr);
+            for (TranslationUnitLink *p_link = p_tu->p_links; p_link != NULL; p_link = p_link->p_next)
+                set_jump_target(p_tc, p_link->p_offset, p_tu->p_x86_code);
+            restore_stub(p_tc, p_tu);
+        }
+    }
+}
+
+
+// unchain TU, that is let all jumps to the TU go to its stub again
+// and map the source address to the stub from now on
+// This part neither logs nor allocates anything (the TU already has a slot), so that tc_handle_write() can use it.
+static void unchain_tu(TranslationCache *p_tc, TranslationUnit *p_tu)
+{
+    if (p_tu->is_published)
+        restore_stub(p_tc, p_tu);
+    p_tu->p_x86_code = NULL;
+    for (TranslationUnitLink *p_link = p_tu->p_links; p_link != NULL; p_link = p_link->p_next)
+        set_jump_target(p_tc, p_link->p_offset, p_tu->p_stub);
+    set_slot_addr(p_tc, get_slot(p_tc, p_tu->p_src_addr, false), p_tu->p_src_addr, p_tu->p_stub);
+}
+
+
+bool tc_unchain_tu(TranslationCache *p_tc, TranslationUnit *p_tu)
+{
+    DEBUG("unchaining TU with source address %p", p_tu->p_src_addr);
+    unchain_tu(p_tc, p_tu);
+    return true;
+}
+
+
+//
+// The following functions detect self-modifying code. When a TU has been translated, the guest
+// pages its source code lives in are write-protected and the TU is added to the lists of TUs
+// overlapping these pages (the page index). When the guest (or a library function) writes to such
+// a page, the resulting SIGSEGV is passed to tc_handle_write(), which invalidates all TUs on the
+// page (they get translated again when they are executed the next time) and removes the write
+// protection so that the write can be repeated. As long as the guest doesn't write to its code,
+// this costs nothing at all. Pages that are written to over and over again (usually because code
+// and data share a page) are no longer protected after MAX_PAGE_INVALIDATIONS invalidations,
+// modifications of the code on these pages go unnoticed then.
+//
+
+// remove TU from the lists of all pages it overlaps
+static void remove_from_page_index(TranslationCache *p_tc, TranslationUnit *p_tu)
+{
+    for (uint64_t page = (uint64_t) p_tu->p_src_start / GUEST_PAGE_SIZE;
+         (page <= ((uint64_t) p_tu->p_src_end - 1) / GUEST_PAGE_SIZE) && (page < NUM_GUEST_PAGES);
+         page++) {
+        for (TranslationUnitRef **pp_ref = &p_tc->p_page_tus[page]; *pp_ref != NULL; pp_ref = &(*pp_ref)->p_next) {
+            if ((*pp_ref)->p_tu == p_tu) {
+                TranslationUnitRef *p_ref = *pp_ref;
+                *pp_ref = p_ref->p_next;
+                p_ref->p_next = p_tc->p_free_refs;
+                p_tc->p_free_refs = p_ref;
+                break;
+            }
+        }
+    }
+    p_tu->p_src_start = NULL;
+    p_tu->p_src_end = NULL;
+}
+
+
+// write-protect the guest pages the source code of a translated TU lives in and add the TU to the page index
+// (a TU that is a trace may contain code from before its source address, so the range is passed explicitly)
+bool tc_protect_tu(TranslationCache *p_tc, TranslationUnit *p_tu, const uint8_t *p_src_start, const uint8_t *p_src_end)
+{
+    TranslationUnitRef *p_ref;
+
+    // TU is already in the page index if it has been translated again (as trace)
+    if (p_tu->p_src_end != NULL)
+        remove_from_page_index(p_tc, p_tu);
+    p_tu->p_src_start = p_src_start;
+    p_tu->p_src_end = p_src_end;
+    for (uint64_t page = (uint64_t) p_src_start / GUEST_PAGE_SIZE;
+         (page <= ((uint64_t) p_src_end - 1) / GUEST_PAGE_SIZE) && (page < NUM_GUEST_PAGES);
+         page++) {
+        ALLOC_RECORD(&p_tc->p_free_refs, p_ref);
+        if (p_ref == NULL)
+            return false;
+        p_ref->p_tu = p_tu;
+        p_ref->p_next = p_tc->p_page_tus[page];
+        p_tc->p_page_tus[page] = p_ref;
+        if (!p_tc->page_protected[page] && (p_tc->page_invalidations[page] < MAX_PAGE_INVALIDATIONS)) {
+            DEBUG("write-protecting guest page at 0x%lx", page * GUEST_PAGE_SIZE);
+            if (mprotect((void *) (page * GUEST_PAGE_SIZE), GUEST_PAGE_SIZE, PROT_READ) == -1) {
+                ERROR("could not write-protect guest page at 0x%lx: %s", page * GUEST_PAGE_SIZE, strerror(errno));
+                return false;
+            }
+            p_tc->page_protected[page] = true;
+        }
+    }
+    return true;
+}
+
+
+// handle a write to a guest page, that is invalidate all TUs overlapping the page and remove
+// the write protection, returns false if the page has not been write-protected by the cache
+// (the write is then a genuine access violation)
+// This function is called from the SIGSEGV handler, so it must be async-signal-safe: it only records
+// the write, which is logged later by tc_log_smc_writes(). The TU that did the write may be among the
+// invalidated ones - its translated code continues to run until the end of the TU because only
+// the jumps to it are redirected to its stub.
+bool tc_handle_write(TranslationCache *p_tc, const uint8_t *p_addr)
+{
+    uint64_t page = (uint64_t) p_addr / GUEST_PAGE_SIZE;
+
+    if ((page >= NUM_GUEST_PAGES) || !p_tc->page_protected[page])
+        return false;
+    while (p_tc->p_page_tus[page] != NULL) {
+        TranslationUnit *p_tu = p_tc->p_page_tus[page]->p_tu;
+        remove_from_page_index(p_tc, p_tu);
+        unchain_tu(p_tc, p_tu);
+        ++p_tc->num_invalidated_tus;
+    }
+    // the guest gets terminated if this fails, as with any other access violation
+    if (mprotect((void *) (page * GUEST_PAGE_SIZE), GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE) == -1)
+        return false;
+    p_tc->page_protected[page] = false;
+    p_tc->smc_writes[p_tc->num_smc_faults % SMC_LOG_SIZE] =
+        (SmcWrite) {p_addr, ++p_tc->page_invalidations[page] == MAX_PAGE_INVALIDATIONS};
+    // the record must be complete before it is counted, in case the handler interrupts tc_log_smc_writes()
+    atomic_signal_fence(memory_order_release);
+    ++p_tc->num_smc_faults;
+    return true;
+}
+
+
+// log the writes to write-protected guest pages recorded by tc_handle_write() (on the guest thread,
+// while it is not running guest code)
+void tc_log_smc_writes(TranslationCache *p_tc)
+{
+    uint32_t num_faults = p_tc->num_smc_faults;
+    atomic_signal_fence(memory_order_acquire);
+    if (num_faults - p_tc->num_smc_logged > SMC_LOG_SIZE) {
+        DEBUG("%u writes to pages with translated code have not been logged", num_faults - p_tc->num_smc_logged - SMC_LOG_SIZE);
+        p_tc->num_smc_logged = num_faults - SMC_LOG_SIZE;
+    }
+    for (; p_tc->num_smc_logged != num_faults; p_tc->num_smc_logged++) {
+        const SmcWrite *p_write = &p_tc->smc_writes[p_tc->num_smc_logged % SMC_LOG_SIZE];
+        DEBUG("guest wrote to address %p on a page with translated code", p_write->p_addr);
+        if (p_write->is_last)
+            WARN("guest page at 0x%lx is written to frequently, modifications of the code on it will not be detected any more",
+                 (uint64_t) p_write->p_addr / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE);
     }
-    return (uint8_t *) *pp_curr_node;
 }
 #pragma GCC diagnostic pop
 
 
+//
+// The following functions implement the persistent cache. The translated code, the TUs and
+// the jumps between them are saved to a file when the guest terminates, and loaded from this
+// file when the same program is run again, so that nothing needs to be translated then. This
+// works without any relocations because the translated code lives at a fixed address
+// (CODE_AREA_ADDRESS), the dispatcher has the same address in every run, and all other
+// addresses the code uses (guest memory, library jump tables, ABS_EXEC_BASE) are fixed as well.
+// The file is only used if it has been created for the same program image by the same vadm
+// executable (because the translated code depends on both), using the same CPU features.
+//
+
+// load the cache from the file, returns false if the file does not exist or is invalid
+static bool load_file(TranslationCache *p_tc)
+{
+    int fd;
+    struct stat stat_info;
+    uint8_t *p_data;
+    uint64_t vadm_hash;
+    bool success = false;
+
+    if (!hash_file("/proc/self/exe", &vadm_hash)) {
+        ERROR("could not calculate hash of vadm executable");
+        return false;
+    }
+    if ((fd = open(p_tc->p_fname, O_RDONLY)) == -1) {
+        DEBUG("could not open file '%s': %s", p_tc->p_fname, strerror(errno));
+        return false;
+    }
+    if ((fstat(fd, &stat_info) == -1) || (stat_info.st_size < (off_t) sizeof(TranslationCacheFileHeader))) {
+        close(fd);
+        return false;
+    }
+    if ((p_data = mmap(NULL, stat_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        ERROR("could not memory-map file '%s': %s", p_tc->p_fname, strerror(errno));
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    // validate the file
+    const TranslationCacheFileHeader *p_hdr = (const TranslationCacheFileHeader *) p_data;
+    const uint8_t *p_pos = p_data + sizeof(TranslationCacheFileHeader), *p_eof = p_data + stat_info.st_size;
+    if ((memcmp(p_hdr->magic, TC_FILE_MAGIC, sizeof(p_hdr->magic)) != 0) ||
+        (p_hdr->program_hash != p_tc->program_hash) ||
+        (p_hdr->vadm_hash != vadm_hash) ||
+        (p_hdr->code_area_addr != (uint64_t) p_tc->p_code_area) ||
+        (p_hdr->code_features != p_tc->code_features) ||
+        (p_hdr->code_start_offset != (p_tc->p_first_flushable_byte - p_tc->p_code_area)) ||
+        (p_tc->p_next_free_byte != p_tc->p_first_flushable_byte) ||
+        (p_tc->num_counters != 0) ||
+        (p_hdr->num_counters > MAX_COUNTERS) ||
+        (p_hdr->code_size + p_hdr->num_counters * sizeof(uint32_t) > (size_t) (p_eof - p_pos)) ||
+        (hash_data(p_pos, p_eof - p_pos, HASH_INIT) != p_hdr->checksum)) {
+        DEBUG("file '%s' has not been created for this program / executable or is corrupt", p_tc->p_fname);
+        goto done;
+    }
+    if (!tc_has_space(p_tc, p_hdr->code_size)) {
+        WARN("translated code in file '%s' is larger than the translation cache", p_tc->p_fname);
+        goto done;
+    }
+
+    // copy the translated code and re-create the TUs and the jumps between them
+    uint8_t *p_code;
+    if ((p_code = tc_alloc_code(p_tc, p_hdr->code_size)) == NULL)
+        goto done;
+    memcpy(TC_WRITABLE(p_tc, p_code), p_pos, p_hdr->code_size);
+    p_pos += p_hdr->code_size;
+    memcpy(p_tc->p_counters, p_pos, p_hdr->num_counters * sizeof(uint32_t));
+    p_tc->num_counters = p_hdr->num_counters;
+    p_pos += p_hdr->num_counters * sizeof(uint32_t);
+    uint32_t code_end_offset = p_hdr->code_start_offset + p_hdr->code_size;
+    for (uint32_t i = 0; i < p_hdr->num_tus; i++) {
+        const TranslationCacheFileTU *p_rec = (const TranslationCacheFileTU *) p_pos;
+        TranslationUnit *p_tu;
+        if ((p_eof - p_pos) < (long) (sizeof(TranslationCacheFileTU) + p_rec->num_links * sizeof(uint32_t)) ||
+            (p_rec->stub_offset >= code_end_offset) ||
+            (p_rec->x86_code_offset >= code_end_offset) ||
+            (p_rec->counter_index > p_hdr->num_counters)) {
+            ERROR("invalid TU record in file '%s'", p_tc->p_fname);
+            goto done;
+        }
+        if ((p_tu = tc_add_tu(p_tc, (const uint8_t *) (uint64_t) p_rec->src_addr, p_tc->p_code_area + p_rec->stub_offset)) == NULL)
+            goto done;
+        if (p_rec->counter_index != 0)
+            p_tu->p_counter = &p_tc->p_counters[p_rec->counter_index - 1];
+        if (p_rec->x86_code_offset != 0) {
+            p_tu->p_x86_code = p_tc->p_code_area + p_rec->x86_code_offset;
+            if (!tc_put_addr(p_tc, p_tu->p_src_addr, p_tu->p_x86_code))
+                goto done;
+            if ((p_rec->src_end != 0) &&
+                !tc_protect_tu(p_tc, p_tu, (const uint8_t *) (uint64_t) p_rec->src_start, (const uint8_t *) (uint64_t) p_rec->src_end))
+                goto done;
+        }
+        p_pos += sizeof(TranslationCacheFileTU);
+        for (uint32_t j = 0; j < p_rec->num_links; j++) {
+            uint32_t link_offset = ((const uint32_t *) p_pos)[j];
+            if ((link_offset >= code_end_offset) || !tc_add_link(p_tc, p_tu, (int32_t *) (p_tc->p_code_area + link_offset))) {
+                ERROR("invalid jump in file '%s'", p_tc->p_fname);
+                goto done;
+            }
+        }
+        p_pos += p_rec->num_links * sizeof(uint32_t);
+    }
+    DEBUG("loaded %d TUs (%d bytes of translated code) from file '%s'", p_hdr->num_tus, p_hdr->code_size, p_tc->p_fname);
+    success = true;
+
+done:
+    munmap(p_data, stat_info.st_size);
+    if (!success && (p_tc->p_first_tu != NULL)) {
+        // get rid of whatever we have loaded so far
+        tc_flush(p_tc);
+        p_tc->num_flushes = 0;
+    }
+    return success;
+}
+
+
+// attach file to the cache, the cache is loaded from this file (if it exists and is valid)
+// and will be saved to it by tc_save_file()
+bool tc_attach_file(TranslationCache *p_tc, const char *p_fname, uint64_t program_hash)
+{
+    p_tc->p_fname = p_fname;
+    p_tc->program_hash = program_hash;
+    if (load_file(p_tc)) {
+        INFO("loaded translated code from file '%s'", p_fname);
+        ++p_tc->num_file_hits;
+        return true;
+    }
+    else {
+        INFO("no valid translated code found in file '%s'", p_fname);
+        ++p_tc->num_file_misses;
+        return false;
+    }
+}
+
+
+// write data to the file and update the checksum
+static bool write_data(FILE *p_file, const void *p_data, size_t size, uint64_t *p_checksum)
+{
+    *p_checksum = hash_data(p_data, size, *p_checksum);
+    return (size == 0) || (fwrite(p_data, size, 1, p_file) == 1);
+}
+
+
+// save the cache to the attached file (if any) if any TUs have been translated by this process
+// The file is written under a temporary name and then renamed, so that other processes that
+// run the same program at the same time never see a partially written file.
+bool tc_save_file(TranslationCache *p_tc)
+{
+    char tmp_fname[PATH_MAX];
+    FILE *p_file;
+    TranslationCacheFileHeader hdr;
+    bool success = true;
+
+    if ((p_tc->p_fname == NULL) || (p_tc->num_translated_tus == 0))
+        return true;
+    // some of the code may have been translated from modified source code, which doesn't
+    // match the program image the next time
+    if (p_tc->num_smc_faults > 0) {
+        INFO("program modifies its code - not saving translated code");
+        return true;
+    }
+    if (!hash_file("/proc/self/exe", &hdr.vadm_hash)) {
+        ERROR("could not calculate hash of vadm executable");
+        return false;
+    }
+    snprintf(tmp_fname, PATH_MAX, "%s.%d", p_tc->p_fname, getpid());
+    if ((p_file = fopen(tmp_fname, "wb")) == NULL) {
+        ERROR("could not create file '%s': %s", tmp_fname, strerror(errno));
+        return false;
+    }
+    memcpy(hdr.magic, TC_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.program_hash = p_tc->program_hash;
+    hdr.code_area_addr = (uint64_t) p_tc->p_code_area;
+    hdr.code_features = p_tc->code_features;
+    hdr.code_start_offset = p_tc->p_first_flushable_byte - p_tc->p_code_area;
+    hdr.code_size = p_tc->p_next_free_byte - p_tc->p_first_flushable_byte;
+    hdr.num_tus = 0;
+    hdr.num_links = 0;
+    hdr.num_counters = p_tc->num_counters;
+    hdr.checksum = HASH_INIT;
+    // header gets written again with the correct values at the end
+    success &= fwrite(&hdr, sizeof(hdr), 1, p_file) == 1;
+    success &= write_data(p_file, p_tc->p_first_flushable_byte, hdr.code_size, &hdr.checksum);
+    success &= write_data(p_file, p_tc->p_counters, hdr.num_counters * sizeof(uint32_t), &hdr.checksum);
+    for (TranslationUnit *p_tu = p_tc->p_first_tu; p_tu != NULL; p_tu = p_tu->p_next) {
+        TranslationCacheFileTU rec;
+        rec.src_addr = (uint64_t) p_tu->p_src_addr;
+        rec.stub_offset = p_tu->p_stub - p_tc->p_code_area;
+        rec.x86_code_offset = p_tu->p_x86_code ? p_tu->p_x86_code - p_tc->p_code_area : 0;
+        rec.src_start = (uint64_t) p_tu->p_src_start;
+        rec.src_end = (uint64_t) p_tu->p_src_end;
+        rec.counter_index = p_tu->p_counter ? p_tu->p_counter - p_tc->p_counters + 1 : 0;
+        rec.num_links = 0;
+        for (TranslationUnitLink *p_link = p_tu->p_links; p_link != NULL; p_link = p_link->p_next)
+            ++rec.num_links;
+        success &= write_data(p_file, &rec, sizeof(rec), &hdr.checksum);
+        for (TranslationUnitLink *p_link = p_tu->p_links; p_link != NULL; p_link = p_link->p_next) {
+            uint32_t link_offset = (uint8_t *) p_link->p_offset - p_tc->p_code_area;
+            success &= write_data(p_file, &link_offset, sizeof(link_offset), &hdr.checksum);
+        }
+        ++hdr.num_tus;
+        hdr.num_links += rec.num_links;
+    }
+    success &= fseek(p_file, 0, SEEK_SET) == 0;
+    success &= fwrite(&hdr, sizeof(hdr), 1, p_file) == 1;
+    success &= fclose(p_file) == 0;
+    if (!success || (rename(tmp_fname, p_tc->p_fname) == -1)) {
+        ERROR("could not write file '%s': %s", p_tc->p_fname, strerror(errno));
+        unlink(tmp_fname);
+        return false;
+    }
+    INFO("saved %d TUs (%d bytes of translated code) to file '%s'", hdr.num_tus, hdr.code_size, p_tc->p_fname);
+    return true;
+}
+
+
+//
+// The following functions implement the images of the cache, which contain the code of a whole program
+// translated ahead of time (vadm -a -o). Unlike the persistent cache, whose code is copied into the code
+// area, an image is mapped read-only (so the code is never written to at runtime), and nothing is
+// translated when the program runs from the image. Its code can therefore neither be changed (the jumps
+// between the TUs are chained already, and TUs can't be invalidated, so self-modifying code is not
+// supported) nor flushed, and the targets of indirect branches that have not been found ahead of time
+// can't be executed.
+// The code jumps to the dispatchers and the other helpers in the permanent part of the cache, which
+// are generated at startup, and calls library routines via the jump tables. Both are at the same
+// addresses in every run, so the code needs no relocations. The image records the addresses of the
+// helpers as absolute symbols, and is only used if they are still the same, see tc_load_image().
+//
+
+// sections of an image (in this order) and their names
+enum {SEC_NULL, SEC_TEXT, SEC_INFO, SEC_TUS, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, NUM_IMAGE_SECTIONS};
+static const char image_section_names[] = "\0.text\0.vadm.info\0.vadm.tus\0.symtab\0.strtab\0.shstrtab";
+#define TU_SYMBOL_NAME_SIZE 12          // "tu_" + source address as 8 hex digits + NUL
+
+
+// write data to the file at the given position (writing behind the end of the file leaves a gap filled with zeros)
+static bool write_at(FILE *p_file, long offset, const void *p_data, size_t size)
+{
+    return (fseek(p_file, offset, SEEK_SET) == 0) && ((size == 0) || (fwrite(p_data, size, 1, p_file) == 1));
+}
+
+
+// save the cache as an image, the flushable part of the code area must start on a page boundary (see
+// tc_align_flushable()) because it is mapped at the same address when the image is loaded
+bool tc_save_image(TranslationCache *p_tc, const char *p_fname, const RuntimeSymbol *p_symbols, int num_symbols)
+{
+    char tmp_fname[PATH_MAX];
+    FILE *p_file;
+    TranslationCacheImageInfo info;
+    TranslationCacheImageTU *p_tus = NULL;
+    Elf64_Sym *p_syms = NULL;
+    char *p_strtab = NULL;
+    uint32_t num_tus = 0, num_syms = 1, strtab_size = 1;
+    bool success = false;
+
+    if ((uintptr_t) p_tc->p_first_flushable_byte % TC_IMAGE_PAGE_SIZE != 0) {
+        ERROR("translated code does not start on a page boundary");
+        return false;
+    }
+    if (!hash_file("/proc/self/exe", &info.vadm_hash)) {
+        ERROR("could not calculate hash of vadm executable");
+        return false;
+    }
+    for (TranslationUnit *p_tu = p_tc->p_first_tu; p_tu != NULL; p_tu = p_tu->p_next)
+        ++num_tus;
+    size_t strtab_max_size = 1 + num_tus * TU_SYMBOL_NAME_SIZE;
+    for (int i = 0; i < num_symbols; i++)
+        strtab_max_size += strlen(p_symbols[i].p_name) + 1;
+    if (((p_tus = malloc(num_tus * sizeof(TranslationCacheImageTU) + 1)) == NULL) ||
+        ((p_syms = calloc(1 + num_symbols + num_tus, sizeof(Elf64_Sym))) == NULL) ||
+        ((p_strtab = malloc(strtab_max_size)) == NULL)) {
+        ERROR("could not allocate memory");
+        goto done;
+    }
+
+    // table of the TUs and the symbols, the TUs that have been translated get one for their code
+    p_strtab[0] = '\0';
+    for (int i = 0; i < num_symbols; i++) {
+        p_syms[num_syms].st_name = strtab_size;
+        p_syms[num_syms].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        p_syms[num_syms].st_shndx = SHN_ABS;
+        p_syms[num_syms].st_value = (uint64_t) p_symbols[i].p_addr;
+        strtab_size += sprintf(p_strtab + strtab_size, "%s", p_symbols[i].p_name) + 1;
+        ++num_syms;
+    }
+    num_tus = 0;
+    for (TranslationUnit *p_tu = p_tc->p_first_tu; p_tu != NULL; p_tu = p_tu->p_next) {
+        p_tus[num_tus++] = (TranslationCacheImageTU) {
+            (uint64_t) p_tu->p_src_addr, (uint64_t) p_tu->p_stub, (uint64_t) p_tu->p_x86_code
+        };
+        if (p_tu->p_x86_code != NULL) {
+            p_syms[num_syms].st_name = strtab_size;
+            p_syms[num_syms].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+            p_syms[num_syms].st_shndx = SEC_TEXT;
+            p_syms[num_syms].st_value = (uint64_t) p_tu->p_x86_code;
+            strtab_size += sprintf(p_strtab + strtab_size, "tu_%08lx", (uint64_t) p_tu->p_src_addr) + 1;
+            ++num_syms;
+        }
+    }
+
+    // layout of the file: ELF header, program header, translated code (on the next page), the sections
+    // of our own, the symbols, and the section headers at the end
+    uint64_t code_size = p_tc->p_next_free_byte - p_tc->p_first_flushable_byte;
+    Elf64_Shdr shdrs[NUM_IMAGE_SECTIONS] = {
+        [SEC_TEXT]     = {.sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_addr = (uint64_t) p_tc->p_first_flushable_byte,
+                          .sh_offset = TC_IMAGE_PAGE_SIZE, .sh_size = code_size, .sh_addralign = CODE_ALIGNMENT},
+        [SEC_INFO]     = {.sh_type = SHT_PROGBITS, .sh_size = sizeof(info), .sh_addralign = 8},
+        [SEC_TUS]      = {.sh_type = SHT_PROGBITS, .sh_size = num_tus * sizeof(TranslationCacheImageTU), .sh_addralign = 4,
+                          .sh_entsize = sizeof(TranslationCacheImageTU)},
+        [SEC_SYMTAB]   = {.sh_type = SHT_SYMTAB, .sh_size = num_syms * sizeof(Elf64_Sym), .sh_link = SEC_STRTAB, .sh_info = 1,
+                          .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym)},
+        [SEC_STRTAB]   = {.sh_type = SHT_STRTAB, .sh_size = strtab_size, .sh_addralign = 1},
+        [SEC_SHSTRTAB] = {.sh_type = SHT_STRTAB, .sh_size = sizeof(image_section_names), .sh_addralign = 1}
+    };
+    uint32_t name_offset = 0;
+    uint64_t offset = TC_IMAGE_PAGE_SIZE;
+    for (int i = SEC_NULL; i < NUM_IMAGE_SECTIONS; i++) {
+        shdrs[i].sh_name = name_offset;
+        name_offset += strlen(image_section_names + name_offset) + 1;
+        if (i > SEC_TEXT) {
+            offset = (offset + shdrs[i].sh_addralign - 1) & ~(shdrs[i].sh_addralign - 1);
+            shdrs[i].sh_offset = offset;
+        }
+        offset += shdrs[i].sh_size;
+    }
+    offset = (offset + 7) & ~7;
+    Elf64_Ehdr ehdr = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+        .e_type = ET_DYN, .e_machine = EM_X86_64, .e_version = EV_CURRENT, .e_phoff = sizeof(Elf64_Ehdr), .e_shoff = offset,
+        .e_ehsize = sizeof(Elf64_Ehdr), .e_phentsize = sizeof(Elf64_Phdr), .e_phnum = 1, .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = NUM_IMAGE_SECTIONS, .e_shstrndx = SEC_SHSTRTAB
+    };
+    Elf64_Phdr phdr = {
+        .p_type = PT_LOAD, .p_flags = PF_R | PF_X, .p_offset = TC_IMAGE_PAGE_SIZE, .p_vaddr = (uint64_t) p_tc->p_first_flushable_byte,
+        .p_paddr = (uint64_t) p_tc->p_first_flushable_byte, .p_filesz = code_size, .p_memsz = code_size, .p_align = TC_IMAGE_PAGE_SIZE
+    };
+    memcpy(info.magic, TC_IMAGE_MAGIC, sizeof(info.magic));
+    info.program_hash = p_tc->program_hash;
+    info.code_features = p_tc->code_features;
+    info.num_counters = p_tc->num_counters;
+    info.checksum = hash_data(p_tus, shdrs[SEC_TUS].sh_size, hash_data(p_tc->p_first_flushable_byte, code_size, HASH_INIT));
+
+    // written under a temporary name and then renamed, as the persistent cache
+    snprintf(tmp_fname, PATH_MAX, "%s.%d", p_fname, getpid());
+    if ((p_file = fopen(tmp_fname, "wb")) == NULL) {
+        ERROR("could not create file '%s': %s", tmp_fname, strerror(errno));
+        goto done;
+    }
+    success = write_at(p_file, 0, &ehdr, sizeof(ehdr)) &&
+              write_at(p_file, ehdr.e_phoff, &phdr, sizeof(phdr)) &&
+              write_at(p_file, shdrs[SEC_TEXT].sh_offset, p_tc->p_first_flushable_byte, code_size) &&
+              write_at(p_file, shdrs[SEC_INFO].sh_offset, &info, sizeof(info)) &&
+              write_at(p_file, shdrs[SEC_TUS].sh_offset, p_tus, shdrs[SEC_TUS].sh_size) &&
+              write_at(p_file, shdrs[SEC_SYMTAB].sh_offset, p_syms, shdrs[SEC_SYMTAB].sh_size) &&
+              write_at(p_file, shdrs[SEC_STRTAB].sh_offset, p_strtab, strtab_size) &&
+              write_at(p_file, shdrs[SEC_SHSTRTAB].sh_offset, image_section_names, sizeof(image_section_names)) &&
+              write_at(p_file, ehdr.e_shoff, shdrs, sizeof(shdrs));
+    success &= fclose(p_file) == 0;
+    if (!success || (rename(tmp_fname, p_fname) == -1)) {
+        ERROR("could not write file '%s': %s", p_fname, strerror(errno));
+        unlink(tmp_fname);
+        success = false;
+        goto done;
+    }
+    INFO("saved %d TUs (%lu bytes of translated code) to image '%s'", num_tus, code_size, p_fname);
+
+done:
+    free(p_strtab);
+    free(p_syms);
+    free(p_tus);
+    return success;
+}
+
+
+// map the translated code from an image and put its TUs into the cache, which has to be empty (apart from the
+// permanent part, which has to end where the code starts, see tc_align_flushable()), returns false if the
+// image is invalid or has not been created for this program / executable (the cache can't be used then)
+bool tc_load_image(TranslationCache *p_tc, const char *p_fname, uint64_t program_hash, const RuntimeSymbol *p_symbols, int num_symbols)
+{
+    int fd;
+    struct stat stat_info;
+    uint8_t *p_data;
+    uint64_t vadm_hash;
+    bool success = false;
+
+    if (!hash_file("/proc/self/exe", &vadm_hash)) {
+        ERROR("could not calculate hash of vadm executable");
+        return false;
+    }
+    if ((fd = open(p_fname, O_RDONLY)) == -1) {
+        ERROR("could not open file '%s': %s", p_fname, strerror(errno));
+        return false;
+    }
+    if ((fstat(fd, &stat_info) == -1) || (stat_info.st_size < (off_t) sizeof(Elf64_Ehdr))) {
+        ERROR("file '%s' is not an image", p_fname);
+        close(fd);
+        return false;
+    }
+    if ((p_data = mmap(NULL, stat_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        ERROR("could not memory-map file '%s': %s", p_fname, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // validate the headers (an image is only read by us, so everything must be where tc_save_image() has put it)
+    uint64_t file_size = stat_info.st_size;
+    const Elf64_Ehdr *p_ehdr = (const Elf64_Ehdr *) p_data;
+    const Elf64_Phdr *p_phdr = (const Elf64_Phdr *) (p_data + p_ehdr->e_phoff);
+    const Elf64_Shdr *p_shdrs = (const Elf64_Shdr *) (p_data + p_ehdr->e_shoff);
+    if ((memcmp(p_ehdr->e_ident, ELFMAG, SELFMAG) != 0) || (p_ehdr->e_ident[EI_CLASS] != ELFCLASS64) ||
+        (p_ehdr->e_type != ET_DYN) || (p_ehdr->e_machine != EM_X86_64) ||
+        (p_ehdr->e_phnum != 1) || (p_ehdr->e_phoff > file_size) || (file_size - p_ehdr->e_phoff < sizeof(Elf64_Phdr)) ||
+        (p_ehdr->e_shnum != NUM_IMAGE_SECTIONS) || (p_ehdr->e_shoff > file_size) ||
+        (file_size - p_ehdr->e_shoff < sizeof(Elf64_Shdr) * NUM_IMAGE_SECTIONS)) {
+        ERROR("file '%s' is not an image", p_fname);
+        goto done;
+    }
+    for (int i = SEC_NULL; i < NUM_IMAGE_SECTIONS; i++) {
+        if ((p_shdrs[i].sh_offset > file_size) || (p_shdrs[i].sh_size > file_size - p_shdrs[i].sh_offset)) {
+            ERROR("file '%s' is not an image", p_fname);
+            goto done;
+        }
+    }
+    const TranslationCacheImageInfo *p_info = (const TranslationCacheImageInfo *) (p_data + p_shdrs[SEC_INFO].sh_offset);
+    const TranslationCacheImageTU *p_tus = (const TranslationCacheImageTU *) (p_data + p_shdrs[SEC_TUS].sh_offset);
+    const Elf64_Sym *p_syms = (const Elf64_Sym *) (p_data + p_shdrs[SEC_SYMTAB].sh_offset);
+    const char *p_strtab = (const char *) (p_data + p_shdrs[SEC_STRTAB].sh_offset);
+    uint8_t *p_code = (uint8_t *) p_phdr->p_vaddr;
+    uint64_t code_size = p_phdr->p_filesz;
+    uint32_t num_tus = p_shdrs[SEC_TUS].sh_size / sizeof(TranslationCacheImageTU);
+    uint32_t num_syms = p_shdrs[SEC_SYMTAB].sh_size / sizeof(Elf64_Sym);
+    if ((p_shdrs[SEC_INFO].sh_size != sizeof(TranslationCacheImageInfo)) ||
+        (memcmp(p_info->magic, TC_IMAGE_MAGIC, sizeof(p_info->magic)) != 0) ||
+        (p_phdr->p_type != PT_LOAD) || (p_phdr->p_offset % TC_IMAGE_PAGE_SIZE != 0) ||
+        (p_phdr->p_offset > file_size) || (code_size > file_size - p_phdr->p_offset) || (p_phdr->p_memsz != code_size) ||
+        (p_shdrs[SEC_STRTAB].sh_size == 0) || (p_strtab[p_shdrs[SEC_STRTAB].sh_size - 1] != '\0')) {
+        ERROR("file '%s' is not an image or is corrupt", p_fname);
+        goto done;
+    }
+    if ((p_info->program_hash != program_hash) || (p_info->vadm_hash != vadm_hash) ||
+        (p_info->code_features != p_tc->code_features) ||
+        (hash_data(p_tus, p_shdrs[SEC_TUS].sh_size, hash_data(p_data + p_phdr->p_offset, code_size, HASH_INIT)) != p_info->checksum)) {
+        ERROR("image '%s' has not been created for this program / executable or is corrupt", p_fname);
+        goto done;
+    }
+    if ((p_code != p_tc->p_first_flushable_byte) || (p_tc->p_next_free_byte != p_tc->p_first_flushable_byte) ||
+        (p_tc->p_first_tu != NULL) || (p_tc->num_counters != 0) || (p_info->num_counters > MAX_COUNTERS) ||
+        !tc_has_space(p_tc, code_size)) {
+        ERROR("translated code in image '%s' does not fit into the translation cache", p_fname);
+        goto done;
+    }
+    // the code can't be relocated because it is read-only, so the helpers it jumps to must be where they were
+    for (uint32_t i = 1; i < num_syms; i++) {
+        if (p_syms[i].st_shndx != SHN_ABS)
+            continue;
+        const char *p_name = p_syms[i].st_name < p_shdrs[SEC_STRTAB].sh_size ? p_strtab + p_syms[i].st_name : "";
+        int j;
+        for (j = 0; (j < num_symbols) && (strcmp(p_name, p_symbols[j].p_name) != 0); j++)
+            ;
+        if ((j == num_symbols) || (p_syms[i].st_value != (uint64_t) p_symbols[j].p_addr)) {
+            ERROR("image '%s' expects '%s' at address 0x%lx, which is not there", p_fname, p_name, p_syms[i].st_value);
+            goto done;
+        }
+    }
+    for (uint32_t i = 0; i < num_tus; i++) {
+        if ((p_tus[i].stub_addr < (uint64_t) p_code) || (p_tus[i].stub_addr >= (uint64_t) p_code + code_size) ||
+            ((p_tus[i].x86_code_addr != 0) &&
+             ((p_tus[i].x86_code_addr < (uint64_t) p_code) || (p_tus[i].x86_code_addr >= (uint64_t) p_code + code_size)))) {
+            ERROR("invalid TU record in image '%s'", p_fname);
+            goto done;
+        }
+    }
+
+    // map the code (replacing that part of the code area, which is never committed then) and create the TUs
+    if (mmap(p_code, code_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_FIXED, fd, p_phdr->p_offset) == MAP_FAILED) {
+        ERROR("could not map translated code from image '%s': %s", p_fname, strerror(errno));
+        goto done;
+    }
+    p_tc->p_next_free_byte = p_code + ((code_size + TC_IMAGE_PAGE_SIZE - 1) & ~(TC_IMAGE_PAGE_SIZE - 1));
+    p_tc->p_first_flushable_byte = p_tc->p_next_free_byte;
+    if (p_tc->p_committed_end < p_tc->p_next_free_byte)
+        p_tc->p_committed_end = p_tc->p_next_free_byte;
+    p_tc->num_counters = p_info->num_counters;
+    p_tc->program_hash = program_hash;
+    p_tc->is_image = true;
+    for (uint32_t i = 0; i < num_tus; i++) {
+        TranslationUnit *p_tu;
+        if ((p_tu = tc_add_tu(p_tc, (const uint8_t *) (uint64_t) p_tus[i].src_addr, (uint8_t *) (uint64_t) p_tus[i].stub_addr)) == NULL)
+            goto done;
+        if (p_tus[i].x86_code_addr != 0) {
+            p_tu->p_x86_code = (uint8_t *) (uint64_t) p_tus[i].x86_code_addr;
+            if (!tc_put_addr(p_tc, p_tu->p_src_addr, p_tu->p_x86_code))
+                goto done;
+        }
+    }
+    INFO("mapped %d TUs (%lu bytes of translated code) from image '%s'", num_tus, code_size, p_fname);
+    success = true;
+
+done:
+    munmap(p_data, stat_info.st_size);
+    close(fd);
+    return success;
+}
+
+
 //
 // unit tests
 //
@@ -117,28 +1184,309 @@ uint8_t *tc_get_addr(TranslationCache *p_tc, const uint8_t *p_src_addr)
 int main()
 {
     int retval = 0;
-    TranslationCache *p_tc = tc_init();
+    TranslationCache *p_tc = tc_init(2 * CODE_COMMIT_SIZE);
 
-    if (!tc_put_addr(p_tc, (const uint8_t *) 0x5, (const uint8_t *) 0xdeadbeef)) {
-        ERROR("storing address 0x5 failed");
+    if (!tc_put_addr(p_tc, (const uint8_t *) 0x4, (const uint8_t *) 0xdeadbeef)) {
+        ERROR("storing address 0x4 failed");
         ++retval;
     }
     if (!tc_put_addr(p_tc, (const uint8_t *) 0x6, (const uint8_t *) 0xcafebabe)) {
-        ERROR("storing address 0x5 failed");
+        ERROR("storing address 0x6 failed");
+        ++retval;
+    }
+    if (!tc_put_addr(p_tc, (const uint8_t *) 0x1ffffe, (const uint8_t *) 0xfeedface)) {
+        ERROR("storing address 0x1ffffe failed");
+        ++retval;
+    }
+    if (tc_put_addr(p_tc, (const uint8_t *) 0x5, (const uint8_t *) 0xdeadbeef)) {
+        ERROR("storing unaligned address 0x5 succeeded");
+        ++retval;
+    }
+    if (tc_put_addr(p_tc, (const uint8_t *) 0x200000, (const uint8_t *) 0xdeadbeef)) {
+        ERROR("storing out-of-range address 0x200000 succeeded");
         ++retval;
     }
-    if (tc_get_addr(p_tc, (const uint8_t *) 0x5) != (const uint8_t *) 0xdeadbeef) {
-        ERROR("looking up address 0x5 failed");
+    if (tc_get_addr(p_tc, (const uint8_t *) 0x4) != (const uint8_t *) 0xdeadbeef) {
+        ERROR("looking up address 0x4 failed");
         ++retval;
     }
     if (tc_get_addr(p_tc, (const uint8_t *) 0x6) != (const uint8_t *) 0xcafebabe) {
         ERROR("looking up address 0x6 failed");
         ++retval;
     }
-    if (tc_get_addr(p_tc, (const uint8_t *) 0x7) != (const uint8_t *) NULL) {
-        ERROR("looking up address 0x7 succeeded");
+    if (tc_get_addr(p_tc, (const uint8_t *) 0x1ffffe) != (const uint8_t *) 0xfeedface) {
+        ERROR("looking up address 0x1ffffe failed");
+        ++retval;
+    }
+    if (tc_get_addr(p_tc, (const uint8_t *) 0x8) != (const uint8_t *) NULL) {
+        ERROR("looking up address 0x8 succeeded");
+        ++retval;
+    }
+    if (tc_get_addr(p_tc, (const uint8_t *) 0x10000) != (const uint8_t *) NULL) {
+        ERROR("looking up address 0x10000 (page table not allocated) succeeded");
+        ++retval;
+    }
+    if (p_tc->num_page_tbls != 2) {
+        ERROR("expected 2 page tables, got %d", p_tc->num_page_tbls);
+        ++retval;
+    }
+
+    uint8_t *p_block1 = tc_alloc_code(p_tc, 10);
+    tc_make_permanent(p_tc);
+    uint8_t *p_block2 = tc_alloc_code(p_tc, 100);
+    if ((p_block1 != p_tc->p_code_area) || (p_block2 != p_block1 + CODE_ALIGNMENT)) {
+        ERROR("code blocks have not been allocated one after the other");
+        ++retval;
+    }
+    // allocate a block that needs another chunk of memory to be committed and write to it
+    uint8_t *p_block3 = tc_alloc_code(p_tc, CODE_COMMIT_SIZE);
+    if (p_block3 == NULL) {
+        ERROR("allocating block that needs more memory to be committed failed");
+        ++retval;
+    }
+    else {
+        // write through the writable view and check that the data shows up in the executable view
+        memset(TC_WRITABLE(p_tc, p_block3), 0xc3, CODE_COMMIT_SIZE);
+        if ((p_block3[0] != 0xc3) || (p_block3[CODE_COMMIT_SIZE - 1] != 0xc3)) {
+            ERROR("data written to the writable view does not show up in the executable view");
+            ++retval;
+        }
+    }
+    if (tc_has_space(p_tc, CODE_COMMIT_SIZE) || (tc_alloc_code(p_tc, CODE_COMMIT_SIZE) != NULL)) {
+        ERROR("allocating more memory than available in the cache succeeded");
+        ++retval;
+    }
+
+    // set up TU with a jump from another block of code to it, chain and unchain it
+    TranslationUnit *p_tu;
+    uint8_t *p_stub = p_block2, *p_x86_code = p_block2 + 16, *p_jump = p_block2 + 32;
+    if ((p_tu = tc_add_tu(p_tc, (const uint8_t *) 0x100, p_stub)) == NULL) {
+        ERROR("adding TU failed");
+        return ++retval;
+    }
+    if ((tc_get_tu(p_tc, (const uint8_t *) 0x100) != p_tu) || (tc_get_addr(p_tc, (const uint8_t *) 0x100) != p_stub)) {
+        ERROR("looking up TU failed");
+        ++retval;
+    }
+    if (!tc_add_link(p_tc, p_tu, (int32_t *) (p_jump + 1)) || (p_jump + 5 + *((int32_t *) (p_jump + 1)) != p_stub)) {
+        ERROR("adding jump to TU failed");
+        ++retval;
+    }
+    if (!tc_chain_tu(p_tc, p_tu, p_x86_code) ||
+        (p_jump + 5 + *((int32_t *) (p_jump + 1)) != p_x86_code) ||
+        (tc_get_addr(p_tc, (const uint8_t *) 0x100) != p_x86_code)) {
+        ERROR("chaining TU failed");
+        ++retval;
+    }
+    if (!tc_unchain_tu(p_tc, p_tu) ||
+        (p_jump + 5 + *((int32_t *) (p_jump + 1)) != p_stub) ||
+        (tc_get_addr(p_tc, (const uint8_t *) 0x100) != p_stub)) {
+        ERROR("unchaining TU failed");
+        ++retval;
+    }
+
+    // after a flush, the mappings and TUs must be gone and the memory after the permanent block must be reused
+    tc_flush(p_tc);
+    if ((tc_get_addr(p_tc, (const uint8_t *) 0x4) != NULL) || (p_tc->num_page_tbls != 0) || (p_tc->p_first_tu != NULL)) {
+        ERROR("mappings still exist after flush");
+        ++retval;
+    }
+    if ((tc_alloc_code(p_tc, 10) != p_block2) || (p_tc->num_flushes != 1)) {
+        ERROR("memory has not been reused after flush");
+        ++retval;
+    }
+
+    // write-protect the source code of a TU spanning two guest pages, a write to the second page
+    // must unchain the TU and remove it from the page index of both pages
+    uint8_t *p_guest_code;
+    if ((p_guest_code = mmap((void *) 0x100000, 2 * GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for guest code: %s", strerror(errno));
+        return ++retval;
+    }
+    tc_flush(p_tc);
+    p_stub = tc_alloc_code(p_tc, 32);
+    p_tu = tc_add_tu(p_tc, p_guest_code + GUEST_PAGE_SIZE - 4, p_stub);
+    tc_chain_tu(p_tc, p_tu, p_stub + 16);
+    if (!tc_protect_tu(p_tc, p_tu, p_tu->p_src_addr, p_guest_code + GUEST_PAGE_SIZE + 4) ||
+        !p_tc->page_protected[0x100] || !p_tc->page_protected[0x101] ||
+        (p_tc->p_page_tus[0x100] == NULL) || (p_tc->p_page_tus[0x101] == NULL)) {
+        ERROR("write-protecting source code of TU failed");
+        ++retval;
+    }
+    if (tc_handle_write(p_tc, p_guest_code + 2 * GUEST_PAGE_SIZE)) {
+        ERROR("write to page that is not write-protected has been handled");
+        ++retval;
+    }
+    if (!tc_handle_write(p_tc, p_guest_code + GUEST_PAGE_SIZE + 8) ||
+        p_tc->page_protected[0x101] ||
+        (p_tc->p_page_tus[0x100] != NULL) || (p_tc->p_page_tus[0x101] != NULL) ||
+        (p_tu->p_x86_code != NULL) || (tc_get_addr(p_tc, p_tu->p_src_addr) != p_stub)) {
+        ERROR("handling write to write-protected page failed");
+        ++retval;
+    }
+    // the write is only recorded (the handler must not log), and logged later
+    tc_log_smc_writes(p_tc);
+    if ((p_tc->num_smc_faults != 1) || (p_tc->smc_writes[0].p_addr != p_guest_code + GUEST_PAGE_SIZE + 8) ||
+        (p_tc->num_smc_logged != 1)) {
+        ERROR("recording write to write-protected page failed");
+        ++retval;
+    }
+    p_guest_code[GUEST_PAGE_SIZE + 8] = 0;
+    munmap(p_guest_code, 2 * GUEST_PAGE_SIZE);
+    // otherwise the cache would not get saved below
+    p_tc->num_smc_faults = 0;
+    p_tc->num_smc_logged = 0;
+
+    // save a TU with a jump to it to a file and load it again
+    char fname[] = "/tmp/tlcache_test_XXXXXX";
+    close(mkstemp(fname));
+    unlink(fname);
+    tc_flush(p_tc);
+    if (tc_attach_file(p_tc, fname, 0x1234) || (p_tc->num_file_misses != 1)) {
+        ERROR("loading non-existing file succeeded");
+        ++retval;
+    }
+    p_stub = tc_alloc_code(p_tc, 48);
+    p_x86_code = p_stub + 16;
+    p_jump = p_stub + 32;
+    memset(TC_WRITABLE(p_tc, p_stub), 0x90, 48);
+    p_tu = tc_add_tu(p_tc, (const uint8_t *) 0x100, p_stub);
+    tc_add_link(p_tc, p_tu, (int32_t *) (p_jump + 1));
+    tc_chain_tu(p_tc, p_tu, p_x86_code);
+    if (!tc_save_file(p_tc)) {
+        ERROR("saving cache to file failed");
+        ++retval;
+    }
+    tc_flush(p_tc);
+    memset(TC_WRITABLE(p_tc, p_stub), 0, 48);
+    if (!tc_attach_file(p_tc, fname, 0x1234) || (p_tc->num_file_hits != 1)) {
+        ERROR("loading cache from file failed");
+        ++retval;
+    }
+    else if ((tc_get_addr(p_tc, (const uint8_t *) 0x100) != p_x86_code) ||
+             (p_jump + 5 + *((int32_t *) (p_jump + 1)) != p_x86_code) ||
+             (p_stub[0] != 0x90) ||
+             (tc_get_tu(p_tc, (const uint8_t *) 0x100)->p_links == NULL)) {
+        ERROR("cache loaded from file differs from the saved one");
+        ++retval;
+    }
+    tc_flush(p_tc);
+    if (tc_attach_file(p_tc, fname, 0x5678)) {
+        ERROR("loading file created for a different program succeeded");
         ++retval;
     }
+    unlink(fname);
     return retval;
 }
 #endif
+
+
+//
+// benchmark comparing the page table with the binary tree that was used before
+//
+#ifdef BENCHMARK
+#define NUM_BENCH_ADDRS   (1 << 19)     // all 16-bit aligned addresses in the range 0x100000 - 0x1fffff
+#define NUM_BENCH_LOOKUPS (4 << 20)
+
+struct BinaryTreeNode
+{
+    struct BinaryTreeNode *p_left_node;
+    struct BinaryTreeNode *p_right_node;
+};
+typedef struct BinaryTreeNode BinaryTreeNode;
+static uint32_t num_tree_nodes = 1;
+
+
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+static bool bt_put_addr(BinaryTreeNode *p_root_node, const uint8_t *p_src_addr, const uint8_t *p_dst_addr)
+{
+    uint32_t curr_bit = 1 << (NUM_SOURCE_ADDR_BITS - 1);
+    BinaryTreeNode **pp_curr_node = &p_root_node;
+
+    while (curr_bit > 1) {
+        pp_curr_node = ((uint32_t) p_src_addr & curr_bit) ? &((*pp_curr_node)->p_left_node) : &((*pp_curr_node)->p_right_node);
+        if (*pp_curr_node == NULL) {
+            if ((*pp_curr_node = calloc(1, sizeof(BinaryTreeNode))) == NULL)
+                return false;
+            ++num_tree_nodes;
+        }
+        curr_bit >>= 1;
+    }
+    if ((uint32_t) p_src_addr & 1)
+        (*pp_curr_node)->p_left_node = (BinaryTreeNode *) p_dst_addr;
+    else
+        (*pp_curr_node)->p_right_node = (BinaryTreeNode *) p_dst_addr;
+    return true;
+}
+
+
+static uint8_t *bt_get_addr(BinaryTreeNode *p_root_node, const uint8_t *p_src_addr)
+{
+    uint32_t curr_bit = 1 << (NUM_SOURCE_ADDR_BITS - 1);
+    BinaryTreeNode **pp_curr_node = &p_root_node;
+    while (curr_bit) {
+        pp_curr_node = ((uint32_t) p_src_addr & curr_bit) ? &((*pp_curr_node)->p_left_node) : &((*pp_curr_node)->p_right_node);
+        if (*pp_curr_node == NULL)
+                return NULL;
+        curr_bit >>= 1;
+    }
+    return (uint8_t *) *pp_curr_node;
+}
+#pragma GCC diagnostic pop
+
+
+int main()
+{
+    static uint32_t seq_addrs[NUM_BENCH_LOOKUPS], rnd_addrs[NUM_BENCH_LOOKUPS];
+    uint32_t rnd = 0x12345678, i;
+    uint64_t start, t_pt_put, t_pt_seq, t_pt_rnd, t_bt_put, t_bt_seq, t_bt_rnd;
+    uintptr_t sum = 0;
+
+    // build the address lists, the random addresses are generated with a xorshift PRNG
+    for (i = 0; i < NUM_BENCH_LOOKUPS; i++) {
+        seq_addrs[i] = 0x100000 + ((i % NUM_BENCH_ADDRS) << 1);
+        rnd ^= rnd << 13;
+        rnd ^= rnd >> 17;
+        rnd ^= rnd << 5;
+        rnd_addrs[i] = 0x100000 + ((rnd % NUM_BENCH_ADDRS) << 1);
+    }
+
+    TranslationCache *p_tc = tc_init(DEFAULT_CODE_CACHE_SIZE);
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_ADDRS; i++)
+        tc_put_addr(p_tc, (const uint8_t *) (uintptr_t) seq_addrs[i], (const uint8_t *) (uintptr_t) seq_addrs[i]);
+    t_pt_put = get_time_ns() - start;
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_LOOKUPS; i++)
+        sum += (uintptr_t) tc_get_addr(p_tc, (const uint8_t *) (uintptr_t) seq_addrs[i]);
+    t_pt_seq = get_time_ns() - start;
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_LOOKUPS; i++)
+        sum += (uintptr_t) tc_get_addr(p_tc, (const uint8_t *) (uintptr_t) rnd_addrs[i]);
+    t_pt_rnd = get_time_ns() - start;
+
+    BinaryTreeNode *p_root_node = calloc(1, sizeof(BinaryTreeNode));
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_ADDRS; i++)
+        bt_put_addr(p_root_node, (const uint8_t *) (uintptr_t) seq_addrs[i], (const uint8_t *) (uintptr_t) seq_addrs[i]);
+    t_bt_put = get_time_ns() - start;
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_LOOKUPS; i++)
+        sum -= (uintptr_t) bt_get_addr(p_root_node, (const uint8_t *) (uintptr_t) seq_addrs[i]);
+    t_bt_seq = get_time_ns() - start;
+    start = get_time_ns();
+    for (i = 0; i < NUM_BENCH_LOOKUPS; i++)
+        sum -= (uintptr_t) bt_get_addr(p_root_node, (const uint8_t *) (uintptr_t) rnd_addrs[i]);
+    t_bt_rnd = get_time_ns() - start;
+
+    INFO("%d mappings, %d lookups (checksum %lu, must be 0)", NUM_BENCH_ADDRS, NUM_BENCH_LOOKUPS, sum);
+    INFO("                   insert    sequential lookup    random lookup    memory");
+    INFO("page table     %7.1f ns         %7.1f ns       %7.1f ns    %6lu KB",
+         (double) t_pt_put / NUM_BENCH_ADDRS, (double) t_pt_seq / NUM_BENCH_LOOKUPS, (double) t_pt_rnd / NUM_BENCH_LOOKUPS,
+         (sizeof(TranslationCache) + p_tc->num_page_tbls * sizeof(TranslationCachePageTbl)) / 1024);
+    INFO("binary tree    %7.1f ns         %7.1f ns       %7.1f ns    %6lu KB",
+         (double) t_bt_put / NUM_BENCH_ADDRS, (double) t_bt_seq / NUM_BENCH_LOOKUPS, (double) t_bt_rnd / NUM_BENCH_LOOKUPS,
+         num_tree_nodes * sizeof(BinaryTreeNode) / 1024);
+    return sum != 0;
+}
+#endif
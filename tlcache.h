@@ -7,43 +7,247 @@
 #define TLCACHE_H_INCLUDED
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // constants
-#define MAX_CODE_SIZE   65536
-#define MAX_CODE_BLOCK_SIZE 1024
-#ifdef TEST
-    #define NUM_SOURCE_ADDR_BITS 3
-#else
-    #define NUM_SOURCE_ADDR_BITS 21
-#endif
+#define CODE_AREA_ADDRESS 0x10000000            // fixed address of the translated code, so that it can be saved and reused
+#define COUNTER_AREA_ADDRESS 0x08000000         // fixed address of the execution counters of the TUs, below 2GB
+                                                // so that the code can access them with 32-bit absolute addresses
+#define MAX_COUNTERS    (1 << 22)               // maximum number of execution counters
+#define INDIRECT_CACHE_ADDRESS 0x0e000000       // fixed address of the cache for the targets of indirect branches, below
+                                                // 2GB as well, so that the translated code can probe it with absolute addresses
+#define NUM_INDIRECT_ENTRIES (1 << 15)          // number of entries in this cache, indexed with bits 1-15 of the source address
+#define MAX_INDIRECT_SITES   4096               // maximum number of indirect branches whose hit rate is logged
+#define MAX_CODE_SIZE   (256 << 20)             // size of the address range reserved for translated code
+#define DEFAULT_CODE_CACHE_SIZE (16 << 20)      // default for the maximum amount of memory used for translated code
+#define CODE_COMMIT_SIZE 65536                  // granularity in which memory is committed
+#define TC_FEATURE_MOVBE 0x01                   // translated code uses MOVBE for the accesses to guest memory
+#define CODE_ALIGNMENT  16                      // alignment of the code blocks handed out by tc_alloc_code()
+#define NUM_SOURCE_ADDR_BITS 21                 // size of the guest address space covered by the cache
+#define NUM_PAGE_TBL_BITS    10                 // bits of the slot number used as index into a page table
+#define NUM_PAGE_DIR_BITS    (NUM_SOURCE_ADDR_BITS - 1 - NUM_PAGE_TBL_BITS)
+#define PAGE_TBL_SIZE        (1 << NUM_PAGE_TBL_BITS)
+#define PAGE_DIR_SIZE        (1 << NUM_PAGE_DIR_BITS)
+#define GUEST_PAGE_SIZE      4096               // granularity of the detection of self-modifying code
+#define NUM_GUEST_PAGES      ((1 << NUM_SOURCE_ADDR_BITS) / GUEST_PAGE_SIZE)
+#define MAX_PAGE_INVALIDATIONS 16               // number of invalidations after which a page is no longer protected
+#define SMC_LOG_SIZE         64                 // number of writes to translated code recorded for logging
+#define NUM_TIERS            2                  // tier 0 = quick translation, tier 1 = optimized translation of hot TUs
 
 // structures to implement the translation cache
-struct TranslationCacheNode
+struct TranslationUnitLink
 {
-    struct TranslationCacheNode *p_left_node;
-    struct TranslationCacheNode *p_right_node;
+    int32_t *p_offset;                          // position of the 32-bit offset of the jump instruction
+    struct TranslationUnitLink *p_next;         // next jump to the same TU
 };
-typedef struct TranslationCacheNode TranslationCacheNode;
+typedef struct TranslationUnitLink TranslationUnitLink;
+struct TranslationUnit
+{
+    const uint8_t *p_src_addr;                  // source address of the TU
+    const uint8_t *p_src_start;                 // start and end of the range of source code
+    const uint8_t *p_src_end;                   // covered by the TU (once translated)
+    uint8_t *p_stub;                            // address of the stub
+    uint8_t *p_x86_code;                        // address of the translated code, NULL if not yet translated
+    uint32_t *p_counter;                        // execution counter of the TU, NULL if it has none
+    bool     is_speculative;                    // translated ahead of execution by the speculative translator
+    bool     is_published;                      // stub jumps to the translated code, but the jumps to the TU
+                                                // haven't been chained yet (see tc_publish_tu())
+    TranslationUnitLink *p_links;               // jumps in other TUs (or this TU) to this TU
+    struct TranslationUnit *p_next;             // next TU in the list of all TUs in the cache
+};
+typedef struct TranslationUnit TranslationUnit;
+// entry of the cache for the targets of indirect branches (direct-mapped, the translated code looks
+// the entries up itself, see emit_indirect_target() in translate.c)
+typedef struct
+{
+    uint32_t ie_src_addr;                       // source address, odd (never matches) if the entry is empty
+    uint32_t ie_dst_addr;                       // destination address (the code area is below 4GB)
+} IndirectCacheEntry;
+// indirect branch in the translated code, whose probes of this cache are counted
+typedef struct
+{
+    const uint8_t *p_src_addr;                  // source address of the branch instruction
+    uint32_t *p_counts;                         // number of hits and misses (two counters in the counter area)
+} IndirectSite;
+struct TranslationUnitRef
+{
+    TranslationUnit *p_tu;                      // TU whose source code overlaps the guest page
+    struct TranslationUnitRef *p_next;          // next TU overlapping the same page
+};
+typedef struct TranslationUnitRef TranslationUnitRef;
+// write to a write-protected guest page, recorded by tc_handle_write() and logged later (it is called from the
+// SIGSEGV handler, which must not log anything itself), see tc_log_smc_writes()
+typedef struct
+{
+    const uint8_t *p_addr;                      // address written to
+    bool     is_last;                           // page is not write-protected any more from now on
+} SmcWrite;
+typedef struct
+{
+    uint8_t *p_dst_addr;                        // destination address
+    TranslationUnit *p_tu;                      // TU starting at the source address (if set up with tc_add_tu())
+} TranslationCacheSlot;
+typedef struct
+{
+    TranslationCacheSlot slots[PAGE_TBL_SIZE];  // one slot per 16-bit aligned source address
+} TranslationCachePageTbl;
 struct TranslationCache
 {
-    TranslationCacheNode *p_root_node;  // root node of the binary tree used to look up addresses
-    uint8_t *p_first_code_block;        // pointer to first code block in the cache
-    uint8_t *p_next_code_block;         // pointer to next code block we will hand out
+    TranslationCachePageTbl *p_page_dir[PAGE_DIR_SIZE];    // page directory used to look up addresses
+    uint32_t num_page_tbls;             // number of page tables allocated so far
+    TranslationUnitRef *p_page_tus[NUM_GUEST_PAGES];   // TUs overlapping each guest page (the page index)
+    bool     page_protected[NUM_GUEST_PAGES];          // guest page is write-protected
+    uint8_t  page_invalidations[NUM_GUEST_PAGES];      // number of times the TUs on the page have been invalidated
+    TranslationUnit *p_first_tu;        // list of all TUs in the cache
+    TranslationUnit *p_free_tus;        // TUs, jumps and page index entries discarded by flushes, they are
+    TranslationUnitLink *p_free_links;  // reused instead of allocating new ones (translating the code again
+    TranslationUnitRef *p_free_refs;    // after a flush then doesn't call malloc() / free() at all)
+    uint8_t *p_code_area;               // pointer to the memory area for the translated code (executable view)
+    ptrdiff_t writable_offset;          // offset of the writable view of this area from the executable one
+    uint8_t *p_next_free_byte;          // pointer to the next free byte in this area
+    uint8_t *p_first_flushable_byte;    // start of the part of this area that gets flushed
+    uint8_t *p_committed_end;           // end of the part of this area that is committed
+    size_t   code_cache_size;           // maximum amount of memory used for translated code
+    uint32_t *p_counters;               // memory area for the execution counters
+    uint32_t num_counters;              // number of execution counters allocated so far
+    uint32_t counter_start_value;       // initial value of the execution counters
+    IndirectCacheEntry *p_indirect_cache;   // memory area for the cache for the targets of indirect branches
+    IndirectSite indirect_sites[MAX_INDIRECT_SITES];    // indirect branches in the translated code...
+    uint32_t num_indirect_sites;        // ... and their number
+    uint32_t num_published_tus;         // number of TUs published but not chained yet
+    uint32_t num_flushes;               // number of times the cache has been flushed
+    uint32_t num_translated_tus;        // number of TUs translated by this process
+    uint32_t num_tier_tus[NUM_TIERS];   // number of these TUs per tier...
+    uint32_t tier_code_size[NUM_TIERS]; // ... and the size of their translated code
+    uint32_t num_eliminated_insns;      // number of instructions eliminated by tier 1
+    uint32_t num_peephole_bytes;        // number of bytes of translated code...
+    uint32_t num_peephole_insns;        // ... and of x86 instructions saved by the peephole optimizer
+    uint32_t num_bound_calls;           // number of library calls bound to direct calls of their entries in the jump tables...
+    uint32_t num_guarded_calls;         // ... and how many of them check A6 first
+    uint32_t num_smc_faults;            // number of writes to write-protected guest pages
+    uint32_t num_invalidated_tus;       // number of TUs invalidated because of these writes
+    SmcWrite smc_writes[SMC_LOG_SIZE];  // the last of these writes (indexed by num_smc_faults)...
+    uint32_t num_smc_logged;            // ... and how many writes have been logged so far
+    uint32_t num_spec_tus;              // number of TUs translated ahead of execution by the speculative translator...
+    uint32_t num_spec_hits;             // ... how many of them have been executed (counted when they are discarded)...
+    uint32_t num_spec_discarded;        // ... and translations it has discarded (source code modified while translating)
+    uint32_t num_spec_dropped;          // number of TUs it has not translated (queue full, or too little space in the cache)
+    uint32_t num_guest_translations;    // number of times the guest had to wait for the translation of a TU
+    uint32_t num_return_misses;         // number of returns the shadow stack has not predicted...
+    uint32_t num_return_resyncs;        // ... and how many of them matched an entry further down
+    uint64_t num_indirect_hits;         // number of hits and misses in the cache for the targets of indirect branches
+    uint64_t num_indirect_misses;       // (of the branches discarded by flushes, the others are still counting)
+    const char *p_fname;                // file the cache is loaded from / saved to, NULL if not persistent
+    uint64_t program_hash;              // hash of the program image
+    uint32_t code_features;             // CPU features the translated code uses (TC_FEATURE_*)
+    uint32_t num_file_hits;             // number of times the cache has been loaded from the file...
+    uint32_t num_file_misses;           // ... or could not be loaded (file missing or invalid)
+    bool     is_image;                  // translated code has been mapped from an image, it can't be changed
+                                        // and nothing is translated anymore (see tc_load_image())
 };
 typedef struct TranslationCache TranslationCache;
 
+// layout of the file the cache is saved to: header, translated code, execution counters, one record for each
+// TU followed by the offsets of the jumps to this TU (all offsets relative to CODE_AREA_ADDRESS)
+#define TC_FILE_MAGIC "VADMTC04"
+typedef struct
+{
+    char     magic[8];                  // TC_FILE_MAGIC
+    uint64_t program_hash;              // hash of the program image the code has been translated from
+    uint64_t vadm_hash;                 // hash of the vadm executable that has translated the code
+    uint64_t code_area_addr;            // address of the memory area for the translated code
+    uint32_t code_start_offset;         // offset of the translated code (after the permanent part)
+    uint32_t code_size;                 // size of the translated code
+    uint32_t num_tus;                   // number of TU records
+    uint32_t num_links;                 // total number of jumps
+    uint32_t num_counters;              // number of execution counters (following the translated code)
+    uint32_t code_features;             // CPU features the translated code uses, the CPU must have them as well
+    uint64_t checksum;                  // hash of everything following the header
+} TranslationCacheFileHeader;
+typedef struct
+{
+    uint32_t src_addr;                  // source address of the TU
+    uint32_t stub_offset;               // offset of the stub
+    uint32_t x86_code_offset;           // offset of the translated code, 0 if not yet translated
+    uint32_t src_start;                 // range of source code covered by the TU,
+    uint32_t src_end;                   // both 0 if not yet translated
+    uint32_t counter_index;             // index of the execution counter + 1, 0 if the TU has none
+    uint32_t num_links;                 // number of jumps to this TU
+} TranslationCacheFileTU;
+
+// An image of the cache (see tc_save_image()) is an ELF shared object whose only segment is the translated code, mapped
+// at the address it has been translated for. Besides the usual sections for the code and the symbols (one per translated
+// TU, and absolute ones for the entry points in the permanent part of the cache the code jumps to) it has two sections
+// of its own, with the header below and the table mapping the source addresses of the TUs to their code.
+#define TC_IMAGE_MAGIC "VADMIM01"
+#define TC_IMAGE_PAGE_SIZE 4096         // alignment of the segment in the file and in memory
+typedef struct
+{
+    char     magic[8];                  // TC_IMAGE_MAGIC
+    uint64_t program_hash;              // as in TranslationCacheFileHeader
+    uint64_t vadm_hash;
+    uint32_t code_features;
+    uint32_t num_counters;              // number of execution counters the code uses
+    uint64_t checksum;                  // hash of the translated code and the table of the TUs
+} TranslationCacheImageInfo;
+typedef struct
+{
+    uint32_t src_addr;                  // source address of the TU
+    uint32_t stub_addr;                 // address of the stub...
+    uint32_t x86_code_addr;             // ... and of the translated code, 0 if it could not be translated
+} TranslationCacheImageTU;
+// entry point in the permanent part of the cache, see get_runtime_symbols() in translate.c
+typedef struct
+{
+    const char *p_name;
+    const uint8_t *p_addr;
+} RuntimeSymbol;
+
+// get the address in the writable view of the code area that corresponds to an address in the
+// executable view (all code is written through the writable view, all addresses handed out by
+// the cache and used in jumps are in the executable view)
+#define TC_WRITABLE(p_tc, p_addr) ((uint8_t *) (p_addr) + (p_tc)->writable_offset)
+
 // global translation cache object, used by the modules translate.c and execute.c
 extern TranslationCache *gp_tlcache;
 
 // prototypes
-TranslationCache *tc_init();
-uint8_t *tc_get_code_block(TranslationCache *p_tc);
+TranslationCache *tc_init(size_t code_cache_size);
+uint8_t *tc_alloc_code(TranslationCache *p_tc, size_t size);
+bool tc_has_space(TranslationCache *p_tc, size_t size);
+uint32_t *tc_alloc_counters(TranslationCache *p_tc, uint32_t num, uint32_t value);
+void tc_add_indirect_site(TranslationCache *p_tc, const uint8_t *p_src_addr, uint32_t *p_counts);
+void tc_put_indirect(TranslationCache *p_tc, const uint8_t *p_src_addr, const uint8_t *p_dst_addr);
+void tc_make_permanent(TranslationCache *p_tc);
+void tc_flush(TranslationCache *p_tc);
+void tc_log_stats(TranslationCache *p_tc);
+bool tc_protect_tu(TranslationCache *p_tc, TranslationUnit *p_tu, const uint8_t *p_src_start, const uint8_t *p_src_end);
+bool tc_handle_write(TranslationCache *p_tc, const uint8_t *p_addr);
+void tc_log_smc_writes(TranslationCache *p_tc);
+bool tc_attach_file(TranslationCache *p_tc, const char *p_fname, uint64_t program_hash);
+bool tc_save_file(TranslationCache *p_tc);
+bool tc_align_flushable(TranslationCache *p_tc);
+bool tc_save_image(TranslationCache *p_tc, const char *p_fname, const RuntimeSymbol *p_symbols, int num_symbols);
+bool tc_load_image(TranslationCache *p_tc, const char *p_fname, uint64_t program_hash, const RuntimeSymbol *p_symbols, int num_symbols);
 bool tc_put_addr(TranslationCache *p_tc, const uint8_t *p_src_addr, const uint8_t *p_dst_addr);
 uint8_t *tc_get_addr(TranslationCache *p_tc, const uint8_t *p_src_addr);
+TranslationUnit *tc_add_tu(TranslationCache *p_tc, const uint8_t *p_src_addr, uint8_t *p_stub);
+TranslationUnit *tc_get_tu(TranslationCache *p_tc, const uint8_t *p_src_addr);
+bool tc_add_link(TranslationCache *p_tc, TranslationUnit *p_tu, int32_t *p_offset);
+bool tc_chain_tu(TranslationCache *p_tc, TranslationUnit *p_tu, uint8_t *p_x86_code);
+bool tc_publish_tu(TranslationCache *p_tc, TranslationUnit *p_tu, uint8_t *p_x86_code);
+void tc_chain_published_tus(TranslationCache *p_tc);
+bool tc_unchain_tu(TranslationCache *p_tc, TranslationUnit *p_tu);
 
 #endif  // TLCACHE_H_INCLUDED
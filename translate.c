@@ -6,11 +6,26 @@
 // 
 
 
+#include <cpuid.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+
 #include "codegen.h"
 #include "translate.h"
 #include "tlcache.h"
 #include "vadm.h"
 #include "util.h"
+#ifndef GENERATE_OPCODE_TBL
+#include "opcode_index_tbl.h"   // generated at build time, see init_opc_info_lookup_tbl()
+#else
+static const uint8_t opcode_index_tbl[0x10000];     // mkopctbl builds the table itself and doesn't translate anything
+#endif
 
 
 // TODO: adapt to naming convention (prefix pointers with p_ and pp_)
@@ -18,7 +33,6 @@
 //
 // utility routines
 //
-// TODO: use macros from codegen.c
 
 // read one word from buffer and advance current position pointer
 static uint16_t read_word(const uint8_t **pos)
@@ -36,23 +50,120 @@ static uint32_t read_dword(const uint8_t **pos)
     return val;
 }
 
-// write one byte into buffer and advance current position pointer
-static void write_byte(uint8_t val, uint8_t **pos)
+// Several threads may translate TUs at the same time (see translate_program()). All state of a
+// translation is thread-local, so they lower the code and generate the translated code in their
+// own buffers, and only need to hold the lock while they change the cache. They take the memory
+// for the translated code and the execution counters from their own arenas (blocks taken from the
+// cache in one go), so only refilling an arena needs the lock, and the TUs a TU jumps to are set up
+// all at once when its code is installed (see install_code()). Apart from taking
+// the next TU from the list, the lock is taken only once per TU, to install its code.
+static bool is_parallel = false;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define AOT_ARENA_SIZE (16 * MAX_TU_SIZE)       // size of the blocks of the code area taken for the arenas...
+#define AOT_COUNTER_BATCH 256                   // ... and number of counters taken at a time
+typedef struct
+{
+    uint8_t  *p_next_code;              // free part of the block of the code area
+    uint8_t  *p_code_end;
+    uint32_t *p_next_counter;           // free part of the block of counters
+    uint32_t *p_counter_end;
+} Arena;
+static __thread Arena arena;
+static uint64_t num_cache_locks;                // number of times the lock has been taken (for the benchmark)
+
+static inline void lock_cache()
 {
-    *((uint8_t *) *pos) = val;
-    *pos += 1;
+    if (is_parallel) {
+        pthread_mutex_lock(&cache_lock);
+        ++num_cache_locks;
+    }
 }
 
-// write one dword into buffer and advance current position pointer
-static void write_dword(uint32_t val, uint8_t **pos)
+static inline void unlock_cache()
 {
-    *((uint32_t *) *pos) = val;
-    *pos += 4;
+    if (is_parallel)
+        pthread_mutex_unlock(&cache_lock);
+}
+
+// space in the cache needed for the translated code of a TU and the stubs of all TUs it jumps to
+#define MAX_TU_SPACE (MAX_TU_SIZE + MAX_FIXUPS_PER_TU * ((STUB_SIZE + CODE_ALIGNMENT - 1) & ~(CODE_ALIGNMENT - 1)))
+
+// allocate execution counters (with the tier 1 threshold as initial value), from the arena if several
+// threads are translating, returns NULL if there are no more counters
+static uint32_t *alloc_counters(uint32_t num)
+{
+    if (!is_parallel)
+        return tc_alloc_counters(gp_tlcache, num, g_tier1_threshold);
+    if ((uint32_t) (arena.p_counter_end - arena.p_next_counter) < num) {
+        lock_cache();
+        uint32_t batch = AOT_COUNTER_BATCH;
+        if ((arena.p_next_counter = tc_alloc_counters(gp_tlcache, batch, g_tier1_threshold)) == NULL) {
+            // the last counters are taken as they are needed
+            batch = num;
+            arena.p_next_counter = tc_alloc_counters(gp_tlcache, batch, g_tier1_threshold);
+        }
+        unlock_cache();
+        if (arena.p_next_counter == NULL) {
+            arena.p_counter_end = NULL;
+            return NULL;
+        }
+        arena.p_counter_end = arena.p_next_counter + batch;
+    }
+    arena.p_next_counter += num;
+    return arena.p_next_counter - num;
+}
+
+// jumps from the TU currently being translated to other TUs, see write_jump_offset()
+static __thread Fixup fixups[MAX_FIXUPS_PER_TU];
+static __thread int num_fixups;
+
+// write 32-bit offset of a relative jump to another TU into buffer, return the new position or NULL on error
+// The code of a TU is generated in a buffer and only copied to its final location in the
+// translation cache when it is complete, so we can't calculate the offset here. Instead, we
+// record the position of the offset and the source address of the TU the jump goes to, and
+// install_code() sets up the TU and fills in the offset later.
+static uint8_t *write_jump_offset(uint8_t *p_pos, const uint8_t *p_m68k_target)
+{
+    if (num_fixups == MAX_FIXUPS_PER_TU) {
+        ERROR("too many jumps to other TUs in this TU");
+        return NULL;
+    }
+    fixups[num_fixups].p_field = p_pos;
+    fixups[num_fixups].p_target = p_m68k_target;
+    ++num_fixups;
+    WRITE_DWORD(p_pos, 0);
+    return p_pos;
+}
+
+// indirect branch at the end of the TU currently being translated (p_counts is NULL if there is none),
+// see emit_indirect_target()
+static __thread IndirectSite indirect_site;
+
+// calls (and jumps) from the TU currently being translated to library routines and to code shared
+// by all TUs (like the shadow stack helpers), see write_call_offset()
+static __thread Fixup call_fixups[MAX_FIXUPS_PER_TU];
+static __thread int num_call_fixups;
+
+// write 32-bit offset of a relative call to an entry in a jump table into buffer, return the new position or NULL on error
+// Like with the jumps to other TUs, the offset is filled in when the code has been copied to its
+// final location, but the target is known already, so install_code() can just calculate it.
+static uint8_t *write_call_offset(uint8_t *p_pos, const uint8_t *p_entry)
+{
+    if (num_call_fixups == MAX_FIXUPS_PER_TU) {
+        ERROR("too many calls of library routines and shared code in this TU");
+        return NULL;
+    }
+    call_fixups[num_call_fixups].p_field = p_pos;
+    call_fixups[num_call_fixups].p_target = p_entry;
+    ++num_call_fixups;
+    WRITE_DWORD(p_pos, 0);
+    return p_pos;
 }
 
 // extract operand from instruction stream and fill Operand structure, return number of bytes used
 static int extract_operand(uint8_t mode_reg, const uint8_t **pos, Operand *op)
 {
+    op->op_base = op->op_index = NO_REG;
     if ((mode_reg & 0xf8) == 0) {
         op->op_type = OP_DREG;
         op->op_length = 4;
@@ -76,7 +187,7 @@ static int extract_operand(uint8_t mode_reg, const uint8_t **pos, Operand *op)
     }
     else if (mode_reg == 0x38) {
         op->op_type = OP_MEM;
-        op->op_length = 2;
+        op->op_length = 4;
         op->op_value = (uint32_t) read_word(pos);
         DEBUG("operand is 16-bit address 0x%04x", (uint16_t) op->op_value);
         return 2;
@@ -111,13 +222,48 @@ static int extract_operand(uint8_t mode_reg, const uint8_t **pos, Operand *op)
 // explanation of REX prefix: https://www-user.tu-chemnitz.de/~heha/viewchm.php/hs/x86.chm/x64.htm
 // Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, Appendix B, Instruction Formats And Encodings
 //
+// Like the emit_* routines in codegen.c, they take the current position in the buffer and
+// return the new one, so that the compiler can keep it in a register.
 // TODO: use emit_* routines from codegen.c
+//
+// The memory of the guest is big-endian, so words and longs are byte-swapped when they are moved
+// between memory and a register, with MOVBE if the CPU supports it (checked once by
+// setup_dispatchers()), and with BSWAP (ROL by 8 for words) after a load / around a store otherwise.
+//
+bool g_use_movbe = false;
 
-// move memory to address register (EAX..EDX, ESI, EDI, EPP, ESP)
-static void x86_encode_move_mem_to_areg(uint32_t addr, uint8_t reg, uint8_t **pos)
+// swap the bytes of the lower word or of the whole data register (R8D..R15D), ROL changes the CF and OF
+static uint8_t *x86_encode_swap_dreg(uint8_t *p_pos, uint8_t reg, uint8_t length)
 {
-    // opcode
-    write_byte(0x8b, pos);
+    if (length == 2) {
+        // operand-size prefix (16-bit operands), prefix byte indicating extension of the R/M field, ROL <register>, 8
+        WRITE_BYTE(p_pos, 0x66);
+        WRITE_BYTE(p_pos, 0x41);
+        WRITE_BYTE(p_pos, 0xc1);
+        WRITE_BYTE(p_pos, 0xc0 | reg);
+        WRITE_BYTE(p_pos, 8);
+    }
+    else {
+        // prefix byte indicating extension of opcode register field, BSWAP <register>
+        WRITE_BYTE(p_pos, 0x41);
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, 0xc8 + reg);
+    }
+    return p_pos;
+}
+
+// move memory to address register (EAX..EDX, ESI, EDI, EPP, ESP), always a long (MOVEA.W is not supported)
+static uint8_t *x86_encode_move_mem_to_areg(uint8_t *p_pos, uint32_t addr, uint8_t reg)
+{
+    // opcode (MOVBE or MOV)
+    if (g_use_movbe) {
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, 0x38);
+        WRITE_BYTE(p_pos, 0xf0);
+    }
+    else {
+        WRITE_BYTE(p_pos, 0x8b);
+    }
     // MOD-REG-R/M byte with register number
     switch (reg) {
         // In order to map A7 to ESP, we have to swap the register numbers of A4 and A7. With all
@@ -129,28 +275,50 @@ static void x86_encode_move_mem_to_areg(uint32_t addr, uint8_t reg, uint8_t **po
             reg = 4;
             break;
     }
-    write_byte(0x04 | (reg << 3), pos);
+    WRITE_BYTE(p_pos, 0x04 | (reg << 3));
     // SIB byte (specifying displacement only as addressing mode) and address
-    write_byte(0x25, pos);
-    write_dword(addr, pos);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, addr);
+    if (!g_use_movbe) {
+        // BSWAP <register>
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, 0xc8 + reg);
+    }
+    return p_pos;
 }
 
-// move memory to data register (R8D..R15D)
-static void x86_encode_move_mem_to_dreg(uint32_t addr, uint8_t reg, uint8_t **pos)
+// move memory to data register (R8D..R15D, or its lower word / byte, the rest of it is left alone)
+static uint8_t *x86_encode_move_mem_to_dreg(uint8_t *p_pos, uint32_t addr, uint8_t reg, uint8_t length)
 {
+    // operand-size prefix for words
+    if (length == 2)
+        WRITE_BYTE(p_pos, 0x66);
     // prefix byte indicating extension of register field in MOD-REG-R/M byte (because we use registers R8D..R15D)
-    write_byte(0x44, pos);
-    // opcode
-    write_byte(0x8b, pos);
+    WRITE_BYTE(p_pos, 0x44);
+    // opcode (MOVBE or MOV)
+    if (length == 1) {
+        WRITE_BYTE(p_pos, 0x8a);
+    }
+    else if (g_use_movbe) {
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, 0x38);
+        WRITE_BYTE(p_pos, 0xf0);
+    }
+    else {
+        WRITE_BYTE(p_pos, 0x8b);
+    }
     // MOD-REG-R/M byte with register number
-    write_byte(0x04 | (reg << 3), pos);
+    WRITE_BYTE(p_pos, 0x04 | (reg << 3));
     // SIB byte (specifying displacement only as addressing mode) and address
-    write_byte(0x25, pos);
-    write_dword(addr, pos);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, addr);
+    if ((length != 1) && !g_use_movbe)
+        p_pos = x86_encode_swap_dreg(p_pos, reg, length);
+    return p_pos;
 }
 
 // move immediate value to address register (EAX..EDX, ESI, EDI, EPP, ESP)
-static void x86_encode_move_imm_to_areg(uint32_t value, uint8_t reg, uint8_t **pos)
+static uint8_t *x86_encode_move_imm_to_areg(uint8_t *p_pos, uint32_t value, uint8_t reg)
 {
     // opcode + register number as one byte
     switch (reg) {
@@ -163,342 +331,1149 @@ static void x86_encode_move_imm_to_areg(uint32_t value, uint8_t reg, uint8_t **p
             reg = 4;
             break;
     }
-    write_byte(0xb8 + reg, pos);
+    WRITE_BYTE(p_pos, 0xb8 + reg);
     // immediate value
-    write_dword(value, pos);
+    WRITE_DWORD(p_pos, value);
+    return p_pos;
 }
 
 // move immediate value to data register (R8D..R15D)
-static void x86_encode_move_imm_to_dreg(uint32_t value, uint8_t reg, uint8_t **pos)
+static uint8_t *x86_encode_move_imm_to_dreg(uint8_t *p_pos, uint32_t value, uint8_t reg)
 {
     // prefix byte indicating extension of opcode register field (because we use registers R8D..R15D)
-    write_byte(0x41, pos);
+    WRITE_BYTE(p_pos, 0x41);
     // opcode + register number as one byte
-    write_byte(0xb8 + reg, pos);
+    WRITE_BYTE(p_pos, 0xb8 + reg);
     // immediate value
-    write_dword(value, pos);
+    WRITE_DWORD(p_pos, value);
+    return p_pos;
 }
 
-// move data register (R8D..R15D) to memory
-static void x86_encode_move_dreg_to_mem(uint8_t reg, uint32_t addr, uint8_t **pos)
+// move data register (R8D..R15D, or its lower word / byte) to memory
+static uint8_t *x86_encode_move_dreg_to_mem(uint8_t *p_pos, uint8_t reg, uint32_t addr, uint8_t length)
 {
+    // without MOVBE, the bytes are swapped in the register before the store and swapped back afterwards
+    bool is_swapped = (length != 1) && !g_use_movbe;
+    if (is_swapped)
+        p_pos = x86_encode_swap_dreg(p_pos, reg, length);
+    // operand-size prefix for words
+    if (length == 2)
+        WRITE_BYTE(p_pos, 0x66);
     // prefix byte indicating extension of register field in MOD-REG-R/M byte (because we use registers R8D..R15D)
-    write_byte(0x44, pos);
-    // opcode
-    write_byte(0x89, pos);
+    WRITE_BYTE(p_pos, 0x44);
+    // opcode (MOVBE or MOV)
+    if (length == 1) {
+        WRITE_BYTE(p_pos, 0x88);
+    }
+    else if (g_use_movbe) {
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, 0x38);
+        WRITE_BYTE(p_pos, 0xf1);
+    }
+    else {
+        WRITE_BYTE(p_pos, 0x89);
+    }
     // MOD-REG-R/M byte with register number
-    write_byte(0x04 | (reg << 3), pos);
+    WRITE_BYTE(p_pos, 0x04 | (reg << 3));
     // SIB byte (specifying displacement only as addressing mode) and address
-    write_byte(0x25, pos);
-    write_dword(addr, pos);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, addr);
+    if (is_swapped)
+        p_pos = x86_encode_swap_dreg(p_pos, reg, length);
+    return p_pos;
 }
 
 // move data register (R8D..R15D) to data register
-static void x86_encode_move_dreg_to_dreg(uint8_t src, uint8_t dst, uint8_t **pos)
+static uint8_t *x86_encode_move_dreg_to_dreg(uint8_t *p_pos, uint8_t src, uint8_t dst)
 {
     // prefix byte indicating extension of register fields (REG and R/M) in MOD-REG-R/M byte (because we use registers R8D..R15D)
-    write_byte(0x45, pos);
+    WRITE_BYTE(p_pos, 0x45);
     // opcode
-    write_byte(0x89, pos);
+    WRITE_BYTE(p_pos, 0x89);
     // MOD-REG-R/M byte with register numbers, mode = 11, source register goes into REG part,
     // destination register into R/M part
-    write_byte(0xc0 | (src << 3) | dst, pos);
+    WRITE_BYTE(p_pos, 0xc0 | (src << 3) | dst);
+    return p_pos;
 }
 
+// move data register (R8D..R15D) to address register (EAX..EDX, ESI, EDI, EPP, ESP)
+static uint8_t *x86_encode_move_dreg_to_areg(uint8_t *p_pos, uint8_t src, uint8_t dst)
+{
+    // prefix byte indicating extension of register field in MOD-REG-R/M byte (because we use registers R8D..R15D)
+    WRITE_BYTE(p_pos, 0x44);
+    // opcode
+    WRITE_BYTE(p_pos, 0x89);
+    // MOD-REG-R/M byte with register numbers, source register goes into REG part, destination
+    // register into R/M part (A4 and A7 swapped, see x86_encode_move_mem_to_areg())
+    switch (dst) {
+        case 4:
+            dst = 7;
+            break;
+        case 7:
+            dst = 4;
+            break;
+    }
+    WRITE_BYTE(p_pos, 0xc0 | (src << 3) | dst);
+    return p_pos;
+}
 
-//
-// opcode handlers
-//
-// All handlers have the following signature and return the number of bytes consumed, 
-// which can be 0, or -1 in case of of an error.
-// static int m68k_xxx(
-//     uint16_t      m68k_opcode,       // opcode to decode
-//     const uint8_t **inpos,           // current position in the input stream, will be updated
-//     uint8_t       **outpos           // current position in the output stream, will be updated
-// )
+// test data register (R8D..R15D, or its lower word / byte), sets SF and ZF according to its value and clears OF and CF
+static uint8_t *x86_encode_test_dreg(uint8_t *p_pos, uint8_t reg, uint8_t length)
+{
+    // operand-size prefix for words
+    if (length == 2)
+        WRITE_BYTE(p_pos, 0x66);
+    // prefix byte indicating extension of register fields (REG and R/M) in MOD-REG-R/M byte (because we use registers R8D..R15D)
+    WRITE_BYTE(p_pos, 0x45);
+    // opcode
+    WRITE_BYTE(p_pos, length == 1 ? 0x84 : 0x85);
+    // With the Motorola TST instruction, the value to test against is implicitly 0, this has
+    // to be encoded as TEST <register>, <register> for Intel.
+    WRITE_BYTE(p_pos, 0xc0 | (reg << 3) | reg);
+    return p_pos;
+}
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-25
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-483
-#ifdef TEST
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-static int m68k_bcc(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// move immediate value to lowest byte of data register (R8B..R15B), doesn't change the flags
+static uint8_t *x86_encode_move_imm_to_dreg_byte(uint8_t *p_pos, uint8_t value, uint8_t reg)
 {
-    return -1;
+    // prefix byte indicating extension of opcode register field (because we use registers R8B..R15B)
+    WRITE_BYTE(p_pos, 0x41);
+    // opcode + register number as one byte
+    WRITE_BYTE(p_pos, 0xb0 + reg);
+    WRITE_BYTE(p_pos, value);
+    return p_pos;
 }
-#pragma GCC diagnostic pop
-#else
-static int m68k_bcc(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+
+// subtract immediate value from data register (R8D..R15D)
+static uint8_t *x86_encode_sub_imm_from_dreg(uint8_t *p_pos, uint8_t value, uint8_t reg)
 {
-    int32_t offset;
-    int      nbytes_used;
+    // prefix byte indicating extension of opcode register field (because we use registers R8D..R15D)
+    WRITE_BYTE(p_pos, 0x41);
+    // opcode
+    WRITE_BYTE(p_pos, 0x83);
+    // register number
+    WRITE_BYTE(p_pos, 0xe8 + reg);
+    // value
+    WRITE_BYTE(p_pos, value);
+    return p_pos;
+}
 
-    DEBUG("translating instruction BCC");
-    switch (m68k_opcode & 0x00ff) {
-        case 0x0000:
-            offset = (int16_t) read_word(inpos);
-            DEBUG("16-bit offset = %d", offset);
-            nbytes_used = 2;
-            break;
-        case 0x00ff:
-            offset = (int32_t) read_dword(inpos);
-            DEBUG("32-bit offset = %d", offset);
-            nbytes_used = 4;
-            break;
-        default:
-            offset = (int8_t) (m68k_opcode & 0x00ff);
-            DEBUG("8-bit offset = %d", offset);
-            nbytes_used = 0;
+// add immediate value to A6 (ESI), with an 8-bit immediate value if it fits into one
+static uint8_t *x86_encode_add_imm_to_a6(uint8_t *p_pos, int32_t value)
+{
+    if ((value >= -128) && (value <= 127)) {
+        WRITE_BYTE(p_pos, 0x83);
+        WRITE_BYTE(p_pos, 0xc6);
+        WRITE_BYTE(p_pos, value);
     }
-
-    // write opcode
-    write_byte(0x0f, outpos);
-    switch (m68k_opcode & 0x0f00) {
-        case 0x0600:
-            DEBUG("BNE => JNE");
-            write_byte(0x85, outpos);
-            break;
-        case 0x0700:
-            DEBUG("BEQ => JE");
-            write_byte(0x84, outpos);
-            break;
-        default:
-            ERROR("condition 0x%x not supported", m68k_opcode & 0x0f00);
-            return -1;
+    else {
+        WRITE_BYTE(p_pos, 0x81);
+        WRITE_BYTE(p_pos, 0xc6);
+        WRITE_DWORD(p_pos, value);
     }
+    return p_pos;
+}
 
-    // recursively call setup_tu() twice, once with the branch target as start address,
-    // once with the address of the following instruction
-    // The offset of the branch target is calculated from the position after the *opcode*,
-    // so we need to subtract the number of bytes used for the offset itself.
-    // This method was inspired by a paper describing how VMware does binary translation:
-    // https://www.vmware.com/pdf/asplos235_adams.pdf
-    uint8_t *branch_taken_addr, *branch_not_taken_addr;
-    DEBUG("setting up TU of branch taken");
-    if ((branch_taken_addr = setup_tu(*inpos + offset - nbytes_used)) == NULL) {
-        ERROR("failed to set up next TU (branch taken)")
-        return -1;
-    }
-    DEBUG("setting up TU of branch not taken");
-    if ((branch_not_taken_addr = setup_tu(*inpos)) == NULL) {
-        ERROR("failed to set up next TU (branch not taken)")
-        return -1;
-    }
+// move for all combinations of source / destination operand types MOVE and MOVEA support,
+// returns NULL if the combination is not supported
+static uint8_t *x86_encode_move(uint8_t *p_pos, const Operand *src, const Operand *dst)
+{
+    if ((src->op_type == OP_MEM) && (dst->op_type == OP_DREG))
+        return x86_encode_move_mem_to_dreg(p_pos, src->op_value, dst->op_value, dst->op_length);
+    else if ((src->op_type == OP_IMM) && (dst->op_type == OP_DREG))
+        return x86_encode_move_imm_to_dreg(p_pos, src->op_value, dst->op_value);
+    else if ((src->op_type == OP_DREG) && (dst->op_type == OP_MEM))
+        return x86_encode_move_dreg_to_mem(p_pos, src->op_value, dst->op_value, src->op_length);
+    else if ((src->op_type == OP_DREG) && (dst->op_type == OP_DREG))
+        return x86_encode_move_dreg_to_dreg(p_pos, src->op_value, dst->op_value);
+    else if ((src->op_type == OP_MEM) && (dst->op_type == OP_AREG))
+        return x86_encode_move_mem_to_areg(p_pos, src->op_value, dst->op_value);
+    else if ((src->op_type == OP_IMM) && (dst->op_type == OP_AREG))
+        return x86_encode_move_imm_to_areg(p_pos, src->op_value, dst->op_value);
+    else if ((src->op_type == OP_DREG) && (dst->op_type == OP_AREG))
+        return x86_encode_move_dreg_to_areg(p_pos, src->op_value, dst->op_value);
+    ERROR("combination of source / destination operand types %d / %d not supported", src->op_type, dst->op_type);
+    return NULL;
+}
 
-    // write offset
-    // offset in translated code = address of TU of branch - value of IP after branch instruction,
-    // not counting the opcode itself (so it's + 4 instead of +6)
-    // To make things easier, we always use the less compact 2-byte encoding with a 32-bit offset.
-    offset = branch_taken_addr - (*outpos + 4);
-    write_dword(offset, outpos);
 
-    // add jump to the corresponding TU if branch is not taken, here the one byte for the opcode is included
-    offset = branch_not_taken_addr - (*outpos + 5);
-    write_byte(0xe9, outpos);
-    write_dword(offset, outpos);
+//
+// lazy evaluation of the condition codes
+//
+// At the start and the end of each TU, the x86 flags SF, ZF, OF and CF hold the 680x0 flags N, Z,
+// V and C, and the X flag is stored at X_FLAG_ADDRESS. SUB and TEST set the flags exactly like
+// their 680x0 counterparts (the carry is a borrow after a subtraction on both), so they are used
+// as they are. MOVE sets N and Z according to the value moved and clears V and C on the 680x0, but
+// MOV doesn't change the flags on the x86. So we only record the register holding the value (and
+// the value if it is a constant), and compute the flags with TEST when a conditional instruction
+// needs them or the TU ends. Conditions are evaluated at translation time if the value is known.
+// The X flag is set together with C by SUB and written to memory with SETC only when the CF is
+// about to be overwritten or the TU ends.
+//
+static __thread CcrState ccr;
+
+// mapping of 680x0 conditions to x86 conditions (lower 4 bits of the opcodes of Jcc and SETcc)
+static const uint8_t x86_cond_tbl[16] = {
+    COND_ALWAYS,    // T
+    COND_NEVER,     // F
+    0x7,            // HI => A
+    0x6,            // LS => BE
+    0x3,            // CC => AE
+    0x2,            // CS => B
+    0x5,            // NE => NE
+    0x4,            // EQ => E
+    0x1,            // VC => NO
+    0x0,            // VS => O
+    0x9,            // PL => NS
+    0x8,            // MI => S
+    0xd,            // GE => GE
+    0xc,            // LT => L
+    0xf,            // GT => G
+    0xe             // LE => LE
+};
 
-    return nbytes_used;
+// evaluate 680x0 condition for the given flags
+static bool eval_cond(uint8_t cond, bool n, bool z, bool v, bool c)
+{
+    switch (cond) {
+        case 0x0: return true;
+        case 0x1: return false;
+        case 0x2: return !c && !z;
+        case 0x3: return c || z;
+        case 0x4: return !c;
+        case 0x5: return c;
+        case 0x6: return !z;
+        case 0x7: return z;
+        case 0x8: return !v;
+        case 0x9: return v;
+        case 0xa: return !n;
+        case 0xb: return n;
+        case 0xc: return n == v;
+        case 0xd: return n != v;
+        case 0xe: return !z && (n == v);
+        default:  return z || (n != v);
+    }
 }
-#endif
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-109
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-122
-static int m68k_jsr(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// reset the state at the start of a TU
+static void ccr_reset()
 {
-    uint16_t mode_reg = m68k_opcode & 0x003f;
-    int16_t offset;
-    Operand  op;
-    int      nbytes_used;
+    ccr.ccr_kind = CCR_NATIVE;
+    ccr.x_pending = false;
+}
 
-    DEBUG("translating instruction JSR");
-    nbytes_used = extract_operand(mode_reg, inpos, &op);
-    if (op.op_type != OP_AREG_OFFSET) {
-        ERROR("only address register with offset supported as operand type");
-        return -1;
-    }
-    offset = (int16_t) read_word(inpos);
-    nbytes_used = 2;
-    if (op.op_value == 6) {
-        // special case: register is A6 => we assume this is a call of a library routine
-        // As the x86 doesn't support register + offset as operand for CALL, we need to
-        // insert an additional ADD instruction before the CALL, but of course we have
-        // to save the old value and restore it after the call.
-        write_byte(0x56, outpos);  // push rsi
-        write_byte(0x81, outpos);  // add esi, <offset>
-        write_byte(0xc6, outpos);
-        write_dword(offset, outpos);
-        write_byte(0xff, outpos);  // call rsi
-        write_byte(0xd6, outpos);
-        write_byte(0x5e, outpos);  // pop rsi
+// write the X flag to memory if it is still in the CF
+static uint8_t *ccr_write_x(uint8_t *p_pos)
+{
+    if (ccr.x_pending) {
+        // SETC byte [X_FLAG_ADDRESS], with SIB byte specifying displacement only as addressing mode
+        WRITE_BYTE(p_pos, 0x0f);
+        WRITE_BYTE(p_pos, 0x92);
+        WRITE_BYTE(p_pos, 0x04);
+        WRITE_BYTE(p_pos, 0x25);
+        WRITE_DWORD(p_pos, X_FLAG_ADDRESS);
+        ccr.x_pending = false;
     }
-    else {
-        ERROR("generic JSR instruction not supported");
-        return -1;
+    return p_pos;
+}
+
+// compute the x86 flags from the recorded value
+static uint8_t *ccr_materialize(uint8_t *p_pos)
+{
+    if (ccr.ccr_kind != CCR_NATIVE) {
+        // TEST overwrites the CF
+        p_pos = ccr_write_x(p_pos);
+        p_pos = x86_encode_test_dreg(p_pos, ccr.ccr_reg, ccr.ccr_length);
+        ccr.ccr_kind = CCR_NATIVE;
     }
+    return p_pos;
+}
 
-    return nbytes_used;
+// an x86 instruction that sets the flags like the 680x0 one (and the X flag as well if sets_x
+// is true) is about to be emitted
+static uint8_t *ccr_set_native(uint8_t *p_pos, bool sets_x)
+{
+    if (!sets_x)
+        p_pos = ccr_write_x(p_pos);
+    ccr.ccr_kind = CCR_NATIVE;
+    ccr.x_pending = sets_x;
+    return p_pos;
 }
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-119
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
-static int m68k_movea(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// a MOVE (not MOVEA) has been emitted, record the value that determines the flags
+static void ccr_set_move(const Operand *src, const Operand *dst)
 {
-    uint16_t mode_reg = m68k_opcode & 0x003f;
-    uint8_t  reg = (m68k_opcode & 0x0e00) >> 9;
-    Operand  op;
-    int      nbytes_used;
+    ccr.ccr_kind = src->op_type == OP_IMM ? CCR_CONST : CCR_RESULT;
+    ccr.ccr_reg = dst->op_type == OP_DREG ? dst->op_value : src->op_value;
+    ccr.ccr_length = dst->op_length;
+    ccr.ccr_value = src->op_value;
+}
 
-    DEBUG("translating instruction MOVEA");
-    if ((m68k_opcode & 0x3000) != 0x2000) {
-        ERROR("only long operation supported");
-        return -1;
-    }
-    DEBUG("destination register is A%d", reg);
-    nbytes_used = extract_operand(mode_reg, inpos, &op);
-    if (op.op_type == OP_MEM) {
-        // replace the original value of AbsExecBase (0x0000004) with the address where the base address of Exec library is stored
-#ifndef TEST
-        if (op.op_value == 0x4)
-            op.op_value = ABS_EXEC_BASE;
-#endif
-        x86_encode_move_mem_to_areg(op.op_value, reg, outpos);
-    }
-    else if (op.op_type == OP_IMM)
-        x86_encode_move_imm_to_areg(op.op_value, reg, outpos);
-    else {
-        ERROR("invalid operand type %d for MOVEA", op.op_type);
-        return -1;
-    }
-    return nbytes_used;
+// a library routine has been called, which may have changed all flags
+static void ccr_set_unknown()
+{
+    ccr.ccr_kind = CCR_NATIVE;
+    ccr.x_pending = false;
 }
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-134
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-static int m68k_moveq(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// a data register is about to be changed by an instruction that doesn't set the flags
+static uint8_t *ccr_write_dreg(uint8_t *p_pos, uint8_t reg)
 {
-    // immediate value as sign-extended 32-bit value
-    int32_t  value = (int8_t) (m68k_opcode & 0x00ff);
-    uint8_t  reg  = (m68k_opcode & 0x0e00) >> 9;
+    if ((ccr.ccr_kind != CCR_NATIVE) && (ccr.ccr_reg == reg))
+        p_pos = ccr_materialize(p_pos);
+    return p_pos;
+}
 
-    DEBUG("translating instruction MOVEQ");
-    DEBUG("destination register is D%d", reg);
-    DEBUG("immediate value = %d", value);
-    x86_encode_move_imm_to_dreg(value, reg, outpos);
-    return 0;
+// a 680x0 condition is about to be tested, emit the code computing the flags unless the condition
+// can be evaluated at translation time (see ccr_get_cond())
+static uint8_t *ccr_prepare_cond(uint8_t *p_pos, uint8_t cond)
+{
+    if ((cond > 0x1) && (ccr.ccr_kind != CCR_CONST))
+        p_pos = ccr_materialize(p_pos);
+    return p_pos;
 }
-#pragma GCC diagnostic pop
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-116
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
-static int m68k_move(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// get the x86 condition for a 680x0 condition (after ccr_prepare_cond()), or COND_ALWAYS /
+// COND_NEVER if it can be evaluated at translation time
+static uint8_t ccr_get_cond(uint8_t cond)
 {
-    uint8_t  src_mode_reg = m68k_opcode & 0x003f;
-    uint8_t  dst_mode_reg = (m68k_opcode & 0x0fc0) >> 6;
-    Operand  srcop, dstop;
-    int      nbytes_used = 0;
+    if ((cond > 0x1) && (ccr.ccr_kind == CCR_CONST))
+        return eval_cond(cond, (int32_t) ccr.ccr_value < 0, ccr.ccr_value == 0, false, false) ? COND_ALWAYS : COND_NEVER;
+    return x86_cond_tbl[cond];
+}
 
-    DEBUG("translating instruction MOVE");
-    if ((m68k_opcode & 0x3000) != 0x2000) {
-        ERROR("only long operation supported");
-        return -1;
-    }
+// the TU is about to be left, put the flags where the next TU expects them
+static uint8_t *ccr_leave_tu(uint8_t *p_pos)
+{
+    p_pos = ccr_materialize(p_pos);
+    return ccr_write_x(p_pos);
+}
 
-    nbytes_used += extract_operand(src_mode_reg, inpos, &srcop);
-    // destination operand has mode and register parts swapped
-    dst_mode_reg = ((dst_mode_reg & 0x07) << 3) | ((dst_mode_reg & 0x38) >> 3);
-    nbytes_used += extract_operand(dst_mode_reg, inpos, &dstop);
 
-    // call the appropriate function depending on the combination of source / destination operand type
-    if ((srcop.op_type      == OP_MEM)  && (dstop.op_type == OP_DREG))
-        x86_encode_move_mem_to_dreg(srcop.op_value, dstop.op_value, outpos);
-    else if ((srcop.op_type == OP_IMM)  && (dstop.op_type == OP_DREG))
-        x86_encode_move_imm_to_dreg(srcop.op_value, dstop.op_value, outpos);
-    else if ((srcop.op_type == OP_DREG) && (dstop.op_type == OP_MEM))
-        x86_encode_move_dreg_to_mem(srcop.op_value, dstop.op_value, outpos);
-    else if ((srcop.op_type == OP_DREG) && (dstop.op_type == OP_DREG))
-        x86_encode_move_dreg_to_dreg(srcop.op_value, dstop.op_value, outpos);
+//
+// routines emitting code for the more complex IR instructions, used by emit_ir()
+// (they return the new position in the buffer, or NULL on error)
+//
+
+// emit (conditional) jump to another TU (install_code() sets it up if necessary)
+static uint8_t *emit_jump(uint8_t *p_pos, uint8_t x86_cond, const uint8_t *p_m68k_target)
+{
+    // To make things easier, we always use the less compact encodings with a 32-bit offset.
+    if (x86_cond == COND_ALWAYS) {
+        WRITE_BYTE(p_pos, 0xe9);
+    }
     else {
-        ERROR("combination of source / destination operand types %d / %d not supported", srcop.op_type, dstop.op_type);
-        return -1;
+        WRITE_BYTE(p_pos, 0x0f);
+        WRITE_BYTE(p_pos, 0x80 | x86_cond);
     }
-    return nbytes_used;
+    return write_jump_offset(p_pos, p_m68k_target);
 }
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-169
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-553
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-static int m68k_rts(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// emit code for Scc, setting the lowest byte of a data register to 0xff if the condition is met
+// and to 0 otherwise (without changing the flags)
+static uint8_t *emit_scc(uint8_t *p_pos, uint8_t cond, uint8_t reg)
 {
-    DEBUG("translating instruction RTS");
-    write_byte(0xc3, outpos);
-    return 0;
+    p_pos = ccr_prepare_cond(p_pos, cond);
+    uint8_t x86_cond = ccr_get_cond(cond);
+    p_pos = ccr_write_dreg(p_pos, reg);
+    if (x86_cond == COND_ALWAYS)
+        p_pos = x86_encode_move_imm_to_dreg_byte(p_pos, 0xff, reg);
+    else if (x86_cond == COND_NEVER)
+        p_pos = x86_encode_move_imm_to_dreg_byte(p_pos, 0, reg);
+    else {
+        // MOV <reg>, 0xff, J<cond> +3 (skipping the next MOV), MOV <reg>, 0
+        p_pos = x86_encode_move_imm_to_dreg_byte(p_pos, 0xff, reg);
+        WRITE_BYTE(p_pos, 0x70 | x86_cond);
+        WRITE_BYTE(p_pos, 3);
+        p_pos = x86_encode_move_imm_to_dreg_byte(p_pos, 0, reg);
+    }
+    return p_pos;
 }
-#pragma GCC diagnostic pop
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-181
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-654
-static int m68k_subq_32(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+// emit code for the loop part of DBcc, decrementing the lower word of a data register and jumping
+// to another TU unless the result is -1 (without changing the flags)
+// LEA and JRCXZ are used because they don't change the flags, RCX is saved on the stack.
+static uint8_t *emit_dbra(uint8_t *p_pos, uint8_t reg, const uint8_t *p_m68k_target)
 {
-    uint16_t mode_reg = m68k_opcode & 0x003f;
-    uint8_t  value = (m68k_opcode & 0x0e00) >> 9;
-    Operand  op;
-    int      nbytes_used;
+    // PUSH RCX
+    WRITE_BYTE(p_pos, 0x51);
+    // MOVZX ECX, <reg>W
+    WRITE_BYTE(p_pos, 0x41);
+    WRITE_BYTE(p_pos, 0x0f);
+    WRITE_BYTE(p_pos, 0xb7);
+    WRITE_BYTE(p_pos, 0xc8 | reg);
+    // LEA <reg>W, [<reg> - 1], with operand size prefix so that only the lower word is written
+    // (register number 4 in the R/M part requires a SIB byte)
+    WRITE_BYTE(p_pos, 0x66);
+    WRITE_BYTE(p_pos, 0x45);
+    WRITE_BYTE(p_pos, 0x8d);
+    WRITE_BYTE(p_pos, 0x40 | (reg << 3) | reg);
+    if (reg == 4)
+        WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, 0xff);
+    // JRCXZ +6 (register was 0 and is -1 now) to POP RCX below
+    WRITE_BYTE(p_pos, 0xe3);
+    WRITE_BYTE(p_pos, 6);
+    // POP RCX, JMP <target>
+    WRITE_BYTE(p_pos, 0x59);
+    if ((p_pos = emit_jump(p_pos, COND_ALWAYS, p_m68k_target)) == NULL)
+        return NULL;
+    // POP RCX
+    WRITE_BYTE(p_pos, 0x59);
+    return p_pos;
+}
 
-    DEBUG("translating instruction SUBQ");
-    if ((m68k_opcode & 0x00c0) != 0x0080) {
-        ERROR("only long operation supported");
-        return -1;
+// emit call of a library routine directly to its entry in the jump table (bound by bind_lib_calls()), if necessary
+// guarded by a check that A6 holds the library base the call has been bound for, with the usual
+// indirect call via the jump table if it doesn't (the library routines preserve A6, so unlike
+// the indirect call, the direct call doesn't need to save it)
+static uint8_t *emit_direct_call(uint8_t *p_pos, const IrInsn *p_insn)
+{
+    uint8_t *p_skip = NULL;
+    bool is_guarded = p_insn->ir_flags & IR_CALL_GUARD;
+
+    if (is_guarded) {
+        // CMP ESI, <library base>, JNE +7 (skipping the CALL and the JMP below)
+        WRITE_BYTE(p_pos, 0x81);
+        WRITE_BYTE(p_pos, 0xfe);
+        WRITE_DWORD(p_pos, p_insn->ir_dst.op_value);
+        WRITE_BYTE(p_pos, OPCODE_JNZ_REL8);
+        WRITE_BYTE(p_pos, 7);
     }
-    DEBUG("immediate value = %d", value);
-    nbytes_used = extract_operand(mode_reg, inpos, &op);
-    if (op.op_type != OP_DREG) {
-        ERROR("only data register supported as destination operand");
-        return -1;
+    // CALL <entry>
+    WRITE_BYTE(p_pos, OPCODE_CALL_REL32);
+    if ((p_pos = write_call_offset(p_pos, p_insn->p_target)) == NULL)
+        return NULL;
+    if (is_guarded) {
+        // JMP <end>, PUSH RSI, ADD ESI, <offset>, CALL RSI, POP RSI
+        WRITE_BYTE(p_pos, OPCODE_JMP_REL8);
+        p_skip = p_pos++;
+        WRITE_BYTE(p_pos, 0x56);
+        p_pos = x86_encode_add_imm_to_a6(p_pos, p_insn->ir_src.op_value);
+        WRITE_BYTE(p_pos, 0xff);
+        WRITE_BYTE(p_pos, 0xd6);
+        WRITE_BYTE(p_pos, 0x5e);
+        *p_skip = p_pos - (p_skip + 1);
     }
-    // prefix byte indicating extension of opcode register field (because we use registers R8D..R15D)
-    write_byte(0x41, outpos);
-    // opcode
-    write_byte(0x83, outpos);
-    // register number
-    write_byte(0xe8 + op.op_value, outpos);
-    // value
-    write_byte(value, outpos);
-    return nbytes_used;
+    return p_pos;
 }
 
-// Motorola M68000 Family Programmer’s Reference Manual, page 4-193
-// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-679
-static int m68k_tst_32(uint16_t m68k_opcode, const uint8_t **inpos, uint8_t **outpos)
+
+// Subroutine calls and returns: a call pushes the return address onto the guest stack (A7 = RSP, so
+// the guest stack is the host stack), and the shadow stack push helper records it together with the
+// address of the translated code following the call. RTS calls the pop helper, which checks if the
+// return address on the guest stack is the one recorded by the last call, and then jumps to the address
+// it has stored in the shadow stack area: the code following the call if it is, the return dispatcher
+// (which looks up the TU for the return address) if it isn't. We can't use CALL / RET of the x86 for
+// this because it would push a 64-bit address onto the guest stack, but each RTS has its own indirect
+// jump, so that the CPU predicts the target of each of them separately. The helpers are called with
+// CALL and return with RET, which the CPU predicts as well. (see setup_dispatchers() for the code)
+#define SHADOW_STACK ((ShadowStack *) SHADOW_STACK_ADDRESS)
+#define SHADOW_FIELD_ADDRESS(field) ((uint32_t) (SHADOW_STACK_ADDRESS + offsetof(ShadowStack, field)))
+
+static uint8_t *p_shadow_push = NULL;           // records a call, the JMP to the subroutine follows the CALL of the helper...
+static uint8_t *p_shadow_push_indirect = NULL;  // ... or the JMP to the target of an indirect call (see emit_jump_to_target())
+static uint8_t *p_shadow_pop = NULL;            // checks the return address and sets the target of the jump of RTS
+static uint8_t *p_branch_dispatcher = NULL;     // translates the target of an indirect branch that is not in the cache
+
+// emit jump to the address the pop helper or the lookup of the target of an indirect branch has stored
+// in the shadow stack area: JMP [<target>]
+#define JUMP_TO_TARGET_SIZE 7
+
+static uint8_t *emit_jump_to_target(uint8_t *p_pos)
 {
-    uint16_t mode_reg = m68k_opcode & 0x003f;
-    Operand  op;
-    int      nbytes_used;
+    WRITE_BYTE(p_pos, OPCODE_JMP_ABS64);
+    WRITE_BYTE(p_pos, 0x24);                        // MOD-REG-R/M byte with opcode extension, SIB byte follows
+    WRITE_BYTE(p_pos, 0x25);                        // SIB byte with no base and no index (32-bit displacement)
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_target));
+    return p_pos;
+}
 
-    DEBUG("translating instruction TST");
-    if ((m68k_opcode & 0x00c0) != 0x0080) {
-        ERROR("only long operation supported");
-        return -1;
+// emit LEA EDX, [<base> + <index> + <displacement>], with the x86 registers (any of them may be NO_REG,
+// the base must not be ESP because it can only be encoded with a SIB byte)
+static uint8_t *emit_lea_edx(uint8_t *p_pos, uint8_t base, uint8_t index, uint32_t disp)
+{
+    if ((index != NO_REG) && (index < 8)) {
+        WRITE_BYTE(p_pos, 0x42);                    // REX prefix for the extended registers R8D..R15D as index
     }
-    nbytes_used = extract_operand(mode_reg, inpos, &op);
-    if (op.op_type != OP_DREG) {
-        ERROR("only data register supported as destination operand");
-        return -1;
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    if (index == NO_REG) {
+        WRITE_BYTE(p_pos, 0x90 | (base & 0x07));    // MOD-REG-R/M byte with EDX, base and 32-bit displacement
     }
-    // prefix byte indicating extension of opcode register field (because we use registers R8D..R15D)
-    write_byte(0x45, outpos);
-    // opcode
-    write_byte(0x85, outpos);
-    // register number
-    // With the Motorola TST instruction, the value to test against is implicitly 0, this has
-    // to be encoded as TEST <register>, <register> for Intel.
-    write_byte(0xc0 | (op.op_value << 3) | op.op_value, outpos);
-    return nbytes_used;
+    else {
+        WRITE_BYTE(p_pos, base != NO_REG ? 0x94 : 0x14);    // SIB byte follows (with 32-bit displacement)
+        WRITE_BYTE(p_pos, ((index & 0x07) << 3) | (base != NO_REG ? base & 0x07 : 0x05));
+    }
+    WRITE_DWORD(p_pos, disp);
+    return p_pos;
+}
+
+// emit code incrementing one of the counters of an indirect branch (with RCX as scratch register):
+// MOV ECX, [<counter>], LEA ECX, [RCX + 1], MOV [<counter>], ECX
+static uint8_t *emit_count(uint8_t *p_pos, const uint32_t *p_counter)
+{
+    uint32_t counter_addr = (uint64_t) p_counter;
+
+    p_pos = emit_move_abs_to_reg(p_pos, counter_addr, REG_ECX);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x49);
+    WRITE_BYTE(p_pos, 1);
+    return emit_move_reg_to_abs(p_pos, REG_ECX, counter_addr);
+}
+
+// Indirect branches: the target address is calculated in EDX and looked up in the cache for the targets of
+// indirect branches (direct-mapped, see tc_put_indirect()). If the entry for the address holds this
+// address, the address of the translated code in it is stored in the shadow stack area, otherwise the
+// address of the branch dispatcher (and the target address for it). The code then continues with the
+// JMP [<target>] of the branch, so that the CPU predicts the target of each branch separately. Like the
+// helpers of the shadow stack, the code uses RCX and RDX as scratch registers (saved on the stack) and
+// compares the addresses with NOT, LEA and JRCXZ because it must not change the flags. The hits and
+// misses of each branch are counted, see tc_log_stats().
+// (This is more than MAX_TRANSLATED_INSN_SIZE bytes of code, but indirect branches end the TU, and
+// lower_code() always leaves room for three IR instructions at the end.)
+static uint8_t *emit_indirect_target(uint8_t *p_pos, const IrInsn *p_insn)
+{
+    const Operand *src = &p_insn->ir_src;
+    uint8_t base = src->op_base != NO_REG ? x86_reg_for_m68k_reg[REG_A0 + src->op_base] : NO_REG;
+    uint8_t index = src->op_index != NO_REG ? x86_reg_for_m68k_reg[src->op_index & 0x0f] : NO_REG;
+    uint8_t *p_skip;
+
+    uint32_t *p_counts = alloc_counters(2);
+    if (p_counts == NULL) {
+        ERROR("no more counters for the indirect branch at %p", p_insn->p_target);
+        return NULL;
+    }
+    p_counts[0] = p_counts[1] = 0;
+    // (the branch is added to the ones whose counts are logged when the code is installed)
+    indirect_site = (IndirectSite) {p_insn->p_target, p_counts};
+    // PUSH RDX, PUSH RCX, EDX = <target address>
+    p_pos = emit_push_reg(p_pos, REG_RDX);
+    p_pos = emit_push_reg(p_pos, REG_RCX);
+    if ((index != NO_REG) && !(src->op_index & INDEX_LONG)) {
+        // MOVSX <scratch register>, <lower word of index register> (the scratch register must not be the base)
+        uint8_t scratch = base == REG_EDX ? REG_ECX : REG_EDX;
+        if (index < 8) {
+            WRITE_BYTE(p_pos, PREFIX_REXB);
+        }
+        WRITE_BYTE(p_pos, PREFIX_0F);
+        WRITE_BYTE(p_pos, OPCODE_MOVSX_WORD);
+        WRITE_BYTE(p_pos, 0xc0 | ((scratch - 8) << 3) | (index & 0x07));
+        index = scratch;
+    }
+    if ((index == NO_REG) && (src->op_value == 0)) {
+        if (base != REG_EDX)
+            p_pos = emit_move_reg_to_reg(p_pos, base, REG_EDX, MODE_32);
+    }
+    else {
+        p_pos = emit_lea_edx(p_pos, base, index, src->op_value);
+    }
+    // MOVZX ECX, DX, MOV ECX, [RCX * 4 + <cache>] (source address in the entry for the target address),
+    // NOT ECX, LEA ECX, [RCX + RDX + 1] (target address minus this address), JRCXZ <hit>
+    WRITE_BYTE(p_pos, PREFIX_0F);
+    WRITE_BYTE(p_pos, OPCODE_MOVZX_WORD);
+    WRITE_BYTE(p_pos, 0xca);
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x0c);
+    WRITE_BYTE(p_pos, 0x8d);                        // SIB byte with RCX * 4 as index and no base (32-bit displacement)
+    WRITE_DWORD(p_pos, INDIRECT_CACHE_ADDRESS + offsetof(IndirectCacheEntry, ie_src_addr));
+    WRITE_BYTE(p_pos, 0xf7);
+    WRITE_BYTE(p_pos, 0xd1);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x4c);
+    WRITE_BYTE(p_pos, 0x11);
+    WRITE_BYTE(p_pos, 0x01);
+    WRITE_BYTE(p_pos, OPCODE_JRCXZ_REL8);
+    p_skip = p_pos++;
+    // miss: MOV [<target address for the branch dispatcher>], EDX, MOV qword [<target>], <branch dispatcher>, JMP <end>
+    p_pos = emit_count(p_pos, p_counts + 1);
+    p_pos = emit_move_reg_to_abs(p_pos, REG_EDX, SHADOW_FIELD_ADDRESS(indirect_src));
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, 0xc7);
+    WRITE_BYTE(p_pos, 0x04);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_target));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+    WRITE_DWORD(p_pos, (uint32_t) p_branch_dispatcher);
+#pragma GCC diagnostic pop
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL8);
+    *p_skip = p_pos + 1 - (p_skip + 1);
+    p_skip = p_pos++;
+    // hit: MOVZX ECX, DX, MOV ECX, [RCX * 4 + <cache> + 4] (address of the translated code), MOV [<target>], RCX
+    p_pos = emit_count(p_pos, p_counts);
+    WRITE_BYTE(p_pos, PREFIX_0F);
+    WRITE_BYTE(p_pos, OPCODE_MOVZX_WORD);
+    WRITE_BYTE(p_pos, 0xca);
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x0c);
+    WRITE_BYTE(p_pos, 0x8d);
+    WRITE_DWORD(p_pos, INDIRECT_CACHE_ADDRESS + offsetof(IndirectCacheEntry, ie_dst_addr));
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_MOV_REG_MEM);
+    WRITE_BYTE(p_pos, 0x0c);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_target));
+    *p_skip = p_pos - (p_skip + 1);
+    // POP RCX, POP RDX
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    return emit_pop_reg(p_pos, REG_RDX);
+}
+
+// emit call of a subroutine, either the TU at p_target or the TU at the address in the OP_TARGET operand src
+// The push helper records the address after the JMP following the CALL of the helper as the address the
+// code continues at, that is the code for the IR_JUMP to the return address.
+static uint8_t *emit_call(uint8_t *p_pos, const IrInsn *p_insn)
+{
+    bool is_indirect = p_insn->ir_src.op_type == OP_TARGET;
+
+    // the target address is calculated first, as the 680x0 does
+    if (is_indirect && ((p_pos = emit_indirect_target(p_pos, p_insn)) == NULL))
+        return NULL;
+    // LEA RSP, [RSP - 4], MOV dword [RSP], <return address> (big-endian, like the guest would have pushed it)
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x64);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, 0xfc);
+    WRITE_BYTE(p_pos, 0xc7);
+    WRITE_BYTE(p_pos, 0x04);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_DWORD(p_pos, htonl(p_insn->ir_dst.op_value));
+    // CALL <push helper>, JMP <subroutine>
+    WRITE_BYTE(p_pos, OPCODE_CALL_REL32);
+    if ((p_pos = write_call_offset(p_pos, is_indirect ? p_shadow_push_indirect : p_shadow_push)) == NULL)
+        return NULL;
+    if (is_indirect)
+        return emit_jump_to_target(p_pos);
+    return emit_jump(p_pos, COND_ALWAYS, p_insn->p_target);
+}
+
+// emit return from subroutine: CALL <pop helper>, JMP [<target>]
+static uint8_t *emit_return(uint8_t *p_pos)
+{
+    WRITE_BYTE(p_pos, OPCODE_CALL_REL32);
+    if ((p_pos = write_call_offset(p_pos, p_shadow_pop)) == NULL)
+        return NULL;
+    return emit_jump_to_target(p_pos);
+}
+
+
+//
+// backend: generate the x86 code for the IR instructions that have not been eliminated, up to the
+// first unconditional jump or return (everything after it in a trace is unreachable), returns the
+// new position in the buffer or NULL on error
+//
+static uint8_t *emit_ir(uint8_t *p_pos, const IrInsn *p_ir, int num_insns)
+{
+    uint8_t x86_cond;
+    uint32_t call_offset = 0;           // offset of the last library call
+
+    ccr_reset();
+    for (const IrInsn *p_insn = p_ir; p_insn < p_ir + num_insns; p_insn++) {
+        if (p_insn->ir_flags & IR_DEAD)
+            continue;
+        const Operand *src = &p_insn->ir_src, *dst = &p_insn->ir_dst;
+        switch (p_insn->ir_opcode) {
+            case IR_MOVE:
+                // the ROL swapping the bytes of a word without MOVBE overwrites the CF (MOVE sets the flags
+                // anyway, but not the X flag)
+                if ((dst->op_length == 2) && !g_use_movbe)
+                    p_pos = ccr_write_x(p_pos);
+                if ((p_pos = x86_encode_move(p_pos, src, dst)) == NULL)
+                    return NULL;
+                // MOVEA doesn't set the flags
+                if (p_insn->ir_flags & IR_SETS_FLAGS)
+                    ccr_set_move(src, dst);
+                break;
+            case IR_SUB:
+                p_pos = ccr_set_native(p_pos, true);
+                p_pos = x86_encode_sub_imm_from_dreg(p_pos, src->op_value, dst->op_value);
+                break;
+            case IR_TEST:
+                p_pos = ccr_set_native(p_pos, false);
+                p_pos = x86_encode_test_dreg(p_pos, src->op_value, 4);
+                break;
+            case IR_LIB_CALL:
+                if (p_insn->ir_flags & IR_CALL_DIRECT) {
+                    if ((p_pos = emit_direct_call(p_pos, p_insn)) == NULL)
+                        return NULL;
+                    ccr_set_unknown();
+                    break;
+                }
+                // As the x86 doesn't support register + offset as operand for CALL, we need to
+                // add the offset to A6 before the CALL, but of course we have to save the old value
+                // and restore it after the call. Within a sequence of calls combined by the peephole
+                // optimizer, A6 stays saved and is just moved on to the next routine (the library
+                // routines preserve A6).
+                if (p_insn->ir_flags & IR_CALL_CONT) {
+                    if (src->op_value != call_offset)
+                        p_pos = x86_encode_add_imm_to_a6(p_pos, src->op_value - call_offset);
+                }
+                else {
+                    WRITE_BYTE(p_pos, 0x56);    // push rsi
+                    p_pos = x86_encode_add_imm_to_a6(p_pos, src->op_value);
+                }
+                call_offset = src->op_value;
+                WRITE_BYTE(p_pos, 0xff);        // call rsi
+                WRITE_BYTE(p_pos, 0xd6);
+                if (!(p_insn->ir_flags & IR_CALL_OPEN)) {
+                    WRITE_BYTE(p_pos, 0x5e);    // pop rsi
+                }
+                ccr_set_unknown();
+                break;
+            case IR_SCC:
+                p_pos = emit_scc(p_pos, p_insn->ir_cond, dst->op_value);
+                break;
+            case IR_RETURN:
+                p_pos = ccr_leave_tu(p_pos);
+                return emit_return(p_pos);
+            case IR_BRANCH:
+                p_pos = ccr_prepare_cond(p_pos, p_insn->ir_cond);
+                if ((x86_cond = ccr_get_cond(p_insn->ir_cond)) == COND_NEVER)
+                    break;
+                p_pos = ccr_leave_tu(p_pos);
+                if ((p_pos = emit_jump(p_pos, x86_cond, p_insn->p_target)) == NULL)
+                    return NULL;
+                if (x86_cond == COND_ALWAYS)
+                    return p_pos;
+                break;
+            case IR_CALL:
+                p_pos = ccr_leave_tu(p_pos);
+                if ((p_pos = emit_call(p_pos, p_insn)) == NULL)
+                    return NULL;
+                // the subroutine may have changed all flags when the code after the call is executed
+                ccr_set_unknown();
+                break;
+            case IR_DBRA:
+                p_pos = ccr_leave_tu(p_pos);
+                if ((p_pos = emit_dbra(p_pos, dst->op_value, p_insn->p_target)) == NULL)
+                    return NULL;
+                break;
+            case IR_JUMP:
+                p_pos = ccr_leave_tu(p_pos);
+                if (src->op_type == OP_TARGET) {
+                    if ((p_pos = emit_indirect_target(p_pos, p_insn)) == NULL)
+                        return NULL;
+                    return emit_jump_to_target(p_pos);
+                }
+                return emit_jump(p_pos, COND_ALWAYS, p_insn->p_target);
+        }
+    }
+    return p_pos;
+}
+
+
+//
+// opcode handlers
+//
+// All handlers have the following signature and return the number of bytes consumed,
+// which can be 0, or -1 in case of of an error. They decode the instruction and lower it into
+// the IR (usually one IR instruction), the x86 code is generated from the IR by emit_ir().
+// static int m68k_xxx(
+//     uint16_t      m68k_opcode,       // opcode to decode
+//     const uint8_t **inpos,           // current position in the input stream, will be updated
+//     IrInsn        **outpos           // current position in the IR, will be updated
+// )
+
+// get the guest registers an operand refers to as bit mask (see IrInsn)
+static inline uint16_t operand_regs(const Operand *op)
+{
+    switch (op->op_type) {
+        case OP_DREG:
+            return 1 << op->op_value;
+        case OP_AREG:
+        case OP_AREG_OFFSET:
+            return 1 << (op->op_value + 8);
+        case OP_TARGET:
+            return (op->op_base != NO_REG ? 1 << (op->op_base + 8) : 0) |
+                   (op->op_index != NO_REG ? 1 << (op->op_index & 0x0f) : 0);
+        default:
+            return 0;
+    }
+}
+
+// append IR instruction and advance current position pointer
+static inline void add_ir_insn(uint8_t opcode, uint8_t flags, const Operand *src, const Operand *dst, IrInsn **outpos)
+{
+    IrInsn insn = {.ir_opcode = opcode, .ir_flags = flags};
+    if (src != NULL) {
+        insn.ir_src = *src;
+        insn.ir_reg_uses |= operand_regs(src);
+    }
+    if (dst != NULL) {
+        insn.ir_dst = *dst;
+        if (opcode != IR_MOVE)
+            insn.ir_reg_uses |= operand_regs(dst);
+        if ((dst->op_type == OP_DREG) || (dst->op_type == OP_AREG))
+            insn.ir_reg_defs |= operand_regs(dst);
+    }
+    *(*outpos)++ = insn;
+}
+
+// append IR instruction jumping to another TU (which may use all registers and the flags)
+static void add_ir_jump(uint8_t opcode, uint8_t cond, const Operand *dst, const uint8_t *p_target, IrInsn **outpos)
+{
+    add_ir_insn(opcode, IR_USES_FLAGS, NULL, dst, outpos);
+    (*outpos)[-1].ir_cond = cond;
+    (*outpos)[-1].ir_reg_uses = IR_ALL_REGS;
+    (*outpos)[-1].p_target = p_target;
+}
+
+// append IR instruction calling a subroutine (the TU at p_target, or at the address in the OP_TARGET operand
+// src if it is given, p_target is then the address of the call itself) followed by the jump to the TU of the
+// following instruction, where the code continues when the subroutine returns (the subroutine may use and
+// change all registers)
+static void add_ir_call(const uint8_t *p_target, const Operand *src, const uint8_t *p_return, IrInsn **outpos)
+{
+    Operand ret = {OP_IMM, 4, .op_value = (uint32_t) (uintptr_t) p_return};
+    add_ir_jump(IR_CALL, 0, &ret, p_target, outpos);
+    if (src != NULL)
+        (*outpos)[-1].ir_src = *src;
+    (*outpos)[-1].ir_reg_defs = IR_ALL_REGS;
+    add_ir_jump(IR_JUMP, 0, NULL, p_return, outpos);
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-25 (BSR: page 4-59)
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-483
+static int m68k_bcc(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    int32_t offset;
+    int      nbytes_used;
+    uint8_t  cond = (m68k_opcode & 0x0f00) >> 8;
+
+    DEBUG("translating instruction BCC");
+    switch (m68k_opcode & 0x00ff) {
+        case 0x0000:
+            offset = (int16_t) read_word(inpos);
+            DEBUG("16-bit offset = %d", offset);
+            nbytes_used = 2;
+            break;
+        case 0x00ff:
+            offset = (int32_t) read_dword(inpos);
+            DEBUG("32-bit offset = %d", offset);
+            nbytes_used = 4;
+            break;
+        default:
+            offset = (int8_t) (m68k_opcode & 0x00ff);
+            DEBUG("8-bit offset = %d", offset);
+            nbytes_used = 0;
+    }
+    // conditional jump to the TU of the branch target followed by a jump to the TU of the following
+    // instruction, emit_ir() sets them up for later translation
+    // The offset of the branch target is calculated from the position after the *opcode*,
+    // so we need to subtract the number of bytes used for the offset itself.
+    // This method was inspired by a paper describing how VMware does binary translation:
+    // https://www.vmware.com/pdf/asplos235_adams.pdf
+    // (condition F is BSR, which calls the subroutine at the branch target instead)
+    if (cond == 0x1) {
+        add_ir_call(*inpos + offset - nbytes_used, NULL, *inpos, outpos);
+        return nbytes_used;
+    }
+    add_ir_jump(IR_BRANCH, cond, NULL, *inpos + offset - nbytes_used, outpos);
+    add_ir_jump(IR_JUMP, 0, NULL, *inpos, outpos);
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-91
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-545
+static int m68k_dbcc(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    Operand  op = {OP_DREG, 2, .op_value = m68k_opcode & 0x0007};
+
+    DEBUG("translating instruction DBCC");
+    // the offset is relative to the position after the opcode
+    int16_t offset = (int16_t) read_word(inpos);
+    DEBUG("register is D%d, branch target is %p", op.op_value, *inpos - 2 + offset);
+    // exit the loop if the condition is met, otherwise decrement the register and branch unless it is -1
+    add_ir_jump(IR_BRANCH, (m68k_opcode & 0x0f00) >> 8, NULL, *inpos, outpos);
+    add_ir_jump(IR_DBRA, 0, &op, *inpos - 2 + offset, outpos);
+    add_ir_jump(IR_JUMP, 0, NULL, *inpos, outpos);
+    return 2;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-173
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-583
+static int m68k_scc(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    Operand  op;
+    int      nbytes_used;
+
+    DEBUG("translating instruction SCC");
+    nbytes_used = extract_operand(m68k_opcode & 0x003f, inpos, &op);
+    if (op.op_type != OP_DREG) {
+        ERROR("only data register supported as destination operand");
+        return -1;
+    }
+    add_ir_insn(IR_SCC, IR_USES_FLAGS, NULL, &op, outpos);
+    (*outpos)[-1].ir_cond = (m68k_opcode & 0x0f00) >> 8;
+    return nbytes_used;
+}
+
+// extract the target address of JMP / JSR from the instruction stream, either as OP_IMM operand if it
+// is known at translation time (absolute and PC-relative addresses), or as OP_TARGET operand if it is
+// only known at runtime (relative to an address register or with an index register), returns the
+// number of bytes used or -1 if the addressing mode is not supported
+static int extract_target(uint8_t mode_reg, const uint8_t **inpos, Operand *op)
+{
+    const uint8_t *p_ext = *inpos;      // PC-relative addresses are relative to the extension word
+    uint16_t ext;
+
+    op->op_type = OP_TARGET;
+    op->op_length = 4;
+    op->op_base = op->op_index = NO_REG;
+    switch (mode_reg) {
+        case 0x10: case 0x11: case 0x12: case 0x13:
+        case 0x14: case 0x15: case 0x16:
+            DEBUG("target address is in register A%d", mode_reg & 0x07);
+            op->op_base = mode_reg & 0x07;
+            op->op_value = 0;
+            return 0;
+        case 0x28: case 0x29: case 0x2a: case 0x2b:
+        case 0x2c: case 0x2d: case 0x2e:
+            DEBUG("target address is register A%d with offset", mode_reg & 0x07);
+            op->op_base = mode_reg & 0x07;
+            op->op_value = (uint32_t) (int16_t) read_word(inpos);
+            return 2;
+        case 0x30: case 0x31: case 0x32: case 0x33:
+        case 0x34: case 0x35: case 0x36:
+            DEBUG("target address is register A%d with index and offset", mode_reg & 0x07);
+            op->op_base = mode_reg & 0x07;
+            op->op_value = 0;
+            break;
+        case 0x38:
+            op->op_type = OP_IMM;
+            op->op_value = (uint32_t) (int16_t) read_word(inpos);
+            DEBUG("target address is 0x%08x", op->op_value);
+            return 2;
+        case 0x39:
+            op->op_type = OP_IMM;
+            op->op_value = read_dword(inpos);
+            DEBUG("target address is 0x%08x", op->op_value);
+            return 4;
+        case 0x3a:
+            op->op_type = OP_IMM;
+            op->op_value = (uint32_t) (uintptr_t) (p_ext + (int16_t) read_word(inpos));
+            DEBUG("target address is 0x%08x", op->op_value);
+            return 2;
+        case 0x3b:
+            // typically a jump table (JMP <table>(PC, D0.W) with D0 = offset of the entry for the case)
+            DEBUG("target address is PC with index and offset");
+            op->op_value = (uint32_t) (uintptr_t) p_ext;
+            break;
+        default:
+            // A7 isn't supported because it is changed by the translated code before the address is calculated
+            ERROR("addressing mode 0x%02x not supported for JMP / JSR", mode_reg);
+            return -1;
+    }
+    // brief extension word: D/A, register, W/L, scale (68020 and later), 0, 8-bit offset
+    ext = read_word(inpos);
+    if ((ext & 0x0700) != 0) {
+        ERROR("only brief extension word without scale factor supported");
+        return -1;
+    }
+    if ((ext >> 12) == REG_A7) {
+        ERROR("A7 not supported as index register");
+        return -1;
+    }
+    op->op_index = (ext >> 12) | ((ext & 0x0800) ? INDEX_LONG : 0);
+    op->op_value += (uint32_t) (int8_t) (ext & 0x00ff);
+    DEBUG("index register is %c%d.%c, offset is %d",
+          (ext & 0x8000) ? 'A' : 'D', (ext >> 12) & 0x07, (ext & 0x0800) ? 'L' : 'W', (int8_t) (ext & 0x00ff));
+    return 2;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-108
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-499
+static int m68k_jmp(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    const uint8_t *p_insn = *inpos - 2;
+    Operand  op;
+    int      nbytes_used;
+
+    DEBUG("translating instruction JMP");
+    if ((m68k_opcode & 0x003f) == 0x2e) {
+        ERROR("JMP d16(A6) (into the jump table of a library) not supported");
+        return -1;
+    }
+    if ((nbytes_used = extract_target(m68k_opcode & 0x003f, inpos, &op)) == -1)
+        return -1;
+    if (op.op_type == OP_IMM) {
+        add_ir_jump(IR_JUMP, 0, NULL, (const uint8_t *) (uintptr_t) op.op_value, outpos);
+    }
+    else {
+        // the TU of the target is looked up at runtime, see emit_indirect_target()
+        add_ir_jump(IR_JUMP, 0, NULL, p_insn, outpos);
+        (*outpos)[-1].ir_src = op;
+    }
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-109
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 3-122
+static int m68k_jsr(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    const uint8_t *p_insn = *inpos - 2;
+    Operand  op;
+    int      nbytes_used;
+
+    DEBUG("translating instruction JSR");
+    if ((m68k_opcode & 0x003f) == 0x2e) {
+        // special case: d16(A6) => we assume this is a call of a library routine
+        Operand offset = {OP_IMM, 4, .op_value = (uint32_t) (int16_t) read_word(inpos)};
+        // the library routine may use any register as argument and clobbers the flags
+        add_ir_insn(IR_LIB_CALL, IR_SETS_FLAGS, &offset, NULL, outpos);
+        (*outpos)[-1].ir_reg_uses = IR_ALL_REGS;
+        return 2;
+    }
+    if ((nbytes_used = extract_target(m68k_opcode & 0x003f, inpos, &op)) == -1)
+        return -1;
+    if (op.op_type == OP_IMM)
+        add_ir_call((const uint8_t *) (uintptr_t) op.op_value, NULL, *inpos, outpos);
+    else
+        add_ir_call(p_insn, &op, *inpos, outpos);
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-119
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
+static int m68k_movea(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    Operand  srcop, dstop = {OP_AREG, 4, .op_value = (m68k_opcode & 0x0e00) >> 9};
+    int      nbytes_used;
+
+    DEBUG("translating instruction MOVEA");
+    if ((m68k_opcode & 0x3000) != 0x2000) {
+        ERROR("only long operation supported");
+        return -1;
+    }
+    DEBUG("destination register is A%d", dstop.op_value);
+    nbytes_used = extract_operand(m68k_opcode & 0x003f, inpos, &srcop);
+    if ((srcop.op_type != OP_MEM) && (srcop.op_type != OP_IMM)) {
+        ERROR("invalid operand type %d for MOVEA", srcop.op_type);
+        return -1;
+    }
+#ifndef TEST
+    // replace the original value of AbsExecBase (0x0000004) with the address where the base address of Exec library is stored
+    if ((srcop.op_type == OP_MEM) && (srcop.op_value == 0x4))
+        srcop.op_value = ABS_EXEC_BASE;
+#endif
+    // MOVEA doesn't set the flags
+    add_ir_insn(IR_MOVE, 0, &srcop, &dstop, outpos);
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-134
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static int m68k_moveq(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    // immediate value as sign-extended 32-bit value
+    Operand  srcop = {OP_IMM, 4, .op_value = (uint32_t) (int8_t) (m68k_opcode & 0x00ff)};
+    Operand  dstop = {OP_DREG, 4, .op_value = (m68k_opcode & 0x0e00) >> 9};
+
+    DEBUG("translating instruction MOVEQ");
+    DEBUG("destination register is D%d", dstop.op_value);
+    DEBUG("immediate value = %d", (int32_t) srcop.op_value);
+    add_ir_insn(IR_MOVE, IR_SETS_FLAGS, &srcop, &dstop, outpos);
+    return 0;
+}
+#pragma GCC diagnostic pop
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-116
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-35
+static int m68k_move(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    uint8_t  src_mode_reg = m68k_opcode & 0x003f;
+    uint8_t  dst_mode_reg = (m68k_opcode & 0x0fc0) >> 6;
+    // operand length for the size field: byte (01), word (11) or long (10)
+    uint8_t  length = (m68k_opcode & 0x1000) ? ((m68k_opcode & 0x2000) ? 2 : 1) : 4;
+    Operand  srcop, dstop;
+    int      nbytes_used = 0;
+
+    DEBUG("translating instruction MOVE");
+    nbytes_used += extract_operand(src_mode_reg, inpos, &srcop);
+    // destination operand has mode and register parts swapped
+    dst_mode_reg = ((dst_mode_reg & 0x07) << 3) | ((dst_mode_reg & 0x38) >> 3);
+    nbytes_used += extract_operand(dst_mode_reg, inpos, &dstop);
+    // combinations of source / destination operand type emit_ir() can generate code for
+    if (!(((srcop.op_type == OP_MEM)  && (dstop.op_type == OP_DREG)) ||
+          ((srcop.op_type == OP_IMM)  && (dstop.op_type == OP_DREG)) ||
+          ((srcop.op_type == OP_DREG) && (dstop.op_type == OP_MEM))  ||
+          ((srcop.op_type == OP_DREG) && (dstop.op_type == OP_DREG)))) {
+        ERROR("combination of source / destination operand types %d / %d not supported", srcop.op_type, dstop.op_type);
+        return -1;
+    }
+    if ((length != 4) && (srcop.op_type != OP_MEM) && (dstop.op_type != OP_MEM)) {
+        ERROR("only long operation supported without memory operand");
+        return -1;
+    }
+    srcop.op_length = dstop.op_length = length;
+    add_ir_insn(IR_MOVE, IR_SETS_FLAGS, &srcop, &dstop, outpos);
+    // a byte or word moved into a data register leaves the rest of it alone
+    if ((length != 4) && (dstop.op_type == OP_DREG))
+        (*outpos)[-1].ir_reg_uses |= operand_regs(&dstop);
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-169
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-553
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static int m68k_rts(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    DEBUG("translating instruction RTS");
+    add_ir_jump(IR_RETURN, 0, NULL, NULL, outpos);
+    return 0;
+}
+#pragma GCC diagnostic pop
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-181
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-654
+static int m68k_subq_32(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    Operand  srcop = {OP_IMM, 4, .op_value = (m68k_opcode & 0x0e00) >> 9 ?: 8}, dstop;  // 0 means 8
+    int      nbytes_used;
+
+    DEBUG("translating instruction SUBQ");
+    if ((m68k_opcode & 0x00c0) != 0x0080) {
+        ERROR("only long operation supported");
+        return -1;
+    }
+    DEBUG("immediate value = %d", srcop.op_value);
+    nbytes_used = extract_operand(m68k_opcode & 0x003f, inpos, &dstop);
+    if (dstop.op_type != OP_DREG) {
+        ERROR("only data register supported as destination operand");
+        return -1;
+    }
+    add_ir_insn(IR_SUB, IR_SETS_FLAGS, &srcop, &dstop, outpos);
+    return nbytes_used;
+}
+
+// Motorola M68000 Family Programmer’s Reference Manual, page 4-193
+// Intel 64 and IA-32 Architectures Software Developer’s Manual, Volume 2, Instruction Set Reference, page 4-679
+static int m68k_tst_32(uint16_t m68k_opcode, const uint8_t **inpos, IrInsn **outpos)
+{
+    Operand  op;
+    int      nbytes_used;
+
+    DEBUG("translating instruction TST");
+    if ((m68k_opcode & 0x00c0) != 0x0080) {
+        ERROR("only long operation supported");
+        return -1;
+    }
+    nbytes_used = extract_operand(m68k_opcode & 0x003f, inpos, &op);
+    if (op.op_type != OP_DREG) {
+        ERROR("only data register supported as destination operand");
+        return -1;
+    }
+    add_ir_insn(IR_TEST, IR_SETS_FLAGS, &op, NULL, outpos);
+    return nbytes_used;
 }
 
 
 //
 // check if opcode is using a valid effective address mode (code is copied straight from Musashi)
 //
+#if defined(TEST) || defined(GENERATE_OPCODE_TBL)
 static bool valid_ea_mode(uint16_t opcode, uint16_t mask)
 {
 	if (mask == 0)
@@ -540,10 +1515,11 @@ static bool valid_ea_mode(uint16_t opcode, uint16_t mask)
 	}
 	return false;
 }
+#endif
 
 
 //
-// opcode info table (copied from Musashi), with just the 8 instructions which are used
+// opcode info table (copied from Musashi), with just the instructions which are used
 // in the test program, needs to be sorted by the number of set bits in mask in descending
 // order to ensure the longest match wins, lives here instead of in the header because
 // we don't want to export the handler functions
@@ -551,10 +1527,14 @@ static bool valid_ea_mode(uint16_t opcode, uint16_t mask)
 static const OpcodeInfo opcode_info_tbl[] = {
 //   opcode handler      mask    match   effective address mask     terminal y/n?
     {m68k_rts          , 0xffff, 0x4e75, 0x000,                     true},       // rts
+    {m68k_jsr          , 0xffff, 0x4eae, 0x000,                     false},      // jsr d16(a6) (library call)
     {m68k_tst_32       , 0xffc0, 0x4a80, 0xbf8,                     false},      // tst.l
-    {m68k_jsr          , 0xffc0, 0x4e80, 0x27b,                     false},      // jsr
+    {m68k_jsr          , 0xffc0, 0x4e80, 0x27b,                     true},       // jsr
+    {m68k_jmp          , 0xffc0, 0x4ec0, 0x27b,                     true},       // jmp
+    {m68k_dbcc         , 0xf0f8, 0x50c8, 0x000,                     true},       // dbcc
     {m68k_subq_32      , 0xf1c0, 0x5180, 0xff8,                     false},      // subq.l
     {m68k_movea        , 0xf1c0, 0x2040, 0xfff,                     false},      // movea.*
+    {m68k_scc          , 0xf0c0, 0x50c0, 0xbf8,                     false},      // scc
     {m68k_moveq        , 0xf100, 0x7000, 0x000,                     false},      // moveq.l
     {m68k_bcc          , 0xf000, 0x6000, 0x000,                     true},       // bcc.*
     {m68k_move         , 0xf000, 0x1000, 0xbff,                     false},      // move.b
@@ -566,7 +1546,11 @@ static const OpcodeInfo opcode_info_tbl[] = {
 
 //
 // initialize opcode info lookup table
+// This is only done at build time: the program mkopctbl (this file compiled with GENERATE_OPCODE_TBL)
+// builds the table and writes it as opcode_index_tbl, which holds the index + 1 of the entry in
+// opcode_info_tbl (0 = opcode not supported) for each opcode, one byte each instead of a pointer.
 //
+#if defined(TEST) || defined(GENERATE_OPCODE_TBL)
 static void init_opc_info_lookup_tbl (const OpcodeInfo **pp_opc_info_lookup_tbl)
 {
     // build table with all 65536 possible opcodes and their handlers on first run
@@ -592,42 +1576,161 @@ static void init_opc_info_lookup_tbl (const OpcodeInfo **pp_opc_info_lookup_tbl)
         }
     }
 }
+#endif
 
 
 //
-// set up a translation unit for later translation when it is about to execute
-// (basically a stub for the actual TU that calls translate_tu() upon execution)
+// set up the dispatchers, the code shared by all stubs that calls translate_tu() and then
+// continues with the translated code, and the code shared by all tier-0 TUs that calls optimize_tu()
+// when they have become hot (needs to be called before the cache is loaded from a file because
+// the code in there expects the dispatchers at the start of the cache)
 //
-uint8_t *setup_tu(const uint8_t *p_m68k_code)
-{
-    uint8_t *p_x86_code;
+static uint8_t *p_dispatcher = NULL;
+static uint8_t *p_tier1_dispatcher = NULL;
+static uint8_t *p_indirect_dispatcher = NULL;   // translates the TU at the address on the stack (the guest starts with)
+static uint8_t *p_return_dispatcher = NULL;     // RTS continues here if the shadow stack didn't predict the return
+static uint8_t *p_guest_entry = NULL;           // code the host calls to run the guest, see setup_program()...
+static uint8_t *p_guest_exit = NULL;            // ... and where the main routine of the guest returns to
+uint32_t g_tier1_threshold = DEFAULT_TIER1_THRESHOLD;
 
-    // check if TU is already in the cache
-    if ((p_x86_code = tc_get_addr(gp_tlcache, p_m68k_code)) != NULL) {
-        DEBUG("TU with source address %p is already in the cache - nothing to do", p_m68k_code);
-        return p_x86_code;
-    }
+// (defined further below, they call the translator)
+static uint8_t *resolve_tu(const uint8_t *p_m68k_code, uint32_t entry_a6);
+static uint8_t *resolve_return(const uint8_t *p_guest_ret, uint32_t entry_a6);
+static uint8_t *resolve_branch(const uint8_t *p_m68k_code, uint32_t entry_a6);
 
-    // get memory block for the translated code and put mapping of source to destination address into cache
-    if ((p_x86_code = tc_get_code_block(gp_tlcache)) == NULL) {
-        ERROR("could not get memory block for translated code");
-        return NULL;
-    }
-    if (!tc_put_addr(gp_tlcache, p_m68k_code, p_x86_code)) {
-        ERROR("could not put mapping of source to destination address into cache");
-        return NULL;
+
+//
+// speculative translation: the TUs set up by setup_tu() (the targets of the branches in the code
+// translated so far) are put into a queue and translated ahead of execution by a worker thread, see
+// spec_translation_worker()
+// The translator and the cache are used by the guest (via the dispatchers) and the worker, so they
+// are protected by a lock while the worker is running. The queue itself is lock-free: entries are
+// only added with the lock held (one producer at a time) and only taken by the worker.
+//
+#define SPEC_QUEUE_SIZE 1024            // must be a power of 2
+bool g_spec_translation = false;
+static bool spec_running = false;
+static pthread_t spec_thread;
+static atomic_int translator_lock = 0;          // futex, see lock_translator()
+static __thread sigset_t saved_sigmask;
+static const uint8_t *spec_queue[SPEC_QUEUE_SIZE];
+static atomic_uint spec_queue_head = 0;         // next entry the worker takes
+static atomic_uint spec_queue_tail = 0;         // next entry to be added
+static sem_t spec_queue_sem;                    // counts the entries in the queue
+static atomic_bool spec_stop = false;
+static __thread sigjmp_buf fault_env;           // where the speculative and the AOT workers continue if they...
+static __thread volatile sig_atomic_t reading_code = 0;        // ... read unmapped guest code, see recover_from_translation_fault()
+
+// lock the translator and the cache (only while the speculative translator is running)
+// SIGUSR1 is blocked while the lock is held because its handler patches the trace sites in the
+// C code, and takes the lock itself so that the worker is not executing any of them meanwhile.
+// The lock is also taken by the SIGSEGV handler (see handle_segv() in execute.c), so it is a futex
+// (0 = free, 1 = taken, 2 = taken and contended) instead of a mutex - this only uses system calls
+// and atomic operations and is therefore async-signal-safe. The guest thread never holds the lock
+// while it writes to guest memory, so the handler can't interrupt its own thread holding it.
+void lock_translator()
+{
+    if (spec_running) {
+        sigset_t sigmask;
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &sigmask, &saved_sigmask);
+        int state = 0;
+        if (!atomic_compare_exchange_strong(&translator_lock, &state, 1)) {
+            if (state != 2)
+                state = atomic_exchange(&translator_lock, 2);
+            while (state != 0) {
+                syscall(SYS_futex, &translator_lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+                state = atomic_exchange(&translator_lock, 2);
+            }
+        }
+    }
+}
+
+
+void unlock_translator()
+{
+    if (spec_running) {
+        if (atomic_exchange(&translator_lock, 0) == 2)
+            syscall(SYS_futex, &translator_lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        pthread_sigmask(SIG_SETMASK, &saved_sigmask, NULL);
     }
+}
 
-    // generate code to call translate_tu()
-    // We fill the memory block with NOPs which get overwritten by the generated code below,
-    // starting at position 0 in the block, and the translated code, starting at position
-    // START_OF_TRANSLATED_CODE (128). This way, we don't need to jump to the translated code
-    // but we create a NOP sled instead. We just need to make sure the code below needed
-    // to call translate_tu() never exceeds 128 bytes (currently 56 bytes).
-    // TODO: Make the emit_* functions return the number of bytes generated. Then we can
-    //       calculate the total number of bytes and use a relative jump instead of the NOP sled
-    memset(p_x86_code, OPCODE_NOP, MAX_CODE_BLOCK_SIZE);
-    uint8_t *p_pos = p_x86_code;
+
+// add a TU to the queue of the speculative translator (with the lock held)
+static void enqueue_spec_tu(const uint8_t *p_m68k_code)
+{
+    unsigned int tail = atomic_load_explicit(&spec_queue_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&spec_queue_head, memory_order_acquire) == SPEC_QUEUE_SIZE) {
+        ++gp_tlcache->num_spec_dropped;
+        return;
+    }
+    spec_queue[tail % SPEC_QUEUE_SIZE] = p_m68k_code;
+    atomic_store_explicit(&spec_queue_tail, tail + 1, memory_order_release);
+    sem_post(&spec_queue_sem);
+}
+
+
+//
+// ahead-of-time translation: the TUs still to be translated are kept in a list (used as a stack),
+// which the TUs set up by the translation of other TUs are added to, and a pool of threads takes
+// them from there, see translate_program()
+//
+static TranslationUnit **pp_aot_tus = NULL;
+static int num_aot_tus, max_aot_tus;
+static int num_aot_threads, num_aot_busy;       // number of threads and how many of them are translating right now
+static bool is_aot_failed;
+static pthread_cond_t aot_cond = PTHREAD_COND_INITIALIZER;
+
+// add a TU to the list (with the lock held)
+static void push_aot_tu(TranslationUnit *p_tu)
+{
+    if (num_aot_tus == max_aot_tus) {
+        TranslationUnit **pp_tus;
+        if ((pp_tus = realloc(pp_aot_tus, 2 * max_aot_tus * sizeof(TranslationUnit *))) == NULL) {
+            ERROR("could not allocate memory for list of TUs");
+            is_aot_failed = true;
+            return;
+        }
+        pp_aot_tus = pp_tus;
+        max_aot_tus *= 2;
+    }
+    pp_aot_tus[num_aot_tus++] = p_tu;
+    if (is_parallel)
+        pthread_cond_signal(&aot_cond);
+}
+
+// The return dispatcher is entered with the return address on top of the guest stack instead of
+// the source address pushed by a stub. It copies it into a slot of the same size as the one of the
+// stubs (which RET replaces with the address of the translated code) and removes it when it returns.
+// The branch dispatcher is entered by an indirect branch whose target is not in the cache, it pushes
+// the target address stored in the shadow stack area by the branch, like a stub would.
+#define DISPATCH_STUB   0
+#define DISPATCH_RETURN 1
+#define DISPATCH_BRANCH 2
+
+static uint8_t *emit_dispatcher(uint8_t *(*p_func)(const uint8_t *, uint32_t), int kind)
+{
+    uint8_t *p_dispatcher_code;
+    if ((p_dispatcher_code = tc_alloc_code(gp_tlcache, MAX_DISPATCHER_SIZE)) == NULL) {
+        ERROR("could not get memory block for the dispatcher");
+        return NULL;
+    }
+    uint8_t *p_pos = TC_WRITABLE(gp_tlcache, p_dispatcher_code);
+    if (kind == DISPATCH_RETURN) {
+        // PUSH qword [RSP]
+        WRITE_BYTE(p_pos, 0xff);
+        WRITE_BYTE(p_pos, 0x34);
+        WRITE_BYTE(p_pos, 0x24);
+    }
+    else if (kind == DISPATCH_BRANCH) {
+        // PUSH qword [<target address of the branch>]
+        WRITE_BYTE(p_pos, 0xff);
+        WRITE_BYTE(p_pos, 0x34);
+        WRITE_BYTE(p_pos, 0x25);
+        WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(indirect_src));
+    }
     // Amiga programs of course don't expect a function call to happen upon the execution
     // of a branch instruction and thus expect registers and flags to be preserved across
     // branch instructions (the call to translate_tu() needs to be completely transparent
@@ -635,109 +1738,1533 @@ uint8_t *setup_tu(const uint8_t *p_m68k_code)
     // registers that needed to be preserved in AmigaOS, and in addition also A0/A1, D0/D1
     // and RFLAGS.
     p_pos = emit_save_program_state(p_pos);
-    // call translate_tu() with address of this TU as argument
-    // TODO: check return value
-    p_pos = emit_move_imm_to_reg(p_pos, (uint64_t) p_m68k_code, REG_RDI, MODE_64);
+    // call the function with the source address of the TU as argument, which the stub
+    // has pushed onto the stack before jumping here, and A6 as second argument (it is already
+    // in RSI, which is where the x86-64 ABI expects the second argument)
+    p_pos = emit_move_stack_to_reg(p_pos, PROGRAM_STATE_SIZE, REG_RDI);
 #pragma GCC diagnostic ignored "-Wcast-function-type"
-    p_pos = emit_abs_call_to_func(p_pos, (void (*)()) translate_tu);
+    p_pos = emit_abs_call_to_func(p_pos, (void (*)()) p_func);
 #pragma GCC diagnostic pop
+    // terminate the guest with an invalid opcode exception if the translation failed
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_TEST_REG_REG);
+    WRITE_BYTE(p_pos, 0xc0);                        // MOD-REG-R/M byte with RAX as both operands
+    WRITE_BYTE(p_pos, OPCODE_JNZ_REL8);
+    WRITE_BYTE(p_pos, 2);
+    WRITE_BYTE(p_pos, PREFIX_0F);
+    WRITE_BYTE(p_pos, OPCODE_UD2);
+    // replace the source address on the stack with the address of the translated code, so
+    // that the RET below continues with the translated code
+    p_pos = emit_move_reg_to_stack(p_pos, REG_RAX, PROGRAM_STATE_SIZE);
     p_pos = emit_restore_program_state(p_pos);
+    if (kind == DISPATCH_RETURN) {
+        // RET 4
+        WRITE_BYTE(p_pos, 0xc2);
+        WRITE_BYTE(p_pos, 4);
+        WRITE_BYTE(p_pos, 0);
+    }
+    else {
+        WRITE_BYTE(p_pos, OPCODE_RET);
+    }
+    assert(p_pos - TC_WRITABLE(gp_tlcache, p_dispatcher_code) <= MAX_DISPATCHER_SIZE);
+    return p_dispatcher_code;
+}
+
+
+//
+// The following functions emit the code shared by the subroutine calls and returns in the translated
+// code (see emit_call() and emit_return()), the helpers use RCX, RDX and RAX as scratch registers
+// (saved on the stack) and LEA and JRCXZ for arithmetic and comparisons because they must not change
+// the flags.
+//
+
+// emit the push helper, which is followed by a JMP of jump_size bytes to the subroutine in the translated
+// code (the return address is at RSP + 8 when it is entered)
+static uint8_t *emit_shadow_push(uint8_t jump_size)
+{
+    uint8_t *p_helper_code;
+    if ((p_helper_code = tc_alloc_code(gp_tlcache, MAX_DISPATCHER_SIZE)) == NULL) {
+        ERROR("could not get memory block for the shadow stack push helper");
+        return NULL;
+    }
+    uint8_t *p_pos = TC_WRITABLE(gp_tlcache, p_helper_code);
+    // PUSH RCX, PUSH RDX, MOV ECX, [<top>]
+    p_pos = emit_push_reg(p_pos, REG_RCX);
+    p_pos = emit_push_reg(p_pos, REG_RDX);
+    p_pos = emit_move_abs_to_reg(p_pos, SHADOW_FIELD_ADDRESS(p_top), REG_ECX);
+    // if the shadow stack is full, start over at the first entry after the return to the host (the
+    // older calls are then just not predicted when they return):
+    // LEA ECX, [RCX - <end>], JRCXZ +8, LEA ECX, [RCX + <end>], JMP +5, MOV ECX, <first entry>
+    uint32_t end = SHADOW_FIELD_ADDRESS(entries[SHADOW_STACK_SIZE]);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x89);
+    WRITE_DWORD(p_pos, -end);
+    WRITE_BYTE(p_pos, OPCODE_JRCXZ_REL8);
+    WRITE_BYTE(p_pos, 8);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x89);
+    WRITE_DWORD(p_pos, end);
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL8);
+    WRITE_BYTE(p_pos, 5);
+    p_pos = emit_move_imm_to_reg(p_pos, SHADOW_FIELD_ADDRESS(entries[2]), REG_ECX, MODE_32);
+    // MOV EDX, [RSP + 24], MOV [RCX], EDX (return address on the guest stack)
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x54);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, 24);
+    WRITE_BYTE(p_pos, OPCODE_MOV_REG_MEM);
+    WRITE_BYTE(p_pos, 0x11);
+    // MOV RDX, [RSP + 16], LEA RDX, [RDX + <jump size>], MOV [RCX + 8], RDX (address after the JMP following the CALL of the helper)
+    p_pos = emit_move_stack_to_reg(p_pos, 16, REG_RDX);
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x52);
+    WRITE_BYTE(p_pos, jump_size);
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_MOV_REG_MEM);
+    WRITE_BYTE(p_pos, 0x51);
+    WRITE_BYTE(p_pos, offsetof(ShadowEntry, p_host_ret));
+    // LEA ECX, [RCX + 16], MOV [<top>], ECX
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x49);
+    WRITE_BYTE(p_pos, sizeof(ShadowEntry));
+    p_pos = emit_move_reg_to_abs(p_pos, REG_ECX, SHADOW_FIELD_ADDRESS(p_top));
+    // POP RDX, POP RCX, RET
+    p_pos = emit_pop_reg(p_pos, REG_RDX);
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    WRITE_BYTE(p_pos, OPCODE_RET);
+    assert(p_pos - TC_WRITABLE(gp_tlcache, p_helper_code) <= MAX_DISPATCHER_SIZE);
+    return p_helper_code;
+}
+
+// emit the pop helper (called by RTS, so the return address is at RSP + 8 when it is entered)
+static uint8_t *emit_shadow_pop()
+{
+    uint8_t *p_helper_code;
+    if ((p_helper_code = tc_alloc_code(gp_tlcache, MAX_DISPATCHER_SIZE)) == NULL) {
+        ERROR("could not get memory block for the shadow stack pop helper");
+        return NULL;
+    }
+    uint8_t *p_pos = TC_WRITABLE(gp_tlcache, p_helper_code);
+    // PUSH RCX, PUSH RDX, PUSH RAX, MOV EDX, [<top>]
+    p_pos = emit_push_reg(p_pos, REG_RCX);
+    p_pos = emit_push_reg(p_pos, REG_RDX);
+    p_pos = emit_push_reg(p_pos, REG_RAX);
+    p_pos = emit_move_abs_to_reg(p_pos, SHADOW_FIELD_ADDRESS(p_top), REG_EDX);
+    // MOV EAX, [RDX - 16], NOT EAX (return address recorded by the last call, complemented),
+    // MOV ECX, [RSP + 32], LEA ECX, [RCX + RAX + 1] (return address on the guest stack minus the recorded one)
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x42);
+    WRITE_BYTE(p_pos, (uint8_t) -sizeof(ShadowEntry));
+    WRITE_BYTE(p_pos, 0xf7);
+    WRITE_BYTE(p_pos, 0xd0);
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x4c);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, 32);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x4c);
+    WRITE_BYTE(p_pos, 0x01);
+    WRITE_BYTE(p_pos, 0x01);
+    // JRCXZ +16 (the addresses match), MOV qword [<target>], <return dispatcher>, POP RAX, POP RDX, POP RCX, RET
+    WRITE_BYTE(p_pos, OPCODE_JRCXZ_REL8);
+    WRITE_BYTE(p_pos, 16);
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, 0xc7);
+    WRITE_BYTE(p_pos, 0x04);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_target));
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+    WRITE_DWORD(p_pos, (uint32_t) p_return_dispatcher);
+#pragma GCC diagnostic pop
+    p_pos = emit_pop_reg(p_pos, REG_RAX);
+    p_pos = emit_pop_reg(p_pos, REG_RDX);
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    WRITE_BYTE(p_pos, OPCODE_RET);
+    // LEA EDX, [RDX - 16], MOV [<top>], EDX, MOV RDX, [RDX + 8], MOV [<target>], RDX
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x52);
+    WRITE_BYTE(p_pos, (uint8_t) -sizeof(ShadowEntry));
+    p_pos = emit_move_reg_to_abs(p_pos, REG_EDX, SHADOW_FIELD_ADDRESS(p_top));
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_MOV_MEM_REG);
+    WRITE_BYTE(p_pos, 0x52);
+    WRITE_BYTE(p_pos, offsetof(ShadowEntry, p_host_ret));
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_MOV_REG_MEM);
+    WRITE_BYTE(p_pos, 0x14);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_target));
+    // POP RAX, POP RDX, POP RCX, RET 4 (removing the return address from the guest stack)
+    p_pos = emit_pop_reg(p_pos, REG_RAX);
+    p_pos = emit_pop_reg(p_pos, REG_RDX);
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    WRITE_BYTE(p_pos, 0xc2);
+    WRITE_BYTE(p_pos, 4);
+    WRITE_BYTE(p_pos, 0);
+    assert(p_pos - TC_WRITABLE(gp_tlcache, p_helper_code) <= MAX_DISPATCHER_SIZE);
+    return p_helper_code;
+}
+
+// emit the code the host calls to run the guest (and the code the main routine returns to), it
+// pushes the return address for the main routine and jumps to the TU the guest starts with via
+// the indirect dispatcher (the TU may have been translated already, e.g. in an earlier run)
+static bool emit_guest_entry()
+{
+    if ((p_guest_entry = tc_alloc_code(gp_tlcache, MAX_DISPATCHER_SIZE)) == NULL) {
+        ERROR("could not get memory block for the guest entry code");
+        return false;
+    }
+    uint8_t *p_pos = TC_WRITABLE(gp_tlcache, p_guest_entry);
+    // LEA RSP, [RSP - 4], MOV dword [RSP], <GUEST_EXIT_ADDRESS> (big-endian)
+    WRITE_BYTE(p_pos, PREFIX_REXW);
+    WRITE_BYTE(p_pos, OPCODE_LEA);
+    WRITE_BYTE(p_pos, 0x64);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_BYTE(p_pos, 0xfc);
+    WRITE_BYTE(p_pos, 0xc7);
+    WRITE_BYTE(p_pos, 0x04);
+    WRITE_BYTE(p_pos, 0x24);
+    WRITE_DWORD(p_pos, htonl(GUEST_EXIT_ADDRESS));
+    // MOV dword [<top>], <first entry after the return to the host>
+    WRITE_BYTE(p_pos, 0xc7);
+    WRITE_BYTE(p_pos, 0x04);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_top));
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(entries[2]));
+    // PUSH qword [<source address of the first TU>], JMP <indirect dispatcher>
+    WRITE_BYTE(p_pos, 0xff);
+    WRITE_BYTE(p_pos, 0x34);
+    WRITE_BYTE(p_pos, 0x25);
+    WRITE_DWORD(p_pos, SHADOW_FIELD_ADDRESS(p_entry));
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL32);
+    WRITE_DWORD(p_pos, p_indirect_dispatcher - (p_guest_entry + (p_pos + 4 - TC_WRITABLE(gp_tlcache, p_guest_entry))));
+    // RET (guest exit)
+    p_guest_exit = p_guest_entry + (p_pos - TC_WRITABLE(gp_tlcache, p_guest_entry));
+    WRITE_BYTE(p_pos, OPCODE_RET);
+    return true;
+}
+
+
+// reset the shadow stack, necessary whenever translated code its entries point to may have become invalid
+// (all returns then go through the return dispatcher until the corresponding calls have been executed again)
+void reset_shadow_stack()
+{
+    ShadowStack *p_shadow = SHADOW_STACK;
+    // the first entry never matches because return addresses are even
+    p_shadow->entries[0] = (ShadowEntry) {0xffffffff, 0, NULL};
+    p_shadow->entries[1] = (ShadowEntry) {htonl(GUEST_EXIT_ADDRESS), 0, p_guest_exit};
+    p_shadow->p_top = &p_shadow->entries[2];
+}
+
+
+bool setup_dispatchers()
+{
+    // the translated code uses MOVBE from now on if the CPU supports it (the cache must not be
+    // loaded from a file created with different features)
+    unsigned int eax, ebx, ecx, edx;
+    g_use_movbe = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_MOVBE);
+    gp_tlcache->code_features = g_use_movbe ? TC_FEATURE_MOVBE : 0;
+    DEBUG("CPU %s MOVBE", g_use_movbe ? "supports" : "doesn't support");
+    if (mmap((void *) SHADOW_STACK_ADDRESS,
+             sizeof(ShadowStack),
+             PROT_READ | PROT_WRITE,
+             MAP_FIXED | MAP_ANON | MAP_PRIVATE,
+             -1,
+             0) == MAP_FAILED) {
+        ERROR("could not create memory mapping for the shadow stack: %s", strerror(errno));
+        return false;
+    }
+    if (((p_dispatcher = emit_dispatcher(translate_tu, DISPATCH_STUB)) == NULL) ||
+        ((p_tier1_dispatcher = emit_dispatcher(optimize_tu, DISPATCH_STUB)) == NULL) ||
+        ((p_indirect_dispatcher = emit_dispatcher(resolve_tu, DISPATCH_STUB)) == NULL) ||
+        ((p_return_dispatcher = emit_dispatcher(resolve_return, DISPATCH_RETURN)) == NULL) ||
+        ((p_branch_dispatcher = emit_dispatcher(resolve_branch, DISPATCH_BRANCH)) == NULL) ||
+        ((p_shadow_push = emit_shadow_push(5)) == NULL) ||                     // JMP rel32
+        ((p_shadow_push_indirect = emit_shadow_push(JUMP_TO_TARGET_SIZE)) == NULL) ||
+        ((p_shadow_pop = emit_shadow_pop()) == NULL) ||
+        !emit_guest_entry())
+        return false;
+    reset_shadow_stack();
+    // the dispatchers must survive flushes of the cache because a flush happens while one of them is running
+    // (and the translated code calls the shadow stack helpers without fixups when it is loaded from a file)
+    tc_make_permanent(gp_tlcache);
+    return true;
+}
+
+
+// get the entry points in the permanent part of the cache the translated code jumps to, for the images
+// of the cache (see tc_save_image())
+const RuntimeSymbol *get_runtime_symbols(int *p_num_symbols)
+{
+    static RuntimeSymbol symbols[10];
+    symbols[0] = (RuntimeSymbol) {"vadm_dispatcher", p_dispatcher};
+    symbols[1] = (RuntimeSymbol) {"vadm_tier1_dispatcher", p_tier1_dispatcher};
+    symbols[2] = (RuntimeSymbol) {"vadm_indirect_dispatcher", p_indirect_dispatcher};
+    symbols[3] = (RuntimeSymbol) {"vadm_return_dispatcher", p_return_dispatcher};
+    symbols[4] = (RuntimeSymbol) {"vadm_branch_dispatcher", p_branch_dispatcher};
+    symbols[5] = (RuntimeSymbol) {"vadm_shadow_push", p_shadow_push};
+    symbols[6] = (RuntimeSymbol) {"vadm_shadow_push_indirect", p_shadow_push_indirect};
+    symbols[7] = (RuntimeSymbol) {"vadm_shadow_pop", p_shadow_pop};
+    symbols[8] = (RuntimeSymbol) {"vadm_guest_entry", p_guest_entry};
+    symbols[9] = (RuntimeSymbol) {"vadm_guest_exit", p_guest_exit};
+    *p_num_symbols = sizeof(symbols) / sizeof(symbols[0]);
+    return symbols;
+}
+
+
+//
+// set up a translation unit for later translation when it is about to execute
+// (basically a stub for the actual TU that jumps to the dispatcher upon execution, which
+// in turn calls translate_tu())
+//
+uint8_t *setup_tu(const uint8_t *p_m68k_code)
+{
+    TranslationUnit *p_tu;
+    uint8_t *p_x86_code;
+
+    // check if TU is already in the cache
+    if ((p_x86_code = tc_get_addr(gp_tlcache, p_m68k_code)) != NULL) {
+        DEBUG("TU with source address %p is already in the cache - nothing to do", p_m68k_code);
+        return p_x86_code;
+    }
+    if (gp_tlcache->is_image) {
+        ERROR("TU with source address %p has not been translated ahead of time", p_m68k_code);
+        return NULL;
+    }
+
+    if ((p_dispatcher == NULL) && !setup_dispatchers()) {
+        ERROR("could not set up dispatchers");
+        return NULL;
+    }
+
+    TRACE("setting up TU with source address %p", p_m68k_code);
+    // get memory block for the stub and put TU (with mapping of source address to the stub) into cache
+    if ((p_x86_code = tc_alloc_code(gp_tlcache, STUB_SIZE)) == NULL) {
+        ERROR("could not get memory block for stub");
+        return NULL;
+    }
+    if ((p_tu = tc_add_tu(gp_tlcache, p_m68k_code, p_x86_code)) == NULL) {
+        ERROR("could not put TU into cache");
+        return NULL;
+    }
+
+    // generate the stub, it pushes the source address of the TU onto the stack (as argument
+    // for translate_tu(), which only uses its lower 32 bits because PUSH sign-extends the immediate
+    // value) and jumps to the dispatcher
+    // (written through the writable view, the offset of the jump is relative to the executable view)
+    uint8_t *p_pos = TC_WRITABLE(gp_tlcache, p_x86_code);
+    WRITE_BYTE(p_pos, OPCODE_PUSH_IMM32);
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+    WRITE_DWORD(p_pos, (uint32_t) p_m68k_code);
+#pragma GCC diagnostic pop
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL32);
+    WRITE_DWORD(p_pos, p_dispatcher - (p_x86_code + STUB_SIZE));
+    if (spec_running)
+        enqueue_spec_tu(p_m68k_code);
+    else if (pp_aot_tus != NULL)
+        push_aot_tu(p_tu);
+    return p_x86_code;
+}
+
+
+//
+// set up the TU the guest starts with, returns the code the host calls to run the guest (it returns
+// when the main routine of the guest returns, with the registers as the guest has left them)
+//
+uint8_t *setup_program(const uint8_t *p_m68k_code)
+{
+    if (setup_tu(p_m68k_code) == NULL)
+        return NULL;
+    SHADOW_STACK->p_entry = p_m68k_code;
+    return p_guest_entry;
+}
+
+
+//
+// emit the code at the start of a TU that counts how often the TU gets executed (by decrementing
+// its execution counter) and jumps to the tier-1 dispatcher when the counter reaches 0
+// RCX is used as scratch register (saved on the stack), and it is decremented with LEA and tested
+// with JRCXZ because, unlike DEC or SUB, they don't modify the flags, which may still be needed by
+// the guest. (LOOP would do both in one instruction but is microcoded and much slower.)
+//
+static void emit_counter_prologue(TranslationUnit *p_tu, uint8_t *p_x86_code)
+{
+    uint8_t *p_start = TC_WRITABLE(gp_tlcache, p_x86_code), *p_pos = p_start;
+    uint32_t counter_addr = (uint64_t) p_tu->p_counter;
+
+    p_pos = emit_push_reg(p_pos, REG_RCX);
+    p_pos = emit_move_abs_to_reg(p_pos, counter_addr, REG_ECX);
+    WRITE_BYTE(p_pos, OPCODE_LEA);                  // LEA ECX, [RCX - 1]
+    WRITE_BYTE(p_pos, 0x40 | (REG_ECX << 3) | REG_ECX);
+    WRITE_BYTE(p_pos, 0xff);
+    p_pos = emit_move_reg_to_abs(p_pos, REG_ECX, counter_addr);
+    WRITE_BYTE(p_pos, OPCODE_JRCXZ_REL8);
+    WRITE_BYTE(p_pos, 3);                           // skip POP and JMP below if counter has reached 0
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL8);
+    WRITE_BYTE(p_pos, 11);                          // skip POP, PUSH and JMP to the tier-1 dispatcher
+    p_pos = emit_pop_reg(p_pos, REG_RCX);
+    WRITE_BYTE(p_pos, OPCODE_PUSH_IMM32);
+    WRITE_DWORD(p_pos, (uint64_t) p_tu->p_src_addr);
+    WRITE_BYTE(p_pos, OPCODE_JMP_REL32);
+    WRITE_DWORD(p_pos, p_tier1_dispatcher - (p_x86_code + (p_pos + 4 - p_start)));
+    assert(p_pos - p_start == COUNTER_PROLOGUE_SIZE);
+}
+
+
+// look up the info for an opcode, NULL if the opcode is not supported
+static const OpcodeInfo *lookup_opcode(uint16_t opcode)
+{
+    uint8_t index = opcode_index_tbl[opcode];
+    return index != 0 ? &opcode_info_tbl[index - 1] : NULL;
+}
+
+
+//
+// the tiers: the code of a TU is lowered into the IR by the opcode handlers and the x86 code is
+// generated from the IR by emit_ir() - with tier 0 up to the first terminal instruction and only
+// optimized by the peephole optimizer, with tier 1 (when the TU has become hot) as trace, that is
+// it continues with the likely successor of the conditional branches it contains (with side exits
+// to the other successors), optimized by all the passes below
+//
+
+// get number of times a TU has been executed so far (as far as the counter tells)
+static uint32_t get_exec_count(const uint8_t *p_m68k_code)
+{
+    TranslationUnit *p_tu = tc_get_tu(gp_tlcache, p_m68k_code);
+    if ((p_tu == NULL) || (p_tu->p_counter == NULL))
+        return 0;
+    uint32_t counter = *p_tu->p_counter;
+    // the counter wraps around if the TU has become hot but could not be translated with tier 1
+    return counter <= g_tier1_threshold ? g_tier1_threshold - counter : g_tier1_threshold;
+}
+
+
+// decide if a trace continues after the conditional branch that has just been lowered (the last
+// two IR instructions are IR_BRANCH to the branch target and IR_JUMP to the following instruction),
+// and if so, remove the jump to the successor the trace continues with (inverting the condition of
+// the branch if that is the branch target), returns the source address of this successor or NULL
+// if the trace ends here
+static const uint8_t *continue_trace(IrInsn **pp_pos, const uint8_t **pp_block_starts, int *p_num_blocks)
+{
+    IrInsn *p_branch = *pp_pos - 2, *p_jump = *pp_pos - 1;
+    const uint8_t *p_taken = p_branch->p_target, *p_not_taken = p_jump->p_target;
+    uint32_t taken_count = get_exec_count(p_taken), not_taken_count = get_exec_count(p_not_taken);
+
+    // The successor that has been executed more often so far is the likely one. If both have been
+    // executed equally often, we assume that backward branches are taken (loops). BRA is always taken.
+    const uint8_t *p_next = ((p_branch->ir_cond == 0x0) ||
+                             (taken_count > not_taken_count) ||
+                             ((taken_count == not_taken_count) && (p_taken <= p_not_taken)))
+                            ? p_taken
+                            : p_not_taken;
+    if (*p_num_blocks == MAX_TRACE_BLOCKS)
+        return NULL;
+    for (int i = 0; i < *p_num_blocks; i++) {
+        // the trace would loop, leave the jumps as they are (a jump back to the start of the
+        // trace becomes a jump to the trace itself when it gets chained)
+        if (pp_block_starts[i] == p_next)
+            return NULL;
+    }
+    DEBUG("continuing trace with %s successor at %p", p_next == p_taken ? "taken" : "not taken", p_next);
+    // remove the jump to the following instruction
+    --*pp_pos;
+    if (p_next == p_taken) {
+        // invert the condition (lowest bit of the condition code, T becomes F) and branch to the following instruction instead
+        p_branch->ir_cond ^= 1;
+        p_branch->p_target = p_not_taken;
+    }
+    pp_block_starts[(*p_num_blocks)++] = p_next;
+    return p_next;
+}
+
+
+// lower the code of a TU into the IR up to the first terminal instruction (tier 0), or the code
+// of a hot TU as trace (tier 1), returns the number of IR instructions or -1 in case of an error,
+// and the range of source code covered
+static int lower_code(const uint8_t *p_m68k_code, bool is_trace, IrInsn *p_ir, const uint8_t **pp_src_start, const uint8_t **pp_src_end)
+{
+    const OpcodeInfo *p_opc_info;
+    const uint8_t *p = p_m68k_code, *p_insn;
+    const uint8_t *p_block_starts[MAX_TRACE_BLOCKS] = {p};
+    int num_blocks = 1;
+    IrInsn *q = p_ir;
+    uint16_t opcode;
+
+    *pp_src_start = *pp_src_end = p;
+    while (true) {
+        // If there is not enough space left for another instruction (leaving room for the three
+        // IR instructions of DBcc), we split the TU and end it with a jump to a new TU starting
+        // with this instruction.
+        if (q - p_ir > MAX_IR_INSNS_PER_TU - 3) {
+            DEBUG("TU is too large - splitting it at source address %p", p);
+            add_ir_jump(IR_JUMP, 0, NULL, p, &q);
+            break;
+        }
+        p_insn = p;
+        opcode = read_word(&p);
+        DEBUG("looking up opcode 0x%04x in opcode handler table", opcode);
+        if ((p_opc_info = lookup_opcode(opcode)) == NULL) {
+            ERROR("no handler found for opcode 0x%04x", opcode);
+            return -1;
+        }
+        if (p_opc_info->opc_handler(opcode, &p, &q) == -1) {
+            ERROR("could not decode instruction at position %p", p_insn);
+            return -1;
+        }
+        if (p_insn < *pp_src_start)
+            *pp_src_start = p_insn;
+        if (p > *pp_src_end)
+            *pp_src_end = p;
+        if (p_opc_info->opc_terminal) {
+            DEBUG("instruction is a terminal instruction");
+            if (is_trace && (p_opc_info->opc_handler == m68k_bcc) && (q[-2].ir_opcode == IR_BRANCH) &&
+                ((p = continue_trace(&q, p_block_starts, &num_blocks)) != NULL))
+                continue;
+            break;
+        }
+    }
+    return q - p_ir;
+}
+
+
+// flag liveness: going backwards through the IR, mark the instructions whose flags are used later
+// (the flags are considered live at the jumps to other TUs and the return, as the code there may use them)
+static void mark_live_flags(IrInsn *p_ir, int num_insns)
+{
+    bool flags_live = true;
+
+    for (IrInsn *p_insn = p_ir + num_insns - 1; p_insn >= p_ir; p_insn--) {
+        if (p_insn->ir_flags & IR_SETS_FLAGS) {
+            if (flags_live)
+                p_insn->ir_flags |= IR_FLAGS_LIVE;
+            flags_live = false;
+        }
+        if (p_insn->ir_flags & IR_USES_FLAGS)
+            flags_live = true;
+    }
+}
+
+
+// redundant-move elimination: remove moves that load a register with the value it already holds,
+// by tracking for each register the constant or the (unmodified) register it is known to hold
+// (only if the flags they set are not used, a MOVE sets the flags on the 680x0)
+#define VALUE_UNKNOWN   0
+#define VALUE_CONST     1
+#define VALUE_COPY      2
+typedef struct
+{
+    uint8_t  kind;                      // VALUE_UNKNOWN, VALUE_CONST or VALUE_COPY
+    uint32_t value;                     // constant or number of the register (0-15)
+} KnownValue;
+
+// forget the value of a register, including all copies of it
+static void forget_value(KnownValue *p_values, int reg)
+{
+    p_values[reg].kind = VALUE_UNKNOWN;
+    for (int i = 0; i < 16; i++) {
+        if ((p_values[i].kind == VALUE_COPY) && (p_values[i].value == (uint32_t) reg))
+            p_values[i].kind = VALUE_UNKNOWN;
+    }
+}
+
+// get the value a register is known to hold (a register with unknown value holds itself)
+static KnownValue get_value(const KnownValue *p_values, int reg)
+{
+    return p_values[reg].kind == VALUE_UNKNOWN ? (KnownValue) {VALUE_COPY, reg} : p_values[reg];
+}
+
+static int eliminate_redundant_moves(IrInsn *p_ir, int num_insns)
+{
+    KnownValue values[16] = {{VALUE_UNKNOWN, 0}};
+    int num_eliminated = 0;
+
+    for (IrInsn *p_insn = p_ir; p_insn < p_ir + num_insns; p_insn++) {
+        if ((p_insn->ir_opcode == IR_LIB_CALL) || (p_insn->ir_opcode == IR_CALL)) {
+            // the library routine (or the subroutine) may change any register
+            for (int i = 0; i < 16; i++)
+                values[i].kind = VALUE_UNKNOWN;
+            continue;
+        }
+        if (p_insn->ir_reg_defs == 0)
+            continue;
+        int dst = __builtin_ctz(p_insn->ir_reg_defs);
+        KnownValue new_value = {VALUE_UNKNOWN, 0};
+        // (a byte or word moved into a register merges with the rest of it, so the value is unknown)
+        if ((p_insn->ir_opcode == IR_MOVE) && (p_insn->ir_dst.op_length == 4)) {
+            if (p_insn->ir_src.op_type == OP_IMM)
+                new_value = (KnownValue) {VALUE_CONST, p_insn->ir_src.op_value};
+            else if (p_insn->ir_reg_uses != 0)
+                new_value = get_value(values, __builtin_ctz(p_insn->ir_reg_uses));
+            KnownValue old_value = get_value(values, dst);
+            if ((new_value.kind != VALUE_UNKNOWN) && (new_value.kind == old_value.kind) && (new_value.value == old_value.value) &&
+                !(p_insn->ir_flags & IR_FLAGS_LIVE)) {
+                p_insn->ir_flags |= IR_DEAD;
+                ++num_eliminated;
+                continue;
+            }
+        }
+        forget_value(values, dst);
+        if (!((new_value.kind == VALUE_COPY) && (new_value.value == (uint32_t) dst)))
+            values[dst] = new_value;
+    }
+    return num_eliminated;
+}
+
+
+// register and flag liveness: going backwards through the IR, remove instructions whose results
+// (registers and flags) are overwritten before they are used (all registers and the flags are
+// considered live at the jumps to other TUs, the calls and the return, as the code there may use them)
+// The X flag is tracked separately because only SUB sets it, MOVE and TST leave it alone, so a SUB
+// can only be removed if another SUB sets X before the next exit from the TU.
+static int eliminate_dead_code(IrInsn *p_ir, int num_insns)
+{
+    uint16_t live_regs = IR_ALL_REGS;
+    bool flags_live = true, x_live = true;
+    int num_eliminated = 0;
+
+    for (IrInsn *p_insn = p_ir + num_insns - 1; p_insn >= p_ir; p_insn--) {
+        if (p_insn->ir_flags & IR_DEAD)
+            continue;
+        // only instructions without side effects apart from their results can be removed
+        bool is_pure = (p_insn->ir_opcode == IR_SUB) || (p_insn->ir_opcode == IR_TEST) || (p_insn->ir_opcode == IR_SCC) ||
+                       ((p_insn->ir_opcode == IR_MOVE) && (p_insn->ir_reg_defs != 0));
+        bool sets_x = p_insn->ir_opcode == IR_SUB;
+        if (is_pure &&
+            !(p_insn->ir_reg_defs & live_regs) &&
+            !((p_insn->ir_flags & IR_SETS_FLAGS) && flags_live) &&
+            !(sets_x && x_live)) {
+            p_insn->ir_flags |= IR_DEAD;
+            ++num_eliminated;
+            continue;
+        }
+        if (p_insn->ir_flags & IR_SETS_FLAGS)
+            flags_live = false;
+        if (p_insn->ir_flags & IR_USES_FLAGS)
+            flags_live = true;
+        if (sets_x)
+            x_live = false;
+        else if ((p_insn->ir_opcode != IR_MOVE) && (p_insn->ir_opcode != IR_TEST) && (p_insn->ir_opcode != IR_SCC))
+            x_live = true;          // branches, jumps, calls and the return
+        live_regs = (live_regs & ~p_insn->ir_reg_defs) | p_insn->ir_reg_uses;
+    }
+    return num_eliminated;
+}
+
+
+// clear the bits of the data registers that hold the values at the addresses a store to addr overlaps with
+static uint8_t forget_addrs(const uint32_t *addrs, uint8_t addrs_known, uint32_t addr)
+{
+    for (uint8_t m = addrs_known; m != 0; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        if ((addrs[i] < addr + 4) && (addr < addrs[i] + 4))
+            addrs_known &= ~(1 << i);
+    }
+    return addrs_known;
+}
+
+
+// peephole optimizer (both tiers): rewrite instructions so that shorter x86 code is generated for
+// them, returns the number of bytes saved (and the number of x86 instructions saved)
+// - a load from an address a data register is known to hold the value of (because it has been
+//   loaded from or stored to the address, and neither has been written since) becomes a move
+//   from this register, or is removed if it is the register loaded (typical for library bases:
+//   MOVE.L D0, _DOSBase followed by MOVEA.L _DOSBase, A6)
+// - a store of a data register to the address it is known to hold the value of is removed
+// - a load of a constant another data register is known to hold becomes a move from this register
+// - library calls without any use of A6 and A7 between them are combined, A6 stays saved on the
+//   stack and is just moved on from one routine to the next
+// Instructions are only removed, and constants only replaced, if the flags they set are not used
+// (a known constant allows evaluating conditions at translation time, see ccr_get_cond()).
+#define REGS_A6_A7  0xc000
+
+static int optimize_peephole(IrInsn *p_ir, int num_insns, int *p_num_x86_insns_saved)
+{
+    uint32_t consts[8], addrs[8];       // constant / address each data register is known to hold (the value of)...
+    uint8_t  consts_known = 0, addrs_known = 0;     // ... if its bit is set here
+    IrInsn  *p_last_call = NULL;        // last library call if A6 and A7 have not been used since
+    uint8_t  buffer[MAX_TRANSLATED_INSN_SIZE];
+    int      num_bytes_saved = 0;
+
+    *p_num_x86_insns_saved = 0;
+    for (IrInsn *p_insn = p_ir; p_insn < p_ir + num_insns; p_insn++) {
+        if (p_insn->ir_flags & IR_DEAD)
+            continue;
+        Operand *src = &p_insn->ir_src, *dst = &p_insn->ir_dst;
+        if (p_insn->ir_opcode == IR_LIB_CALL) {
+            if (p_insn->ir_flags & IR_CALL_DIRECT) {
+                // direct calls don't save A6, so they can't be part of a sequence
+                p_last_call = NULL;
+                consts_known = addrs_known = 0;
+                continue;
+            }
+            if (p_last_call != NULL) {
+                // POP + PUSH are saved, and the ADD to A6 gets shorter or is not needed at all
+                int32_t delta = src->op_value - p_last_call->ir_src.op_value;
+                p_last_call->ir_flags |= IR_CALL_OPEN;
+                p_insn->ir_flags |= IR_CALL_CONT;
+                num_bytes_saved += 2 + (x86_encode_add_imm_to_a6(buffer, src->op_value) - buffer);
+                *p_num_x86_insns_saved += 2;
+                if (delta != 0)
+                    num_bytes_saved -= x86_encode_add_imm_to_a6(buffer, delta) - buffer;
+                else
+                    ++*p_num_x86_insns_saved;
+            }
+            p_last_call = p_insn;
+            // the library routine may change any register and any memory
+            consts_known = addrs_known = 0;
+            continue;
+        }
+        // the jumps to other TUs and the return use all registers, so they end a sequence of calls as well
+        if ((p_insn->ir_reg_uses | p_insn->ir_reg_defs) & REGS_A6_A7)
+            p_last_call = NULL;
+        if ((p_insn->ir_opcode != IR_MOVE) || (dst->op_length != 4)) {
+            // the values of the data registers the other instructions change are unknown (and the values
+            // in memory a byte or word is stored to)
+            consts_known &= ~p_insn->ir_reg_defs;
+            addrs_known &= ~p_insn->ir_reg_defs;
+            if (dst->op_type == OP_MEM)
+                addrs_known = forget_addrs(addrs, addrs_known, dst->op_value);
+            continue;
+        }
+
+        bool flags_dead = !(p_insn->ir_flags & IR_FLAGS_LIVE);
+        int reg = -1;
+        if ((src->op_type == OP_MEM) && (dst->op_type != OP_MEM)) {
+            if ((dst->op_type == OP_DREG) && flags_dead &&
+                (addrs_known & (1 << dst->op_value)) && (addrs[dst->op_value] == src->op_value)) {
+                DEBUG("removing redundant load of D%d", dst->op_value);
+                num_bytes_saved += x86_encode_move(buffer, src, dst) - buffer;
+                ++*p_num_x86_insns_saved;
+                p_insn->ir_flags |= IR_DEAD;
+                continue;
+            }
+            for (uint8_t m = addrs_known; m != 0; m &= m - 1) {
+                if (addrs[__builtin_ctz(m)] == src->op_value)
+                    reg = __builtin_ctz(m);
+            }
+        }
+        else if ((src->op_type == OP_IMM) && (dst->op_type == OP_DREG) && flags_dead) {
+            for (uint8_t m = consts_known & ~(1 << dst->op_value); m != 0; m &= m - 1) {
+                if (consts[__builtin_ctz(m)] == src->op_value)
+                    reg = __builtin_ctz(m);
+            }
+        }
+        else if ((src->op_type == OP_DREG) && (dst->op_type == OP_MEM) && flags_dead &&
+                 (addrs_known & (1 << src->op_value)) && (addrs[src->op_value] == dst->op_value)) {
+            DEBUG("removing redundant store of D%d", src->op_value);
+            num_bytes_saved += x86_encode_move(buffer, src, dst) - buffer;
+            ++*p_num_x86_insns_saved;
+            p_insn->ir_flags |= IR_DEAD;
+            continue;
+        }
+        if ((reg != -1) && !((dst->op_type == OP_DREG) && (reg == (int) dst->op_value))) {
+            DEBUG("replacing %s with move from D%d", src->op_type == OP_MEM ? "load" : "constant", reg);
+            num_bytes_saved += x86_encode_move(buffer, src, dst) - buffer;
+            *src = (Operand) {OP_DREG, 4, .op_value = reg};
+            p_insn->ir_reg_uses = operand_regs(src);
+            num_bytes_saved -= x86_encode_move(buffer, src, dst) - buffer;
+        }
+
+        // track the constants and addresses the data registers hold (the values of)
+        if (dst->op_type == OP_MEM) {
+            addrs_known = forget_addrs(addrs, addrs_known, dst->op_value);
+            addrs[src->op_value] = dst->op_value;
+            addrs_known |= 1 << src->op_value;
+        }
+        else if (dst->op_type == OP_DREG) {
+            uint8_t bit = 1 << dst->op_value;
+            consts_known &= ~bit;
+            addrs_known &= ~bit;
+            if (src->op_type == OP_IMM) {
+                consts[dst->op_value] = src->op_value;
+                consts_known |= bit;
+            }
+            else if (src->op_type == OP_MEM) {
+                addrs[dst->op_value] = src->op_value;
+                addrs_known |= bit;
+            }
+            else {
+                if (consts_known & (1 << src->op_value)) {
+                    consts[dst->op_value] = consts[src->op_value];
+                    consts_known |= bit;
+                }
+                if (addrs_known & (1 << src->op_value)) {
+                    addrs[dst->op_value] = addrs[src->op_value];
+                    addrs_known |= bit;
+                }
+            }
+        }
+    }
+    return num_bytes_saved;
+}
+
+
+//
+// binding of library calls: calls of library routines (JSR offset(A6)) normally go through the
+// jump table with an indirect CALL RSI, plus saving and restoring A6. If A6 is known to hold the
+// base of a library, the entry in the jump table is known as well, and the call can go directly
+// there. (Not to the thunk the entry jumps to, because the thunk may not have been generated yet,
+// see setup_jump_tables(), and the address of the entry is the same in every run, which matters
+// for the persistent translation cache.) A6 is tracked through the
+// TU starting with the value it has when the TU is entered (passed to translate_tu() /
+// optimize_tu() by the dispatcher). This value, and values loaded from memory, are only
+// speculative (the TU may be entered with another value, or the memory may change before the
+// load is executed), so the call is guarded by a check of A6 and falls back to the indirect call.
+// Only a constant loaded into A6 makes the guard unnecessary. Returns the number of calls bound.
+//
+static const uint8_t *p_jump_tbl_start = NULL, *p_jump_tbl_end = NULL;
+
+// register the memory area of the jump tables of a library (the areas of all libraries must be adjacent)
+void register_jump_table(const uint8_t *p_start, const uint8_t *p_end)
+{
+    if ((p_jump_tbl_start == NULL) || (p_start < p_jump_tbl_start))
+        p_jump_tbl_start = p_start;
+    if (p_end > p_jump_tbl_end)
+        p_jump_tbl_end = p_end;
+}
+
+// get the entry in the jump table a library call goes to, or NULL if there is no entry for an
+// implemented routine at this address (which jumps to its thunk or calls the resolver stub)
+static const uint8_t *resolve_lib_call(uint32_t lib_base, uint32_t offset)
+{
+    const uint8_t *p_entry = (const uint8_t *) (uintptr_t) (lib_base + offset);
+    if ((p_entry < p_jump_tbl_start) || (p_entry + 5 > p_jump_tbl_end) ||
+        ((*p_entry != OPCODE_JMP_REL32) && (*p_entry != OPCODE_CALL_REL32)))
+        return NULL;
+    return p_entry;
+}
+
+static int bind_lib_calls(IrInsn *p_ir, int num_insns, uint32_t entry_a6, int *p_num_guarded)
+{
+    uint32_t a6 = entry_a6;
+    bool     is_known = true, is_certain = false;
+    int      num_bound = 0;
+
+    *p_num_guarded = 0;
+    if (p_jump_tbl_start == NULL)
+        return 0;
+    for (IrInsn *p_insn = p_ir; p_insn < p_ir + num_insns; p_insn++) {
+        if (p_insn->ir_flags & IR_DEAD)
+            continue;
+        const Operand *src = &p_insn->ir_src;
+        if (p_insn->ir_opcode == IR_LIB_CALL) {
+            const uint8_t *p_entry;
+            if (is_known && ((p_entry = resolve_lib_call(a6, src->op_value)) != NULL)) {
+                DEBUG("binding call of library routine at offset %d to entry at %p", (int32_t) src->op_value, p_entry);
+                p_insn->ir_flags |= IR_CALL_DIRECT | (is_certain ? 0 : IR_CALL_GUARD);
+                p_insn->ir_dst = (Operand) {OP_IMM, 4, .op_value = a6};
+                p_insn->p_target = p_entry;
+                ++num_bound;
+                if (!is_certain)
+                    ++*p_num_guarded;
+            }
+            // the library routines preserve A6
+            continue;
+        }
+        if (!(p_insn->ir_reg_defs & (1 << (8 + 6))))
+            continue;
+        if ((p_insn->ir_opcode == IR_MOVE) && (src->op_type == OP_IMM)) {
+            a6 = src->op_value;
+            is_known = is_certain = true;
+        }
+        else if ((p_insn->ir_opcode == IR_MOVE) && (src->op_type == OP_MEM)) {
+            // the value is in guest memory, so it is big-endian
+            is_known = read_dword_safely((const void *) (uintptr_t) src->op_value, &a6);
+            a6 = ntohl(a6);
+            is_certain = false;
+        }
+        else
+            is_known = false;
+    }
+    return num_bound;
+}
+
+
+// allocate a memory block for the translated code of a TU, from the arena if several threads are translating
+// (the arena is only refilled with a whole block while there is enough space left for the TUs of the other
+// threads, see aot_translation_worker())
+static uint8_t *alloc_tu_code(size_t size)
+{
+    if (!is_parallel)
+        return tc_alloc_code(gp_tlcache, size);
+    size = (size + CODE_ALIGNMENT - 1) & ~(CODE_ALIGNMENT - 1);
+    if ((size_t) (arena.p_code_end - arena.p_next_code) < size) {
+        lock_cache();
+        size_t block_size = tc_has_space(gp_tlcache, AOT_ARENA_SIZE + num_aot_threads * MAX_TU_SPACE) ? AOT_ARENA_SIZE : size;
+        arena.p_next_code = tc_alloc_code(gp_tlcache, block_size);
+        unlock_cache();
+        if (arena.p_next_code == NULL) {
+            arena.p_code_end = NULL;
+            return NULL;
+        }
+        arena.p_code_end = arena.p_next_code + block_size;
+    }
+    arena.p_next_code += size;
+    return arena.p_next_code - size;
+}
+
+
+//
+// copy the code of a TU generated in the buffer to a memory block of the exact size (place_code(),
+// which doesn't change the cache), fill in the offsets of the jumps and chain the TU to the new code
+// (install_code(), or just publish it if it has been translated by the speculative translator, that
+// is while the guest is running)
+//
+static uint8_t *place_code(TranslationUnit *p_tu, const uint8_t *p_buffer, size_t code_size, bool is_counted)
+{
+    uint8_t *p_x86_code;
+
+    if ((p_x86_code = alloc_tu_code(code_size)) == NULL) {
+        ERROR("could not get memory block for translated code");
+        return NULL;
+    }
+    memcpy(TC_WRITABLE(gp_tlcache, p_x86_code), p_buffer, code_size);
+    if (is_counted)
+        emit_counter_prologue(p_tu, p_x86_code);
+    // the offsets of the calls of library routines are relative to the final location of the code
+    for (int i = 0; i < num_call_fixups; i++) {
+        uint8_t *p_field = p_x86_code + (call_fixups[i].p_field - p_buffer);
+        *((int32_t *) TC_WRITABLE(gp_tlcache, p_field)) = call_fixups[i].p_target - (p_field + 4);
+    }
+    DEBUG("translated code (%ld bytes) is at address %p", code_size, p_x86_code);
+    return p_x86_code;
+}
+
+static uint8_t *install_code(TranslationUnit *p_tu, const uint8_t *p_buffer, uint8_t *p_x86_code, bool is_speculative)
+{
+    // the offsets of the jumps are set by adding them to the lists of jumps to the TUs they go to
+    // (which are set up first if necessary)
+    for (int i = 0; i < num_fixups; i++) {
+        if (setup_tu(fixups[i].p_target) == NULL) {
+            ERROR("failed to set up TU with source address %p", fixups[i].p_target);
+            return NULL;
+        }
+        if (!tc_add_link(gp_tlcache, tc_get_tu(gp_tlcache, fixups[i].p_target), (int32_t *) (p_x86_code + (fixups[i].p_field - p_buffer)))) {
+            ERROR("could not add jump to TU with source address %p", fixups[i].p_target);
+            return NULL;
+        }
+    }
+    if (indirect_site.p_counts != NULL)
+        tc_add_indirect_site(gp_tlcache, indirect_site.p_src_addr, indirect_site.p_counts);
+
+    // Chain the TU, so that all jumps to this TU (including the ones in the code we've just
+    // translated) go directly to the translated code. This swaps the cache entry in one go:
+    // all jumps to the TU and the mapping of its source address are changed while the guest is
+    // stopped in the dispatcher, so the guest never sees a mix of old and new code. The stub
+    // itself is left alone, so that the TU can be unchained again if its source code gets
+    // modified by the guest. Stubs are rarely executed once their TU has been translated (only
+    // when the TU is the first one), and then translate_tu() just returns the translated code.
+    if (is_speculative ? !tc_publish_tu(gp_tlcache, p_tu, p_x86_code) : !tc_chain_tu(gp_tlcache, p_tu, p_x86_code)) {
+        ERROR("could not chain TU");
+        return NULL;
+    }
+    return p_x86_code;
+}
+
+
+//
+// translate the code of a TU from Motorola 680x0 to Intel x86-64 code with tier 0, that is
+// lowered into the IR instruction by instruction until the first terminal instruction and
+// generated from the IR without any optimizations, and chain the TU
+//
+static uint8_t *translate_code(TranslationUnit *p_tu, uint32_t entry_a6, bool is_speculative)
+{
+    static __thread IrInsn ir[MAX_IR_INSNS_PER_TU];
+    static __thread uint8_t tu_buffer[MAX_TU_SIZE];
+    const uint8_t *p_src_start, *p_src_end;
+    uint8_t *p_x86_code;
+    int num_insns, num_bytes_saved, num_x86_insns_saved, num_bound, num_guarded;
+
+    TRACE("translating TU with source address %p and stub at address %p", p_tu->p_src_addr, p_tu->p_stub);
+    // The code is generated in a buffer first because we don't know its size in advance. It
+    // starts with the code counting the executions of the TU (if tier 1 is enabled), which is
+    // emitted when the final location of the code is known.
+    // (TUs that have been translated before have a counter already)
+    if ((g_tier1_threshold > 0) && (p_tu->p_counter == NULL))
+        p_tu->p_counter = alloc_counters(1);
+    bool is_counted = p_tu->p_counter != NULL;
+    uint8_t *q = tu_buffer + (is_counted ? COUNTER_PROLOGUE_SIZE : 0);
+    // the speculative and the AOT workers translate TUs before they are executed, which may be in unmapped memory
+    reading_code = is_speculative || (pp_aot_tus != NULL);
+    if ((num_insns = lower_code(p_tu->p_src_addr, false, ir, &p_src_start, &p_src_end)) == -1) {
+        reading_code = 0;
+        return NULL;
+    }
+    if (is_speculative) {
+        // The guest is running and may modify the code while it is being read. Therefore, the code
+        // is write-protected first (a write then waits for the lock in the SIGSEGV handler and
+        // invalidates the TU afterwards) and lowered again, and only used if it still covers the
+        // same range (otherwise it would be partially unprotected).
+        const uint8_t *p_protected_start = p_src_start, *p_protected_end = p_src_end;
+        if (!tc_protect_tu(gp_tlcache, p_tu, p_src_start, p_src_end) ||
+            ((num_insns = lower_code(p_tu->p_src_addr, false, ir, &p_src_start, &p_src_end)) == -1)) {
+            reading_code = 0;
+            return NULL;
+        }
+        reading_code = 0;
+        if ((p_src_start < p_protected_start) || (p_src_end > p_protected_end)) {
+            DEBUG("source code of TU with source address %p has been modified while it was being translated", p_tu->p_src_addr);
+            return NULL;
+        }
+    }
+    reading_code = 0;
+    mark_live_flags(ir, num_insns);
+    num_bound = bind_lib_calls(ir, num_insns, entry_a6, &num_guarded);
+    num_bytes_saved = optimize_peephole(ir, num_insns, &num_x86_insns_saved);
+    num_fixups = num_call_fixups = 0;
+    indirect_site.p_counts = NULL;
+    if ((q = emit_ir(q, ir, num_insns)) == NULL)
+        return NULL;
+    if ((p_x86_code = place_code(p_tu, tu_buffer, q - tu_buffer, is_counted)) == NULL)
+        return NULL;
+    lock_cache();
+    if ((p_x86_code = install_code(p_tu, tu_buffer, p_x86_code, is_speculative)) != NULL) {
+        if (is_speculative) {
+            p_tu->is_speculative = true;
+            ++gp_tlcache->num_spec_tus;
+        }
+        ++gp_tlcache->num_tier_tus[0];
+        gp_tlcache->tier_code_size[0] += q - tu_buffer;
+        gp_tlcache->num_peephole_bytes += num_bytes_saved;
+        gp_tlcache->num_peephole_insns += num_x86_insns_saved;
+        gp_tlcache->num_bound_calls += num_bound;
+        gp_tlcache->num_guarded_calls += num_guarded;
+        // write-protect the source code to detect self-modifying code
+        if (!tc_protect_tu(gp_tlcache, p_tu, p_src_start, p_src_end))
+            WARN("modifications of the source code of TU with source address %p will not be detected", p_tu->p_src_addr);
+    }
+    unlock_cache();
+    return p_x86_code;
+}
+
+
+//
+// translate the code of a hot TU with tier 1 and chain the TU to the new code
+//
+static uint8_t *translate_code_tier1(TranslationUnit *p_tu, uint32_t entry_a6)
+{
+    static IrInsn ir[MAX_IR_INSNS_PER_TU];
+    static uint8_t tu_buffer[MAX_TU_SIZE];
+    const uint8_t *p_src_start, *p_src_end;
+    uint8_t *p_x86_code, *q = tu_buffer;
+    int num_insns, num_eliminated, num_bytes_saved, num_x86_insns_saved, num_bound, num_guarded;
+
+    TRACE("translating TU with source address %p with tier 1", p_tu->p_src_addr);
+    if ((num_insns = lower_code(p_tu->p_src_addr, true, ir, &p_src_start, &p_src_end)) == -1)
+        return NULL;
+    mark_live_flags(ir, num_insns);
+    num_eliminated = eliminate_redundant_moves(ir, num_insns);
+    num_eliminated += eliminate_dead_code(ir, num_insns);
+    DEBUG("%d of %d IR instructions eliminated", num_eliminated, num_insns);
+    num_bound = bind_lib_calls(ir, num_insns, entry_a6, &num_guarded);
+    num_bytes_saved = optimize_peephole(ir, num_insns, &num_x86_insns_saved);
+    num_fixups = num_call_fixups = 0;
+    indirect_site.p_counts = NULL;
+    if ((q = emit_ir(q, ir, num_insns)) == NULL)
+        return NULL;
+    if (((p_x86_code = place_code(p_tu, tu_buffer, q - tu_buffer, false)) == NULL) ||
+        ((p_x86_code = install_code(p_tu, tu_buffer, p_x86_code, false)) == NULL))
+        return NULL;
+    ++gp_tlcache->num_tier_tus[1];
+    gp_tlcache->tier_code_size[1] += q - tu_buffer;
+    gp_tlcache->num_eliminated_insns += num_eliminated;
+    gp_tlcache->num_peephole_bytes += num_bytes_saved;
+    gp_tlcache->num_peephole_insns += num_x86_insns_saved;
+    gp_tlcache->num_bound_calls += num_bound;
+    gp_tlcache->num_guarded_calls += num_guarded;
+    if (!tc_protect_tu(gp_tlcache, p_tu, p_src_start, p_src_end))
+        WARN("modifications of the source code of TU with source address %p will not be detected", p_tu->p_src_addr);
+    return p_x86_code;
+}
+
+
+// get the code of a TU if the code has been mapped from an image, where all TUs have been translated
+// ahead of time (those that couldn't be translated then can't be executed)
+static uint8_t *get_image_code(const uint8_t *p_m68k_code)
+{
+    TranslationUnit *p_tu;
+    if (((p_tu = tc_get_tu(gp_tlcache, p_m68k_code)) == NULL) || (p_tu->p_x86_code == NULL)) {
+        ERROR("TU with source address %p has not been translated ahead of time", p_m68k_code);
+        return NULL;
+    }
+    return p_tu->p_x86_code;
+}
+
+
+// make sure the translated code and the stubs of all TUs it jumps to fit into the cache,
+// otherwise flush the cache first
+// This is safe because the only code in the cache that is in use right now is the
+// dispatcher (which called us), and that is permanent. The TU we're about to translate is
+// the only entry point into the translated code that is live, so we just need to set up
+// its stub again. (The shadow stack points into the translated code as well, but its entries
+// are just predictions, so it is reset and the returns go through the return dispatcher.)
+static bool make_space(const uint8_t *p_m68k_code)
+{
+    if (!tc_has_space(gp_tlcache, MAX_TU_SPACE)) {
+        tc_flush(gp_tlcache);
+        reset_shadow_stack();
+        if (setup_tu(p_m68k_code) == NULL) {
+            ERROR("could not set up TU after flushing the cache");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// translate a translation unit with tier 0, called by the dispatcher when the stub of the TU is
+// executed (with the value A6 has at this point, which is used for binding library calls)
+//
+static uint8_t *translate_tu_locked(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    TranslationUnit *p_tu;
+
+    if (gp_tlcache->is_image)
+        return get_image_code(p_m68k_code);
+    if (!make_space(p_m68k_code))
+        return NULL;
+    if ((p_tu = tc_get_tu(gp_tlcache, p_m68k_code)) == NULL) {
+        ERROR("translate_tu() called on a TU with source address %p that is not in the cache", p_m68k_code);
+        return NULL;
+    }
+    if (p_tu->p_x86_code != NULL) {
+        DEBUG("TU with source address %p has already been translated - nothing to do", p_m68k_code);
+        return p_tu->p_x86_code;
+    }
+    if (spec_running)
+        ++gp_tlcache->num_guest_translations;
+    return translate_code(p_tu, entry_a6, false);
+}
+
+
+uint8_t *translate_tu(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    p_m68k_code = (const uint8_t *) ((uintptr_t) p_m68k_code & 0xffffffff);
+    lock_translator();
+    // the guest is stopped in the dispatcher, so the TUs the speculative translator has published can be chained now
+    // (and the writes to translated code the SIGSEGV handler has recorded can be logged)
+    tc_chain_published_tus(gp_tlcache);
+    tc_log_smc_writes(gp_tlcache);
+    uint8_t *p_x86_code = translate_tu_locked(p_m68k_code, entry_a6);
+    unlock_translator();
+    return p_x86_code;
+}
+
+
+//
+// translate a hot TU again with tier 1, called by the tier-1 dispatcher when the execution counter
+// of the TU has reached 0
+// The TU is chained to the new code, so all jumps to it go there from now on, and the tier-0
+// code is not used anymore (it is not executing, because we got here from its very start).
+//
+static uint8_t *optimize_tu_locked(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    TranslationUnit *p_tu;
+    uint8_t *p_x86_code;
+
+    if (gp_tlcache->is_image)
+        return get_image_code(p_m68k_code);
+    if (!make_space(p_m68k_code))
+        return NULL;
+    if ((p_tu = tc_get_tu(gp_tlcache, p_m68k_code)) == NULL) {
+        ERROR("optimize_tu() called on a TU with source address %p that is not in the cache", p_m68k_code);
+        return NULL;
+    }
+    if ((p_x86_code = translate_code_tier1(p_tu, entry_a6)) == NULL) {
+        // don't try again and continue with the code we have (if the cache hasn't been flushed)
+        WARN("could not translate TU with source address %p with tier 1", p_m68k_code);
+        if (p_tu->p_counter != NULL)
+            *p_tu->p_counter = 0;
+        p_x86_code = p_tu->p_x86_code ? p_tu->p_x86_code : translate_code(p_tu, entry_a6, false);
+    }
+    return p_x86_code;
+}
+
+
+uint8_t *optimize_tu(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    p_m68k_code = (const uint8_t *) ((uintptr_t) p_m68k_code & 0xffffffff);
+    lock_translator();
+    tc_chain_published_tus(gp_tlcache);
+    uint8_t *p_x86_code = optimize_tu_locked(p_m68k_code, entry_a6);
+    unlock_translator();
     return p_x86_code;
 }
 
 
 //
-// translate a translation unit from Motorola 680x0 to Intel x86-64 code
+// translate the TU at an address only known at runtime (the TU the guest starts with, or a return address
+// the shadow stack has not predicted), called by the indirect and the return dispatcher
+// Only the lower 32 bits of the address are valid because the dispatchers get it pushed as 64-bit value.
 //
-uint8_t *translate_tu(const uint8_t *p_m68k_code)
+static uint8_t *resolve_tu_locked(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    DEBUG("resolving TU with source address %p", p_m68k_code);
+    if (gp_tlcache->is_image)
+        return get_image_code(p_m68k_code);
+    tc_chain_published_tus(gp_tlcache);
+    if (make_space(p_m68k_code) && (setup_tu(p_m68k_code) != NULL))
+        return translate_tu_locked(p_m68k_code, entry_a6);
+    return NULL;
+}
+
+
+static uint8_t *resolve_tu(const uint8_t *p_m68k_code, uint32_t entry_a6)
 {
-    static const OpcodeInfo *p_opc_info_lookup_tbl[0x10000];
-    static bool initialized = false;
     uint8_t *p_x86_code;
 
-    if (!initialized) {
-        DEBUG("building opcode handler table");
-        init_opc_info_lookup_tbl(p_opc_info_lookup_tbl);
-        initialized = true;
-    }
+    p_m68k_code = (const uint8_t *) ((uintptr_t) p_m68k_code & 0xffffffff);
+    lock_translator();
+    p_x86_code = resolve_tu_locked(p_m68k_code, entry_a6);
+    unlock_translator();
+    return p_x86_code;
+}
 
-    // get address of memory block for the translated code
-    if ((p_x86_code = tc_get_addr(gp_tlcache, p_m68k_code)) == NULL) {
-        ERROR("translate_tu() called on a TU with source address %p that is not in the cache", p_m68k_code);
-        return NULL;
+
+// translate the target of an indirect branch that was not in the cache for the targets of indirect
+// branches (called by the branch dispatcher), and put it there so that the branch finds it next time
+static uint8_t *resolve_branch(const uint8_t *p_m68k_code, uint32_t entry_a6)
+{
+    uint8_t *p_x86_code;
+
+    p_m68k_code = (const uint8_t *) ((uintptr_t) p_m68k_code & 0xffffffff);
+    lock_translator();
+    if ((p_x86_code = resolve_tu_locked(p_m68k_code, entry_a6)) != NULL)
+        tc_put_indirect(gp_tlcache, p_m68k_code, p_x86_code);
+    unlock_translator();
+    return p_x86_code;
+}
+
+
+// find the code RTS continues at if the return address on the guest stack (as the dispatcher passes
+// it, big-endian in the lower 32 bits) is not the one recorded by the last call
+// The guest may have left several subroutines at once (e.g. with longjmp()), then the return address
+// is further down in the shadow stack, and the entries above it are discarded. Otherwise (e.g. the
+// return address has been replaced to jump somewhere else), the shadow stack stays as it is.
+static uint8_t *resolve_return(const uint8_t *p_guest_ret, uint32_t entry_a6)
+{
+    uint32_t guest_ret = (uint32_t) (uintptr_t) p_guest_ret;
+    ShadowStack *p_shadow = SHADOW_STACK;
+
+    ++gp_tlcache->num_return_misses;
+    for (ShadowEntry *p_entry = p_shadow->p_top - 1; p_entry > p_shadow->entries; p_entry--) {
+        if (p_entry->se_guest_ret == guest_ret) {
+            DEBUG("return address %p found %ld entries down in the shadow stack",
+                  (void *) (uintptr_t) ntohl(guest_ret), p_shadow->p_top - p_entry - 1);
+            ++gp_tlcache->num_return_resyncs;
+            p_shadow->p_top = p_entry;
+            return p_entry->p_host_ret;
+        }
     }
+    if (ntohl(guest_ret) == GUEST_EXIT_ADDRESS)
+        return p_guest_exit;
+    return resolve_tu((const uint8_t *) (uintptr_t) ntohl(guest_ret), entry_a6);
+}
 
-    DEBUG("translating TU with source address %p and destination address %p", p_m68k_code, p_x86_code);
-    // translate instructions one by one until we hit a terminal instruction
-    // We need to put the translated code after the stub that called us, that is
-    // at position START_OF_TRANSLATED_CODE in the memory block.
-    // TODO: check if there is still enough space in the memory block
-    // TODO: store name of instruction in table and print it here instead of in the handlers
-    // TODO: store position of mode / register byte in table and extract operand here
-    const uint8_t *p = p_m68k_code;
-    uint8_t *q = p_x86_code + START_OF_TRANSLATED_CODE;
-    uint16_t opcode;
-    int nbytes_used;
+
+//
+// translate the whole program ahead of time (vadm -a), that is all TUs reachable from the TUs set up
+// so far: every TU translated sets up the TUs for its branch targets, which get translated as well
+// Only the targets of direct branches are found this way, the targets of indirect jumps (JMP (An),
+// RTS, ...) are still translated at runtime when they are executed for the first time. A6 is not known,
+// so library calls are only bound if A6 is loaded in the TU itself.
+// The TUs are translated by several threads in parallel. The code is only linked to the other TUs (which
+// are set up then) with the lock held, which is a small part of the work, see also alloc_tu_code().
+// The code is saved to the persistent cache, or as an image the program can be run from without
+// translating anything at runtime (see tc_save_image()).
+//
+
+// called by the SIGSEGV handler, abandons the translation if the speculative or an AOT worker has tried
+// to read guest memory that is not mapped (the TU doesn't contain valid code then, it will never be executed)
+void recover_from_translation_fault()
+{
+    if (reading_code)
+        siglongjmp(fault_env, 1);
+}
+
+
+// SIGSEGV handler while translating ahead of time (the guest isn't running, so every other fault is a bug)
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void handle_aot_fault(int signum, siginfo_t *p_info, void *p_context)
+{
+    recover_from_translation_fault();
+    // restore default action, so that the process gets terminated when the instruction is repeated
+    struct sigaction action;
+    action.sa_handler = SIG_DFL;
+    action.sa_flags = 0;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+}
+
+
+static void *aot_translation_worker(void *p_arg)
+{
+    lock_cache();
     while (true) {
-        opcode = read_word(&p);
-        DEBUG("looking up opcode 0x%04x in opcode handler table", opcode);
-        if (p_opc_info_lookup_tbl[opcode])
-            nbytes_used = p_opc_info_lookup_tbl[opcode]->opc_handler(opcode, &p, &q);
-        else {
-            ERROR("no handler found for opcode 0x%04x", opcode);
-            return NULL;
+        // wait for the other threads if the list is empty, their TUs may add new ones
+        while ((num_aot_tus == 0) && (num_aot_busy > 0) && !is_aot_failed)
+            pthread_cond_wait(&aot_cond, &cache_lock);
+        if ((num_aot_tus == 0) || is_aot_failed)
+            break;
+        TranslationUnit *p_tu = pp_aot_tus[--num_aot_tus];
+        // the cache must not be flushed, it would discard the code translated so far
+        if (!tc_has_space(gp_tlcache, num_aot_threads * MAX_TU_SPACE)) {
+            ERROR("translation cache is too small for the program");
+            is_aot_failed = true;
+            break;
         }
-        if (nbytes_used == -1) {
-            ERROR("could not decode instruction at position %p", p - 2);
-            return NULL;
+        ++num_aot_busy;
+        unlock_cache();
+        // TUs that can't be translated are left alone (their code is probably never executed), as are
+        // the ones whose code isn't mapped (branch targets in data that has been taken for code)
+        if (sigsetjmp(fault_env, 1) != 0) {
+            reading_code = 0;
+            WARN("TU with source address %p is not in mapped memory", p_tu->p_src_addr);
+        }
+        else if (translate_code(p_tu, 0, false) == NULL) {
+            WARN("could not translate TU with source address %p ahead of time", p_tu->p_src_addr);
         }
-        if (p_opc_info_lookup_tbl[opcode]->opc_terminal) {
-            DEBUG("instruction is the terminal instruction in this TU - continuing execution of guest");
-            // insert jump to the translated code at the beginning of the memory block to
-            // keep us from being called again if this TU gets executed more than once
-            q = p_x86_code;
-            WRITE_BYTE(q, OPCODE_JMP_REL8);
-            WRITE_BYTE(q, 0x7e);
-            return p_x86_code;
+        lock_cache();
+        --num_aot_busy;
+    }
+    // the list is empty and no TUs are being translated anymore (or we've failed), so we're all done
+    // (the rest of the arena remains unused)
+    if (is_parallel)
+        pthread_cond_broadcast(&aot_cond);
+    unlock_cache();
+    arena = (Arena) {0};
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+
+bool translate_program(int num_threads)
+{
+    pthread_t threads[MAX_AOT_THREADS];
+    struct sigaction sa, old_sa;
+    int num_started = 1, err;
+
+    max_aot_tus = 1024;
+    if ((pp_aot_tus = malloc(max_aot_tus * sizeof(TranslationUnit *))) == NULL) {
+        ERROR("could not allocate memory for list of TUs");
+        return false;
+    }
+    num_aot_tus = num_aot_busy = 0;
+    is_aot_failed = false;
+    for (TranslationUnit *p_tu = gp_tlcache->p_first_tu; p_tu != NULL; p_tu = p_tu->p_next) {
+        if (p_tu->p_x86_code == NULL)
+            push_aot_tu(p_tu);
+    }
+    sa.sa_sigaction = handle_aot_fault;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, &old_sa);
+    // the calling thread is one of the threads
+    num_aot_threads = num_threads;
+    is_parallel = num_threads > 1;
+    for (; num_started < num_threads; num_started++) {
+        if ((err = pthread_create(&threads[num_started], NULL, aot_translation_worker, NULL)) != 0) {
+            WARN("could not create thread for translation: %s", strerror(err));
+            break;
         }
     }
+    aot_translation_worker(NULL);
+    for (int i = 1; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+    is_parallel = false;
+    sigaction(SIGSEGV, &old_sa, NULL);
+    free(pp_aot_tus);
+    pp_aot_tus = NULL;
+    return !is_aot_failed;
 }
 
 
+//
+// the worker thread of the speculative translator, translates the TUs in the queue with tier 0 and
+// publishes them (the guest only chains them when it is stopped in the dispatcher the next time)
+// It doesn't know the value of A6 when the TU is entered, so only library calls with A6 loaded in
+// the TU itself are bound, and it never flushes the cache (it leaves TUs alone if there isn't enough
+// space left, the guest will translate them when they are executed).
+//
+
+
+static void translate_speculatively(const uint8_t *p_m68k_code)
+{
+    TranslationUnit *p_tu;
+
+    // the TU may have been translated meanwhile, or discarded by a flush
+    if (((p_tu = tc_get_tu(gp_tlcache, p_m68k_code)) == NULL) || (p_tu->p_x86_code != NULL))
+        return;
+    if (!tc_has_space(gp_tlcache, 2 * MAX_TU_SPACE)) {
+        ++gp_tlcache->num_spec_dropped;
+        return;
+    }
+    if (sigsetjmp(fault_env, 1) != 0) {
+        reading_code = 0;
+        DEBUG("TU with source address %p is not in mapped memory", p_m68k_code);
+        ++gp_tlcache->num_spec_discarded;
+        return;
+    }
+    if (translate_code(p_tu, 0, true) == NULL)
+        ++gp_tlcache->num_spec_discarded;
+}
+
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void *spec_translation_worker(void *p_arg)
+{
+    while (true) {
+        while (sem_wait(&spec_queue_sem) == -1)
+            ;
+        if (atomic_load(&spec_stop))
+            break;
+        unsigned int head = atomic_load_explicit(&spec_queue_head, memory_order_relaxed);
+        const uint8_t *p_m68k_code = spec_queue[head % SPEC_QUEUE_SIZE];
+        atomic_store_explicit(&spec_queue_head, head + 1, memory_order_release);
+        lock_translator();
+        translate_speculatively(p_m68k_code);
+        unlock_translator();
+    }
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+
+// start the speculative translator (if enabled), needs to be called in the process running the guest
+bool start_spec_translation()
+{
+    sigset_t sigmask, saved;
+    int err;
+
+    // (there is nothing to translate if the code has been mapped from an image)
+    if (!g_spec_translation || gp_tlcache->is_image)
+        return true;
+    if (sem_init(&spec_queue_sem, 0, 0) == -1) {
+        ERROR("could not create semaphore: %s", strerror(errno));
+        return false;
+    }
+    // The worker only handles SIGSEGV (see recover_from_translation_fault()), all other signals are for the guest.
+    sigfillset(&sigmask);
+    sigdelset(&sigmask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &sigmask, &saved);
+    spec_running = true;
+    if ((err = pthread_create(&spec_thread, NULL, spec_translation_worker, NULL)) != 0) {
+        ERROR("could not create thread for speculative translation: %s", strerror(err));
+        spec_running = false;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return spec_running;
+}
+
+
+// stop the speculative translator and chain the TUs it has published last, so that the cache is
+// in the same state as without it (e.g. for saving it to a file)
+void stop_spec_translation()
+{
+    if (!spec_running)
+        return;
+    atomic_store(&spec_stop, true);
+    sem_post(&spec_queue_sem);
+    pthread_join(spec_thread, NULL);
+    spec_running = false;
+    tc_chain_published_tus(gp_tlcache);
+}
+
+
+//
+// run translated code with D1 = number of iterations and D2 = 0, returns D0 (used by the unit tests and the benchmarks)
+// The callee-saved registers are saved and restored manually because RBP can't be declared as
+// clobbered, and the red zone is skipped because the pushes would overwrite it.
+//
+#if defined(TEST) || defined(BENCHMARK)
+static uint32_t run_guest(uint8_t *p_code, uint32_t num_iterations)
+{
+    register uint64_t rax asm("rax") = (uint64_t) p_code;
+    register uint64_t r8 asm("r8");
+    register uint64_t r9 asm("r9") = num_iterations;
+    asm volatile(
+        "sub    $128, %%rsp\n"
+        "push   %%rbx\n"
+        "push   %%rbp\n"
+        "push   %%r12\n"
+        "push   %%r13\n"
+        "push   %%r14\n"
+        "push   %%r15\n"
+        "xor    %%r10d, %%r10d\n"
+        "call   *%%rax\n"
+        "pop    %%r15\n"
+        "pop    %%r14\n"
+        "pop    %%r13\n"
+        "pop    %%r12\n"
+        "pop    %%rbp\n"
+        "pop    %%rbx\n"
+        "add    $128, %%rsp\n"
+        : "+r" (rax), "=r" (r8), "+r" (r9)
+        :
+        : "rcx", "rdx", "rsi", "rdi", "r10", "r11", "memory", "cc"
+    );
+    return r8;
+}
+#endif
+
+
 //
 // unit tests
 //
 #ifdef TEST
+#define TIER1_X_CODE_OFFSET 64          // offset of the second TU on the page with the code for tier 1
+
+// fill in the offset of the call of the pop helper and the address of the target at the end of the
+// expected code of a TU, see emit_return()
+static void set_return_fields(uint8_t *p_expected, size_t size, const uint8_t *p_code)
+{
+    *((int32_t *) (p_expected + size - 11)) = p_shadow_pop - (p_code + size - 7);
+    *((uint32_t *) (p_expected + size - 4)) = SHADOW_FIELD_ADDRESS(p_target);
+}
+
+
 int main()
 {
     int retval = 0;
     static const OpcodeInfo *p_opc_info_lookup_tbl[0x10000];
-    uint8_t x86_code[MAX_INSTRUCTION_SIZE];
+    uint8_t x86_code[MAX_TRANSLATED_INSN_SIZE];
+    IrInsn ir[3], *p_ir;
     const uint8_t *p;
     uint8_t *q;
     uint16_t opcode;
     int nbytes_used;
 
+    // the table generated at build time must match the one built at runtime
     DEBUG("building opcode handler table");
     init_opc_info_lookup_tbl(p_opc_info_lookup_tbl);
+    for (int i = 0; i < 0x10000; i++) {
+        if (lookup_opcode(i) != p_opc_info_lookup_tbl[i]) {
+            ERROR("generated opcode table differs from table built at runtime for opcode 0x%04x", i);
+            return 1;
+        }
+    }
+    INFO("generated opcode table matches table built at runtime");
 
     // test case table consists of one row per test case with two colums (Motorola and Intel instructions) each
     for (unsigned int i = 0; i < sizeof(testcase_tbl) / (MAX_INSTRUCTION_SIZE + 1) / 2; i++) {
         p = &testcase_tbl[i][0][1];
-        q = x86_code;
+        p_ir = ir;
         opcode = read_word(&p);
         DEBUG("looking up opcode 0x%04x in opcode handler table", opcode);
-        if (p_opc_info_lookup_tbl[opcode])
-            nbytes_used = p_opc_info_lookup_tbl[opcode]->opc_handler(opcode, &p, &q);
+        if (lookup_opcode(opcode))
+            nbytes_used = lookup_opcode(opcode)->opc_handler(opcode, &p, &p_ir);
         else {
             ERROR("no handler found for opcode 0x%04x", opcode);
             return 1;
         }
-        if (nbytes_used == -1) {
-            ERROR("could not decode instruction at position %p", p - 2);
+        if ((nbytes_used == -1) || ((q = emit_ir(x86_code, ir, p_ir - ir)) == NULL)) {
+            ERROR("could not translate instruction at position %p", p - 2);
             return 1;
         }
-        if (memcmp(&testcase_tbl[i][1][1], x86_code, testcase_tbl[i][1][0]) == 0) {
+        if ((q - x86_code == testcase_tbl[i][1][0]) && (memcmp(&testcase_tbl[i][1][1], x86_code, testcase_tbl[i][1][0]) == 0)) {
             INFO("test case #%d passed", i);
         }
         else {
@@ -745,6 +3272,843 @@ int main()
             ++retval;
         }
     }
+
+    // the same moves with MOVBE (only encoded, so this works without MOVBE as well)
+    static const struct {Operand src, dst; uint8_t x86_code[11];} movbe_tbl[] = {
+        {{OP_MEM, 4, .op_value = 0x5555aaaa}, {OP_AREG, 4, .op_value = 6},
+         {0x0f, 0x38, 0xf0, 0x34, 0x25, 0xaa, 0xaa, 0x55, 0x55}},                  // movbe esi, [0x5555aaaa]
+        {{OP_MEM, 4, .op_value = 0x5555aaaa}, {OP_DREG, 4, .op_value = 0},
+         {0x44, 0x0f, 0x38, 0xf0, 0x04, 0x25, 0xaa, 0xaa, 0x55, 0x55}},            // movbe r8d, [0x5555aaaa]
+        {{OP_DREG, 4, .op_value = 1}, {OP_MEM, 4, .op_value = 0x5555aaaa},
+         {0x44, 0x0f, 0x38, 0xf1, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55}},            // movbe [0x5555aaaa], r9d
+        {{OP_MEM, 2, .op_value = 0x5555aaaa}, {OP_DREG, 2, .op_value = 0},
+         {0x66, 0x44, 0x0f, 0x38, 0xf0, 0x04, 0x25, 0xaa, 0xaa, 0x55, 0x55}},      // movbe r8w, [0x5555aaaa]
+        {{OP_DREG, 2, .op_value = 1}, {OP_MEM, 2, .op_value = 0x5555aaaa},
+         {0x66, 0x44, 0x0f, 0x38, 0xf1, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55}}       // movbe [0x5555aaaa], r9w
+    };
+    int num_movbe_errors = 0;
+    g_use_movbe = true;
+    for (size_t i = 0; i < sizeof(movbe_tbl) / sizeof(movbe_tbl[0]); i++) {
+        size_t size = movbe_tbl[i].src.op_length == 2 ? 11 : (movbe_tbl[i].dst.op_type == OP_AREG ? 9 : 10);
+        q = x86_encode_move(x86_code, &movbe_tbl[i].src, &movbe_tbl[i].dst);
+        if ((q - x86_code != (ptrdiff_t) size) || (memcmp(x86_code, movbe_tbl[i].x86_code, size) != 0)) {
+            ERROR("move #%d has not been encoded correctly with MOVBE", (int) i);
+            ++num_movbe_errors;
+        }
+    }
+    g_use_movbe = false;
+    if (num_movbe_errors == 0)
+        INFO("moves have been encoded with MOVBE");
+    retval += num_movbe_errors;
+
+    // translate a TU that is too large for the buffer (MOVEQ instructions followed by RTS),
+    // it needs to be split into two TUs with a jump from the first to the second one
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) TEST_CODE_ADDRESS, 6 * 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < 1000; i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(0x7001);
+    ((uint16_t *) p_m68k_code)[1000] = htons(0x4e75);
+    gp_tlcache = tc_init(DEFAULT_CODE_CACHE_SIZE);
+    // (the expected code below is the one without MOVBE, whatever the CPU supports)
+    setup_dispatchers();
+    g_use_movbe = false;
+    uint8_t *p_x86_code;
+    if ((setup_tu(p_m68k_code) == NULL) || ((p_x86_code = translate_tu(p_m68k_code, 0)) == NULL)) {
+        ERROR("translating large TU failed");
+        return ++retval;
+    }
+    int ninsns;
+    for (ninsns = 1; (ninsns < 1000) && (tc_get_addr(gp_tlcache, p_m68k_code + ninsns * 2) == NULL); ninsns++)
+        ;
+    // MOVEQ is translated to 6 bytes, and the flags are computed with TEST (3 bytes) before the jump
+    q = p_x86_code + COUNTER_PROLOGUE_SIZE + ninsns * 6 + 3;
+    if ((ninsns == 1000) ||
+        (*q != OPCODE_JMP_REL32) ||
+        (q + 5 + *((int32_t *) (q + 1)) != tc_get_addr(gp_tlcache, p_m68k_code + ninsns * 2))) {
+        ERROR("large TU has not been split correctly");
+        ++retval;
+    }
+    else {
+        INFO("large TU has been split after %d instructions", ninsns);
+    }
+
+    // translate a TU with redundant moves and dead instructions with tier 1
+    static const uint16_t tier1_code[] = {
+        0x7001, 0x7001,                 // moveq #1, d0 (twice, second one is redundant)
+        0x2401, 0x2202,                 // move.l d1, d2, move.l d2, d1 (redundant)
+        0x7605, 0x7606,                 // moveq #5, d3 (dead), moveq #6, d3
+        0x4a84, 0x5385,                 // tst.l d4 (flags are dead), subq.l #1, d5
+        0x4e75                          // rts
+    };
+    uint8_t tier1_x86_code[] = {
+        0x41, 0xb8, 0x01, 0x00, 0x00, 0x00,     // mov r8d, 1
+        0x45, 0x89, 0xca,                       // mov r10d, r9d
+        0x41, 0xbb, 0x06, 0x00, 0x00, 0x00,     // mov r11d, 6
+        0x41, 0x83, 0xed, 0x01,                 // sub r13d, 1
+        0x0f, 0x92, 0x04, 0x25,                 // setc [X_FLAG_ADDRESS]
+        X_FLAG_ADDRESS & 0xff, (X_FLAG_ADDRESS >> 8) & 0xff, (X_FLAG_ADDRESS >> 16) & 0xff, X_FLAG_ADDRESS >> 24,
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <pop helper>
+        0xff, 0x24, 0x25, 0x00, 0x00, 0x00, 0x00    // jmp [<target>]
+    };
+    // a SUB whose result and NZVC flags are dead is kept because of the X flag, MOVEQ doesn't change it
+    static const uint16_t tier1_x_code[] = {
+        0x5383, 0x7600,                 // subq.l #1, d3 (sets X), moveq #0, d3
+        0x4e75                          // rts
+    };
+    uint8_t tier1_x_x86_code[] = {
+        0x41, 0x83, 0xeb, 0x01,                 // sub r11d, 1
+        0x41, 0xbb, 0x00, 0x00, 0x00, 0x00,     // mov r11d, 0
+        0x0f, 0x92, 0x04, 0x25,                 // setc [X_FLAG_ADDRESS]
+        X_FLAG_ADDRESS & 0xff, (X_FLAG_ADDRESS >> 8) & 0xff, (X_FLAG_ADDRESS >> 16) & 0xff, X_FLAG_ADDRESS >> 24,
+        0x45, 0x85, 0xdb,                       // test r11d, r11d
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <pop helper>
+        0xff, 0x24, 0x25, 0x00, 0x00, 0x00, 0x00    // jmp [<target>]
+    };
+    // (on the next page because the first one has been write-protected, both TUs are written before
+    // the first one is translated)
+    p_m68k_code += 4096;
+    for (size_t i = 0; i < sizeof(tier1_code) / sizeof(tier1_code[0]); i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(tier1_code[i]);
+    for (size_t i = 0; i < sizeof(tier1_x_code) / sizeof(tier1_x_code[0]); i++)
+        ((uint16_t *) (p_m68k_code + TIER1_X_CODE_OFFSET))[i] = htons(tier1_x_code[i]);
+    if ((setup_tu(p_m68k_code) == NULL) || ((p_x86_code = optimize_tu(p_m68k_code, 0)) == NULL)) {
+        ERROR("translating TU with tier 1 failed");
+        return ++retval;
+    }
+    set_return_fields(tier1_x86_code, sizeof(tier1_x86_code), p_x86_code);
+    if ((memcmp(p_x86_code, tier1_x86_code, sizeof(tier1_x86_code)) != 0) ||
+        (gp_tlcache->num_tier_tus[1] != 1) ||
+        (gp_tlcache->num_eliminated_insns != 4) ||
+        (tc_get_addr(gp_tlcache, p_m68k_code) != p_x86_code)) {
+        ERROR("TU has not been translated correctly with tier 1");
+        ++retval;
+    }
+    else {
+        INFO("TU has been translated with tier 1, %d instructions eliminated", gp_tlcache->num_eliminated_insns);
+    }
+    uint32_t num_eliminated_insns = gp_tlcache->num_eliminated_insns;
+    if ((setup_tu(p_m68k_code + TIER1_X_CODE_OFFSET) == NULL) ||
+        ((p_x86_code = optimize_tu(p_m68k_code + TIER1_X_CODE_OFFSET, 0)) == NULL)) {
+        ERROR("translating TU setting the X flag with tier 1 failed");
+        return ++retval;
+    }
+    set_return_fields(tier1_x_x86_code, sizeof(tier1_x_x86_code), p_x86_code);
+    if ((memcmp(p_x86_code, tier1_x_x86_code, sizeof(tier1_x_x86_code)) != 0) ||
+        (gp_tlcache->num_eliminated_insns != num_eliminated_insns)) {
+        ERROR("SUB setting the X flag has been eliminated by tier 1");
+        ++retval;
+    }
+    else {
+        INFO("SUB setting the X flag has been kept by tier 1");
+    }
+
+    // translate a TU the peephole optimizer can shorten with tier 0
+    static const uint16_t peephole_code[] = {
+        0x23c0, 0x0000, 0x2000,         // move.l d0, 0x2000
+        0x2239, 0x0000, 0x2000,         // move.l 0x2000, d1 (becomes a register move)
+        0x23c1, 0x0000, 0x2000,         // move.l d1, 0x2000 (redundant)
+        0x2c79, 0x0000, 0x2000,         // movea.l 0x2000, a6 (becomes a register move)
+        0x7405, 0x7605,                 // moveq #5, d2, moveq #5, d3 (becomes a register move)
+        0x4eae, 0xffe2, 0x4eae, 0xffdc, // jsr -30(a6), jsr -36(a6) (combined)
+        0x4e75                          // rts
+    };
+    uint8_t peephole_x86_code[] = {
+        0x41, 0x0f, 0xc8,                       // bswap r8d
+        0x44, 0x89, 0x04, 0x25, 0x00, 0x20, 0x00, 0x00, // mov [0x2000], r8d
+        0x41, 0x0f, 0xc8,                       // bswap r8d
+        0x45, 0x89, 0xc1,                       // mov r9d, r8d
+        0x44, 0x89, 0xce,                       // mov esi, r9d
+        0x41, 0xba, 0x05, 0x00, 0x00, 0x00,     // mov r10d, 5
+        0x45, 0x89, 0xd3,                       // mov r11d, r10d
+        0x56, 0x83, 0xc6, 0xe2, 0xff, 0xd6,     // push rsi, add esi, -30, call rsi
+        0x83, 0xc6, 0xfa, 0xff, 0xd6, 0x5e,     // add esi, -6, call rsi, pop rsi
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <pop helper>
+        0xff, 0x24, 0x25, 0x00, 0x00, 0x00, 0x00    // jmp [<target>]
+    };
+    p_m68k_code += 4096;
+    for (size_t i = 0; i < sizeof(peephole_code) / sizeof(peephole_code[0]); i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(peephole_code[i]);
+    uint32_t num_bytes_saved = gp_tlcache->num_peephole_bytes, num_x86_insns_saved = gp_tlcache->num_peephole_insns;
+    if ((setup_tu(p_m68k_code) == NULL) || ((p_x86_code = translate_tu(p_m68k_code, 0)) == NULL)) {
+        ERROR("translating TU for the peephole optimizer failed");
+        return ++retval;
+    }
+    num_bytes_saved = gp_tlcache->num_peephole_bytes - num_bytes_saved;
+    num_x86_insns_saved = gp_tlcache->num_peephole_insns - num_x86_insns_saved;
+    set_return_fields(peephole_x86_code, sizeof(peephole_x86_code), p_x86_code + COUNTER_PROLOGUE_SIZE);
+    if ((memcmp(p_x86_code + COUNTER_PROLOGUE_SIZE, peephole_x86_code, sizeof(peephole_x86_code)) != 0) ||
+        (num_bytes_saved != 33) ||
+        (num_x86_insns_saved != 3)) {
+        ERROR("TU has not been optimized correctly by the peephole optimizer");
+        ++retval;
+    }
+    else {
+        INFO("TU has been optimized by the peephole optimizer, %d bytes and %d x86 instructions saved", num_bytes_saved, num_x86_insns_saved);
+    }
+
+    // translate a TU with library calls that can be bound to the entry in the jump table, using a fake
+    // jump table on the last page (with the library base at its end and the thunk at its start) and the
+    // library base as value of A6 when the TU is entered
+    uint8_t *p_jump_tbl = p_m68k_code + 2 * 4096;
+    uint32_t lib_base = (uintptr_t) p_jump_tbl + 4096;
+    p_jump_tbl[4096 - 30] = OPCODE_JMP_REL32;
+    *((int32_t *) (p_jump_tbl + 4096 - 29)) = -(4096 - 25);
+    register_jump_table(p_jump_tbl, p_jump_tbl + 4096);
+    static const uint16_t bind_code[] = {
+        0x4eae, 0xffe2,                 // jsr -30(a6) (bound with a guard)
+        0x2c7c, 0x0000, 0x0000,         // movea.l #<library base>, a6
+        0x4eae, 0xffe2,                 // jsr -30(a6) (bound without a guard)
+        0x4e75                          // rts
+    };
+    uint8_t bind_x86_code[] = {
+        0x81, 0xfe, 0x00, 0x00, 0x00, 0x00,     // cmp esi, <library base>
+        0x75, 0x07,                             // jne +7
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <entry>
+        0xeb, 0x07,                             // jmp +7
+        0x56, 0x83, 0xc6, 0xe2, 0xff, 0xd6, 0x5e,   // push rsi, add esi, -30, call rsi, pop rsi
+        0xbe, 0x00, 0x00, 0x00, 0x00,           // mov esi, <library base>
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <entry>
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <pop helper>
+        0xff, 0x24, 0x25, 0x00, 0x00, 0x00, 0x00    // jmp [<target>]
+    };
+    p_m68k_code += 4096;
+    for (size_t i = 0; i < sizeof(bind_code) / sizeof(bind_code[0]); i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(bind_code[i]);
+    ((uint16_t *) p_m68k_code)[3] = htons(lib_base >> 16);
+    ((uint16_t *) p_m68k_code)[4] = htons(lib_base & 0xffff);
+    // (the page gets write-protected when the first TU on it is translated, so the second one is set up here)
+    static const uint16_t bind_mem_code[] = {
+        0x2c79, 0x0000, 0x0000,         // movea.l <address of library base>, a6
+        0x4eae, 0xffe2,                 // jsr -30(a6) (bound with a guard)
+        0x4e75                          // rts
+    };
+    uint8_t *p_bind_mem_code = p_m68k_code + 32;
+    uint32_t *p_lib_base_var = (uint32_t *) (p_m68k_code + 64);
+    for (size_t i = 0; i < sizeof(bind_mem_code) / sizeof(bind_mem_code[0]); i++)
+        ((uint16_t *) p_bind_mem_code)[i] = htons(bind_mem_code[i]);
+    ((uint16_t *) p_bind_mem_code)[1] = htons((uintptr_t) p_lib_base_var >> 16);
+    ((uint16_t *) p_bind_mem_code)[2] = htons((uintptr_t) p_lib_base_var & 0xffff);
+    *p_lib_base_var = htonl(lib_base);
+    if ((setup_tu(p_m68k_code) == NULL) || ((p_x86_code = translate_tu(p_m68k_code, lib_base)) == NULL)) {
+        ERROR("translating TU with library calls failed");
+        return ++retval;
+    }
+    q = p_x86_code + COUNTER_PROLOGUE_SIZE;
+    *((uint32_t *) (bind_x86_code + 2)) = lib_base;
+    *((uint32_t *) (bind_x86_code + 23)) = lib_base;
+    *((int32_t *) (bind_x86_code + 9)) = (p_jump_tbl + 4096 - 30) - (q + 13);
+    *((int32_t *) (bind_x86_code + 28)) = (p_jump_tbl + 4096 - 30) - (q + 32);
+    set_return_fields(bind_x86_code, sizeof(bind_x86_code), q);
+    if ((memcmp(q, bind_x86_code, sizeof(bind_x86_code)) != 0) ||
+        (gp_tlcache->num_bound_calls != 2) ||
+        (gp_tlcache->num_guarded_calls != 1)) {
+        ERROR("library calls have not been bound correctly");
+        ++retval;
+    }
+    else {
+        INFO("library calls have been bound to the entry in the jump table");
+    }
+    // the same TU with A6 loaded from memory (like MOVEA.L _DOSBase, A6, it was set up above), the
+    // library base stored there is big-endian like everything in guest memory, and the call is bound with a guard
+    if ((setup_tu(p_bind_mem_code) == NULL) || (translate_tu(p_bind_mem_code, 0) == NULL)) {
+        ERROR("translating TU with library call via A6 loaded from memory failed");
+        return ++retval;
+    }
+    if ((gp_tlcache->num_bound_calls != 3) || (gp_tlcache->num_guarded_calls != 2)) {
+        ERROR("library call via A6 loaded from memory has not been bound");
+        ++retval;
+    }
+    else {
+        INFO("library call via A6 loaded from memory has been bound to the entry in the jump table");
+    }
+
+    // translate a TU with a subroutine call, which pushes the return address onto the guest stack,
+    // records it on the shadow stack and jumps to the subroutine, followed by the jump to the TU of
+    // the following instruction (where the subroutine returns to), and the subroutine, which calls
+    // another one via A0 (on the page after the jump table) after looking up its target in the cache
+    // for the targets of indirect branches
+    static const uint16_t call_code[] = {
+        0x6104,                         // bsr.b +4 (to the JSR)
+        0x7001,                         // moveq #1, d0
+        0x4e75,                         // rts
+        0x4e90,                         // jsr (a0)
+        0x4e75                          // rts
+    };
+    uint8_t call_x86_code[] = {
+        0x48, 0x8d, 0x64, 0x24, 0xfc,           // lea rsp, [rsp - 4]
+        0xc7, 0x04, 0x24, 0x00, 0x00, 0x00, 0x00,   // mov dword [rsp], <return address>
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <push helper>
+        0xe9, 0x00, 0x00, 0x00, 0x00,           // jmp <subroutine>
+        0xe9, 0x00, 0x00, 0x00, 0x00            // jmp <return address>
+    };
+    uint8_t indirect_call_x86_code[] = {
+        0x52,                                   // push rdx
+        0x51,                                   // push rcx
+        0x89, 0xc2,                             // mov edx, eax
+        0x0f, 0xb7, 0xca,                       // movzx ecx, dx
+        0x8b, 0x0c, 0x8d, 0x00, 0x00, 0x00, 0x00,   // mov ecx, [rcx * 4 + <cache>]
+        0xf7, 0xd1,                             // not ecx
+        0x8d, 0x4c, 0x11, 0x01,                 // lea ecx, [rcx + rdx + 1]
+        0xe3, 0x26,                             // jrcxz <hit>
+        0x8b, 0x0c, 0x25, 0x00, 0x00, 0x00, 0x00,   // mov ecx, [<misses>]
+        0x8d, 0x49, 0x01,                       // lea ecx, [rcx + 1]
+        0x89, 0x0c, 0x25, 0x00, 0x00, 0x00, 0x00,   // mov [<misses>], ecx
+        0x89, 0x14, 0x25, 0x00, 0x00, 0x00, 0x00,   // mov [<target address for the branch dispatcher>], edx
+        0x48, 0xc7, 0x04, 0x25, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // mov qword [<target>], <branch dispatcher>
+        0xeb, 0x23,                             // jmp <end>
+        0x8b, 0x0c, 0x25, 0x00, 0x00, 0x00, 0x00,   // hit: mov ecx, [<hits>]
+        0x8d, 0x49, 0x01,                       // lea ecx, [rcx + 1]
+        0x89, 0x0c, 0x25, 0x00, 0x00, 0x00, 0x00,   // mov [<hits>], ecx
+        0x0f, 0xb7, 0xca,                       // movzx ecx, dx
+        0x8b, 0x0c, 0x8d, 0x00, 0x00, 0x00, 0x00,   // mov ecx, [rcx * 4 + <cache> + 4]
+        0x48, 0x89, 0x0c, 0x25, 0x00, 0x00, 0x00, 0x00, // mov [<target>], rcx
+        0x59,                                   // end: pop rcx
+        0x5a,                                   // pop rdx
+        0x48, 0x8d, 0x64, 0x24, 0xfc,           // lea rsp, [rsp - 4]
+        0xc7, 0x04, 0x24, 0x00, 0x00, 0x00, 0x00,   // mov dword [rsp], <return address>
+        0xe8, 0x00, 0x00, 0x00, 0x00,           // call <push helper for indirect calls>
+        0xff, 0x24, 0x25, 0x00, 0x00, 0x00, 0x00,   // jmp [<target>]
+        0xe9, 0x00, 0x00, 0x00, 0x00            // jmp <return address>
+    };
+    p_m68k_code = p_jump_tbl + 4096;
+    for (size_t i = 0; i < sizeof(call_code) / sizeof(call_code[0]); i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(call_code[i]);
+    uint8_t *p_sub_x86_code;
+    if ((setup_tu(p_m68k_code) == NULL) || ((p_x86_code = translate_tu(p_m68k_code, 0)) == NULL) ||
+        ((p_sub_x86_code = translate_tu(p_m68k_code + 6, 0)) == NULL)) {
+        ERROR("translating TUs with subroutine calls failed");
+        return ++retval;
+    }
+    q = p_x86_code + COUNTER_PROLOGUE_SIZE;
+    *((uint32_t *) (call_x86_code + 8)) = htonl((uint32_t) (uintptr_t) (p_m68k_code + 2));
+    *((int32_t *) (call_x86_code + 13)) = p_shadow_push - (q + 17);
+    *((int32_t *) (call_x86_code + 18)) = p_sub_x86_code - (q + 22);
+    *((int32_t *) (call_x86_code + 23)) = tc_get_addr(gp_tlcache, p_m68k_code + 2) - (q + 27);
+    uint8_t *q_sub = p_sub_x86_code + COUNTER_PROLOGUE_SIZE;
+    uint32_t counts = (uint32_t) (uintptr_t) gp_tlcache->indirect_sites[gp_tlcache->num_indirect_sites - 1].p_counts;
+    *((uint32_t *) (indirect_call_x86_code + 10)) = INDIRECT_CACHE_ADDRESS;
+    *((uint32_t *) (indirect_call_x86_code + 25)) = counts + 4;
+    *((uint32_t *) (indirect_call_x86_code + 35)) = counts + 4;
+    *((uint32_t *) (indirect_call_x86_code + 42)) = SHADOW_FIELD_ADDRESS(indirect_src);
+    *((uint32_t *) (indirect_call_x86_code + 50)) = SHADOW_FIELD_ADDRESS(p_target);
+    *((uint32_t *) (indirect_call_x86_code + 54)) = (uint32_t) (uintptr_t) p_branch_dispatcher;
+    *((uint32_t *) (indirect_call_x86_code + 63)) = counts;
+    *((uint32_t *) (indirect_call_x86_code + 73)) = counts;
+    *((uint32_t *) (indirect_call_x86_code + 83)) = INDIRECT_CACHE_ADDRESS + 4;
+    *((uint32_t *) (indirect_call_x86_code + 91)) = SHADOW_FIELD_ADDRESS(p_target);
+    *((uint32_t *) (indirect_call_x86_code + 105)) = htonl((uint32_t) (uintptr_t) (p_m68k_code + 8));
+    *((int32_t *) (indirect_call_x86_code + 110)) = p_shadow_push_indirect - (q_sub + 114);
+    *((uint32_t *) (indirect_call_x86_code + 117)) = SHADOW_FIELD_ADDRESS(p_target);
+    *((int32_t *) (indirect_call_x86_code + 122)) = tc_get_addr(gp_tlcache, p_m68k_code + 8) - (q_sub + 126);
+    if ((memcmp(q, call_x86_code, sizeof(call_x86_code)) != 0) ||
+        (gp_tlcache->indirect_sites[gp_tlcache->num_indirect_sites - 1].p_src_addr != p_m68k_code + 6) ||
+        (memcmp(q_sub, indirect_call_x86_code, sizeof(indirect_call_x86_code)) != 0)) {
+        ERROR("subroutine calls have not been translated correctly");
+        ++retval;
+    }
+    else {
+        INFO("subroutine calls have been translated with the shadow stack");
+    }
+
+    // translate a program ahead of time, save it as an image and run it from the image, without translating
+    // anything at runtime (the target of the branch that is never taken is on a page that is not mapped, the
+    // translation of this TU is abandoned)
+    static const uint16_t aot_code[] = {
+        0x7000,                         //        moveq #0, d0
+        0x207c, 0x0000, 0x0000,         //        movea.l #sub, a0
+        0x6100, 16,                     // loop:  bsr.w sub
+        0x4e90,                         //        jsr (a0)
+        0x4a82, 0x6600, 0x1fee,         //        tst.l d2, bne.w <next page but one>
+        0x5381, 0x66f0,                 //        subq.l #1, d1, bne.b loop
+        0x4e75,                         //        rts
+        0x5380, 0x4e75                  // sub:   subq.l #1, d0, rts
+    };
+    uint8_t *p_aot_code = (uint8_t *) TEST_CODE_ADDRESS + 0x10000;
+    if ((mmap(p_aot_code, 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0) == MAP_FAILED) ||
+        (munmap(p_aot_code + 0x2000, 4096) == -1) ||
+        (mmap((void *) ABS_EXEC_BASE, 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0) == MAP_FAILED)) {
+        ERROR("could not create memory mappings for program translated ahead of time: %s", strerror(errno));
+        return ++retval;
+    }
+    for (size_t i = 0; i < sizeof(aot_code) / sizeof(aot_code[0]); i++)
+        ((uint16_t *) p_aot_code)[i] = htons(aot_code[i]);
+    ((uint16_t *) p_aot_code)[2] = htons((uintptr_t) (p_aot_code + 26) >> 16);
+    ((uint16_t *) p_aot_code)[3] = htons((uintptr_t) (p_aot_code + 26) & 0xffff);
+    char image_fname[] = "/tmp/translate_test_XXXXXX";
+    close(mkstemp(image_fname));
+    int num_symbols;
+    const RuntimeSymbol *p_symbols = get_runtime_symbols(&num_symbols);
+    g_tier1_threshold = 0;
+    tc_flush(gp_tlcache);
+    reset_shadow_stack();
+    gp_tlcache->program_hash = 0x1234;
+    if (!tc_align_flushable(gp_tlcache) || (setup_tu(p_aot_code) == NULL) || !translate_program(2) ||
+        !tc_save_image(gp_tlcache, image_fname, p_symbols, num_symbols)) {
+        ERROR("translating program ahead of time failed");
+        unlink(image_fname);
+        return ++retval;
+    }
+    TranslationUnit *p_unmapped_tu = tc_get_tu(gp_tlcache, p_aot_code + 0x2000);
+    if ((p_unmapped_tu == NULL) || (p_unmapped_tu->p_x86_code != NULL)) {
+        ERROR("TU that is not in mapped memory has not been set up or has been translated");
+        ++retval;
+    }
+    tc_flush(gp_tlcache);
+    reset_shadow_stack();
+    bool is_loaded = tc_load_image(gp_tlcache, image_fname, 0x1234, p_symbols, num_symbols);
+    unlink(image_fname);
+    uint32_t num_translated_tus = gp_tlcache->num_translated_tus;
+    uint8_t *p_guest_code;
+    if (!is_loaded || ((p_guest_code = setup_program(p_aot_code)) == NULL)) {
+        ERROR("loading image failed");
+        return ++retval;
+    }
+    uint32_t d0 = run_guest(p_guest_code, 10);
+    if ((d0 != (uint32_t) -20) || (gp_tlcache->num_translated_tus != num_translated_tus)) {
+        ERROR("program run from image has returned D0 = %d (expected -20) and %d TUs have been translated",
+              d0, gp_tlcache->num_translated_tus - num_translated_tus);
+        ++retval;
+    }
+    else {
+        INFO("program translated ahead of time has been run from an image");
+    }
     return retval;
 }
 #endif
+
+
+//
+// benchmark comparing the startup time with an empty translation cache (every TU needs to
+// be translated) and with a translation cache loaded from a file
+//
+#ifdef BENCHMARK
+#define NUM_BENCH_TUS       2000
+#define NUM_BENCH_MOVEQS    20
+#define BENCH_TU_SIZE       (NUM_BENCH_MOVEQS * 2 + 4)
+#define NUM_BENCH_LOOPS     10000000
+#define NUM_BENCH_ROUNDS    50
+#define SPEED_CODE_ADDRESS  (TEST_CODE_ADDRESS + 0x40000)
+#define LOOP_CODE_ADDRESS   (TEST_CODE_ADDRESS + 0x80000)
+#define CALL_CODE_ADDRESS   (TEST_CODE_ADDRESS + 0x90000)
+#define SWITCH_CODE_ADDRESS (TEST_CODE_ADDRESS + 0xa0000)
+#define MEMORY_CODE_ADDRESS (TEST_CODE_ADDRESS + 0xb0000)
+#define NUM_AOT_BENCH_TUS   7000
+#define NUM_AOT_BENCH_ROUNDS 10
+#define AOT_CODE_ADDRESS    (TEST_CODE_ADDRESS + 0xc0000)       // up to the end of the guest address space covered by the cache
+
+static int bench_persistent_cache()
+{
+    uint8_t *p_m68k_code;
+    size_t code_size = NUM_BENCH_TUS * BENCH_TU_SIZE;
+    if ((p_m68k_code = mmap((void *) TEST_CODE_ADDRESS, code_size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    // each TU consists of a number of MOVEQs and a BEQ.W to the following TU (so both successors are the same)
+    uint16_t *p_pos = (uint16_t *) p_m68k_code;
+    for (int i = 0; i < NUM_BENCH_TUS; i++) {
+        for (int j = 0; j < NUM_BENCH_MOVEQS; j++)
+            *p_pos++ = htons(0x7001);
+        *p_pos++ = htons(0x6700);
+        *p_pos++ = htons(2);
+    }
+
+    char fname[] = "/tmp/translate_bench_XXXXXX";
+    close(mkstemp(fname));
+    unlink(fname);
+    gp_tlcache = tc_init(DEFAULT_CODE_CACHE_SIZE);
+    setup_dispatchers();
+    tc_attach_file(gp_tlcache, fname, 0x1234);
+    uint64_t start = get_time_ns();
+    for (int i = 0; i < NUM_BENCH_TUS; i++) {
+        if ((setup_tu(p_m68k_code + i * BENCH_TU_SIZE) == NULL) || (translate_tu(p_m68k_code + i * BENCH_TU_SIZE, 0) == NULL)) {
+            ERROR("translating TU failed");
+            return 1;
+        }
+    }
+    uint64_t cold_time = get_time_ns() - start;
+    tc_save_file(gp_tlcache);
+
+    tc_flush(gp_tlcache);
+    start = get_time_ns();
+    if (!tc_attach_file(gp_tlcache, fname, 0x1234)) {
+        ERROR("loading translation cache failed");
+        return 1;
+    }
+    uint64_t warm_time = get_time_ns() - start;
+    unlink(fname);
+    if (tc_get_addr(gp_tlcache, p_m68k_code + (NUM_BENCH_TUS - 1) * BENCH_TU_SIZE) == NULL) {
+        ERROR("translated code is missing after loading translation cache");
+        return 1;
+    }
+    INFO("%d TUs, translated: %.3f ms, loaded from file: %.3f ms (%.1fx faster)",
+           NUM_BENCH_TUS, cold_time / 1e6, warm_time / 1e6, (double) cold_time / warm_time);
+    return 0;
+}
+
+
+// measure how many instructions per second tier 0 translates, with TUs consisting of a typical
+// mix of the supported instructions (best of several rounds, the cache is flushed in between)
+static int bench_translation_speed()
+{
+    static const uint16_t tu_code[] = {
+        0x7001,                         // moveq #1, d0
+        0x2200,                         // move.l d0, d1
+        0x2439, 0x5555, 0xaaaa,         // move.l 0x5555aaaa, d2
+        0x23c2, 0x5555, 0xaaaa,         // move.l d2, 0x5555aaaa
+        0x5383,                         // subq.l #1, d3
+        0x4a84,                         // tst.l d4
+        0x57c5,                         // seq d5
+        0x287c, 0xdead, 0xbeef,         // movea.l #0xdeadbeef, a4
+        0x6600, 2                       // bne.w next TU
+    };
+    const int num_insns_per_tu = 9, tu_size = sizeof(tu_code);
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) SPEED_CODE_ADDRESS, NUM_BENCH_TUS * tu_size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < NUM_BENCH_TUS; i++) {
+        for (size_t j = 0; j < sizeof(tu_code) / sizeof(tu_code[0]); j++)
+            ((uint16_t *) (p_m68k_code + i * tu_size))[j] = htons(tu_code[j]);
+    }
+
+    uint64_t best_time = UINT64_MAX;
+    for (int round = 0; round < NUM_BENCH_ROUNDS; round++) {
+        tc_flush(gp_tlcache);
+        uint64_t start = get_time_ns();
+        for (int i = 0; i < NUM_BENCH_TUS; i++) {
+            if ((setup_tu(p_m68k_code + i * tu_size) == NULL) || (translate_tu(p_m68k_code + i * tu_size, 0) == NULL)) {
+                ERROR("translating TU failed");
+                return 1;
+            }
+        }
+        uint64_t elapsed = get_time_ns() - start;
+        if (elapsed < best_time)
+            best_time = elapsed;
+    }
+    INFO("tier 0 translates %.2f million instructions per second (%.1f ns per instruction)",
+         (double) NUM_BENCH_TUS * num_insns_per_tu * 1e3 / best_time, (double) best_time / (NUM_BENCH_TUS * num_insns_per_tu));
+    return 0;
+}
+
+
+// measure how long the ahead-of-time translation of a large program takes with different numbers
+// of threads (best of several rounds), the TUs form a binary tree (TU i branches to TU 2i + 2 and falls through to TU i + 1),
+// so the number of TUs that can be translated in parallel grows quickly
+static int bench_parallel_translation()
+{
+    static const uint16_t tu_code[] = {
+        0x7001,                         // moveq #1, d0
+        0x2200,                         // move.l d0, d1
+        0x2439, 0x5555, 0xaaaa,         // move.l 0x5555aaaa, d2
+        0x23c2, 0x5555, 0xaaaa,         // move.l d2, 0x5555aaaa
+        0x5383,                         // subq.l #1, d3
+        0x4a84,                         // tst.l d4
+        0x57c5,                         // seq d5
+        0x287c, 0xdead, 0xbeef,         // movea.l #0xdeadbeef, a4
+        0x67ff, 0, 0                    // beq.l TU 2i + 2 (offset filled in below)
+    };
+    const int tu_size = sizeof(tu_code), num_insns_per_tu = 9;
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) AOT_CODE_ADDRESS, NUM_AOT_BENCH_TUS * tu_size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < NUM_AOT_BENCH_TUS; i++) {
+        uint16_t *p_tu_code = (uint16_t *) (p_m68k_code + i * tu_size);
+        for (size_t j = 0; j < sizeof(tu_code) / sizeof(tu_code[0]); j++)
+            p_tu_code[j] = htons(tu_code[j]);
+        if (i == NUM_AOT_BENCH_TUS - 1) {
+            // the last TU just returns
+            p_tu_code[sizeof(tu_code) / sizeof(tu_code[0]) - 3] = htons(0x4e75);
+            break;
+        }
+        int target = 2 * i + 2 < NUM_AOT_BENCH_TUS ? 2 * i + 2 : NUM_AOT_BENCH_TUS - 1;
+        // offset is relative to the position after the opcode
+        int32_t offset = (target - i) * tu_size - (tu_size - 4);
+        p_tu_code[sizeof(tu_code) / sizeof(tu_code[0]) - 2] = htons((uint32_t) offset >> 16);
+        p_tu_code[sizeof(tu_code) / sizeof(tu_code[0]) - 1] = htons(offset & 0xffff);
+    }
+
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 2)
+        max_threads = 2;
+    else if (max_threads > MAX_AOT_THREADS)
+        max_threads = MAX_AOT_THREADS;
+    uint64_t single_thread_time = 0;
+    // 1, 2, 4, ... threads up to the number of CPUs (but at least 2)
+    for (int n = 1; n < 2 * max_threads; n *= 2) {
+        int num_threads = n < max_threads ? n : max_threads;
+        uint64_t best_time = UINT64_MAX;
+        num_cache_locks = 0;
+        for (int round = 0; round < NUM_AOT_BENCH_ROUNDS; round++) {
+            tc_flush(gp_tlcache);
+            uint32_t num_tus = gp_tlcache->num_tier_tus[0];
+            uint64_t start = get_time_ns();
+            if ((setup_tu(p_m68k_code) == NULL) || !translate_program(num_threads)) {
+                ERROR("translating program failed");
+                return 1;
+            }
+            uint64_t elapsed = get_time_ns() - start;
+            if ((num_tus = gp_tlcache->num_tier_tus[0] - num_tus) != NUM_AOT_BENCH_TUS) {
+                ERROR("%d TUs translated instead of %d", num_tus, NUM_AOT_BENCH_TUS);
+                return 1;
+            }
+            if (elapsed < best_time)
+                best_time = elapsed;
+        }
+        if (num_threads == 1)
+            single_thread_time = best_time;
+        INFO("ahead-of-time translation with %2d threads: %d TUs / %d instructions in %.3f ms (%.2fx), lock taken %.2f times per TU",
+             num_threads, NUM_AOT_BENCH_TUS, NUM_AOT_BENCH_TUS * num_insns_per_tu, best_time / 1e6, (double) single_thread_time / best_time,
+             (double) num_cache_locks / (NUM_AOT_BENCH_ROUNDS * NUM_AOT_BENCH_TUS));
+    }
+    return 0;
+}
+
+
+// run a loop with four conditional branches per iteration (three of them are never taken), so
+// that each iteration executes four TUs, and some instructions tier 1 can eliminate, with tier 0
+// only, with tier 0 and the execution counters, and with tier 1
+static int bench_tiers()
+{
+    static const uint16_t loop_code[] = {
+        0x4a82, 0x6600, 28,             // loop:  tst.l d2, bne.w never
+        0x4a83, 0x5383,                 //        tst.l d3 (flags are dead), subq.l #1, d3
+        0x2a03, 0x2a04,                 //        move.l d3, d5 (dead), move.l d4, d5
+        0x7c01, 0x7c01,                 //        moveq #1, d6, moveq #1, d6 (redundant)
+        0x4a82, 0x6600, 10,             //        tst.l d2, bne.w never
+        0x5381, 0x6600, -28,            //        subq.l #1, d1, bne.w loop
+        0x4e75,                         //        rts
+        0x7001, 0x4e75                  // never: moveq #1, d0, rts
+    };
+    static const struct {const char *p_name; uint32_t threshold;} configs[] = {
+        {"tier 0 only         ", 0},
+        {"tier 0 with counters", UINT32_MAX},
+        {"tier 1              ", DEFAULT_TIER1_THRESHOLD}
+    };
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) LOOP_CODE_ADDRESS, 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    // SUBQ writes the X flag, which lives on the same page as the base address of Exec library
+    if (mmap((void *) ABS_EXEC_BASE, 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0) == MAP_FAILED) {
+        ERROR("could not create memory mapping for X flag: %s", strerror(errno));
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(loop_code) / sizeof(loop_code[0]); i++)
+        ((uint16_t *) p_m68k_code)[i] = htons(loop_code[i]);
+
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        g_tier1_threshold = configs[i].threshold;
+        tc_flush(gp_tlcache);
+        memset(gp_tlcache->num_tier_tus, 0, sizeof(gp_tlcache->num_tier_tus));
+        memset(gp_tlcache->tier_code_size, 0, sizeof(gp_tlcache->tier_code_size));
+        gp_tlcache->num_eliminated_insns = 0;
+        uint8_t *p_x86_code = setup_program(p_m68k_code);
+        // warm up, so that all TUs are translated (and the hot ones with tier 1)
+        run_guest(p_x86_code, 1000);
+        uint64_t start = get_time_ns();
+        run_guest(p_x86_code, NUM_BENCH_LOOPS);
+        uint64_t elapsed = get_time_ns() - start;
+        INFO("%s: %.2f ns per iteration, tier 0: %d TUs / %d bytes, tier 1: %d TUs / %d bytes, %d instructions eliminated",
+             configs[i].p_name, (double) elapsed / NUM_BENCH_LOOPS,
+             gp_tlcache->num_tier_tus[0], gp_tlcache->tier_code_size[0],
+             gp_tlcache->num_tier_tus[1], gp_tlcache->tier_code_size[1],
+             gp_tlcache->num_eliminated_insns);
+    }
+    g_tier1_threshold = DEFAULT_TIER1_THRESHOLD;
+    return 0;
+}
+
+
+// run a loop calling a subroutine with BSR and with JSR (A0) (which looks up its target in the cache
+// for the targets of indirect branches), the returns are predicted by the shadow stack
+static int bench_calls()
+{
+    static const uint16_t call_code[] = {
+        0x207c, 0x0000, 0x0000,         //        movea.l #sub, a0
+        0x6106,                         // loop:  bsr.b sub (or jsr (a0))
+        0x5381, 0x66fa,                 //        subq.l #1, d1, bne.b loop
+        0x4e75,                         //        rts
+        0x7001, 0x4e75                  // sub:   moveq #1, d0, rts
+    };
+    static const struct {const char *p_name; uint16_t opcode;} configs[] = {
+        {"BSR     + RTS", 0x6106},
+        {"JSR (A0) + RTS", 0x4e90}
+    };
+    // each configuration gets a page of its own because pages with translated code are write-protected
+    const size_t num_configs = sizeof(configs) / sizeof(configs[0]);
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) CALL_CODE_ADDRESS, num_configs * 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    for (size_t i = 0; i < num_configs; i++) {
+        uint16_t *p_code = (uint16_t *) (p_m68k_code + i * 4096);
+        uint32_t sub = CALL_CODE_ADDRESS + i * 4096 + 14;
+        for (size_t j = 0; j < sizeof(call_code) / sizeof(call_code[0]); j++)
+            p_code[j] = htons(call_code[j]);
+        p_code[1] = htons(sub >> 16);
+        p_code[2] = htons(sub & 0xffff);
+        p_code[3] = htons(configs[i].opcode);
+    }
+
+    for (size_t i = 0; i < num_configs; i++) {
+        tc_flush(gp_tlcache);
+        reset_shadow_stack();
+        gp_tlcache->num_return_misses = 0;
+        uint8_t *p_x86_code = setup_program(p_m68k_code + i * 4096);
+        run_guest(p_x86_code, 1000);
+        uint64_t start = get_time_ns();
+        run_guest(p_x86_code, NUM_BENCH_LOOPS / 10);
+        uint64_t elapsed = get_time_ns() - start;
+        INFO("%s: %.2f ns per iteration, %d returns not predicted by the shadow stack",
+             configs[i].p_name, (double) elapsed / (NUM_BENCH_LOOPS / 10), gp_tlcache->num_return_misses);
+    }
+    return 0;
+}
+
+
+// run a loop with a switch statement as an interpreter would have it, a JMP through a table indexed
+// by D0 (here the table consists of the cases themselves), with each case selecting the next one,
+// so that the JMP always has the same target or cycles through four of them
+static int bench_switch()
+{
+    static const uint16_t switch_code[] = {
+        0x7000,                         //        moveq #0, d0
+        0x4efb, 0x0002,                 // loop:  jmp case0(pc, d0.w)
+        0x7004, 0x600a,                 // case0: moveq #4, d0 (or moveq #0, d0), bra.b next
+        0x7008, 0x6006,                 // case1: moveq #8, d0, bra.b next
+        0x700c, 0x6002,                 // case2: moveq #12, d0, bra.b next
+        0x7000,                         // case3: moveq #0, d0
+        0x5381, 0x66ea,                 // next:  subq.l #1, d1, bne.b loop
+        0x4e75                          //        rts
+    };
+    static const struct {const char *p_name; uint16_t case0;} configs[] = {
+        {"JMP d8(PC, D0.W), 1 target ", 0x7000},
+        {"JMP d8(PC, D0.W), 4 targets", 0x7004}
+    };
+    // each configuration gets a page of its own because pages with translated code are write-protected
+    const size_t num_configs = sizeof(configs) / sizeof(configs[0]);
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) SWITCH_CODE_ADDRESS, num_configs * 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    for (size_t i = 0; i < num_configs; i++) {
+        uint16_t *p_code = (uint16_t *) (p_m68k_code + i * 4096);
+        for (size_t j = 0; j < sizeof(switch_code) / sizeof(switch_code[0]); j++)
+            p_code[j] = htons(switch_code[j]);
+        p_code[3] = htons(configs[i].case0);
+    }
+
+    for (size_t i = 0; i < num_configs; i++) {
+        tc_flush(gp_tlcache);
+        uint8_t *p_x86_code = setup_program(p_m68k_code + i * 4096);
+        run_guest(p_x86_code, 1000);
+        uint32_t hits = 0, misses = 0;
+        for (uint32_t j = 0; j < gp_tlcache->num_indirect_sites; j++) {
+            hits -= gp_tlcache->indirect_sites[j].p_counts[0];
+            misses -= gp_tlcache->indirect_sites[j].p_counts[1];
+        }
+        uint64_t start = get_time_ns();
+        run_guest(p_x86_code, NUM_BENCH_LOOPS / 10);
+        uint64_t elapsed = get_time_ns() - start;
+        for (uint32_t j = 0; j < gp_tlcache->num_indirect_sites; j++) {
+            hits += gp_tlcache->indirect_sites[j].p_counts[0];
+            misses += gp_tlcache->indirect_sites[j].p_counts[1];
+        }
+        INFO("%s: %.2f ns per iteration, %u hits, %u misses in the cache for the targets of indirect branches",
+             configs[i].p_name, (double) elapsed / (NUM_BENCH_LOOPS / 10), hits, misses);
+    }
+    return 0;
+}
+
+
+// run a loop that loads and stores a long and a word, once with BSWAP / ROL and once with MOVBE (if
+// the CPU supports it), the difference is the cost of the byte swapping
+static int bench_memory_access()
+{
+    static const uint16_t memory_code[] = {
+        0x2039, 0x0000, 0x0000,         // loop:  move.l data, d0
+        0x23c0, 0x0000, 0x0004,         //        move.l d0, data + 4
+        0x3439, 0x0000, 0x0000,         //        move.w data, d2
+        0x33c2, 0x0000, 0x0006,         //        move.w d2, data + 6
+        0x5381, 0x66e4,                 //        subq.l #1, d1, bne.b loop
+        0x4e75                          //        rts
+    };
+    const bool movbe_supported = g_use_movbe;
+    // data on a page of its own because pages with translated code are write-protected
+    uint8_t *p_m68k_code;
+    if ((p_m68k_code = mmap((void *) MEMORY_CODE_ADDRESS, 2 * 4096, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_ANON | MAP_PRIVATE, -1, 0)) == MAP_FAILED) {
+        ERROR("could not create memory mapping for code: %s", strerror(errno));
+        return 1;
+    }
+    uint16_t *p_code = (uint16_t *) p_m68k_code;
+    const uint32_t data = MEMORY_CODE_ADDRESS + 4096;
+    for (size_t i = 0; i < sizeof(memory_code) / sizeof(memory_code[0]); i++)
+        p_code[i] = htons(memory_code[i]);
+    for (size_t i = 1; i < 12; i += 3) {
+        uint32_t addr = data + p_code[i + 1];
+        p_code[i] = htons(addr >> 16);
+        p_code[i + 1] = htons(addr & 0xffff);
+    }
+
+    for (int use_movbe = 0; use_movbe <= (int) movbe_supported; use_movbe++) {
+        g_use_movbe = use_movbe;
+        tc_flush(gp_tlcache);
+        uint8_t *p_x86_code = setup_program(p_m68k_code);
+        run_guest(p_x86_code, 1000);
+        uint64_t start = get_time_ns();
+        run_guest(p_x86_code, NUM_BENCH_LOOPS);
+        uint64_t elapsed = get_time_ns() - start;
+        INFO("%s: %.2f ns per iteration with 4 accesses", use_movbe ? "MOVBE        " : "BSWAP / ROL 8",
+             (double) elapsed / NUM_BENCH_LOOPS);
+    }
+    if (!movbe_supported)
+        INFO("CPU does not support MOVBE");
+    g_use_movbe = movbe_supported;
+    return 0;
+}
+
+
+int main()
+{
+    return bench_persistent_cache() + bench_translation_speed() + bench_parallel_translation() + bench_tiers() + bench_calls() +
+           bench_switch() + bench_memory_access();
+}
+#endif
+
+
+//
+// generator of the opcode table (mkopctbl), writes opcode_index_tbl to stdout
+//
+#ifdef GENERATE_OPCODE_TBL
+int main()
+{
+    static const OpcodeInfo *p_opc_info_lookup_tbl[0x10000];
+
+    if (sizeof(opcode_info_tbl) / sizeof(opcode_info_tbl[0]) > UINT8_MAX) {
+        ERROR("too many entries in opcode info table for 8-bit indexes");
+        return 1;
+    }
+    init_opc_info_lookup_tbl(p_opc_info_lookup_tbl);
+    printf("//\n// opcode_index_tbl.h - part of the Virtual AmigaDOS Machine (VADM)\n");
+    printf("//                      generated by mkopctbl, do not edit\n//\n\n");
+    printf("// index + 1 of the entry in opcode_info_tbl for each opcode, 0 = opcode not supported\n");
+    printf("static const uint8_t opcode_index_tbl[0x10000] = {\n");
+    for (int i = 0; i < 0x10000; i++) {
+        printf("%s%d,%s", (i % 32 == 0) ? "    " : "",
+               p_opc_info_lookup_tbl[i] != NULL ? (int) (p_opc_info_lookup_tbl[i] - opcode_info_tbl) + 1 : 0,
+               (i % 32 == 31) ? "\n" : " ");
+    }
+    printf("};\n");
+    return 0;
+}
+#endif
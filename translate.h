@@ -15,56 +15,191 @@
 #include <sys/errno.h>
 #include <sys/mman.h>
 
+#include "tlcache.h"            // for RuntimeSymbol
+
 // constants
-#define START_OF_TRANSLATED_CODE 128
-#define MAX_INSTRUCTION_SIZE 10         // only for the unit tests
+#define MAX_INSTRUCTION_SIZE 20         // only for the unit tests
+#define TEST_CODE_ADDRESS 0x00100000    // only for the unit tests
+#define MAX_TU_SIZE 4096                // size of the buffer the code of a TU is generated in
+#define MAX_TRANSLATED_INSN_SIZE 64     // maximum size of the code generated for one instruction
+#define MAX_FIXUPS_PER_TU 16            // maximum number of jumps to other TUs in one TU
+#define MAX_DISPATCHER_SIZE 128         // maximum size of the code of the dispatcher
+#define STUB_SIZE 10                    // size of the stub of a TU (PUSH imm32 + JMP rel32)
+#define COUNTER_PROLOGUE_SIZE 34        // size of the code at the start of a tier-0 TU that counts its executions
+#define DEFAULT_TIER1_THRESHOLD 50      // number of executions after which a TU is translated again with tier 1
+#define MAX_TRACE_BLOCKS 8              // maximum number of basic blocks in a trace
+#define MAX_AOT_THREADS 64              // maximum number of threads translating the program ahead of time
+#define SHADOW_STACK_ADDRESS 0x0c000000 // fixed address of the shadow stack, below 2GB so that the code can use 32-bit absolute addresses
+#define SHADOW_STACK_SIZE 4096          // number of entries in the shadow stack
+#define GUEST_EXIT_ADDRESS 0xfffffffe   // return address pushed for the main routine of the guest (never a TU)
+#define MAX_IR_INSNS_PER_TU ((MAX_TU_SIZE - COUNTER_PROLOGUE_SIZE) / MAX_TRANSLATED_INSN_SIZE)   // so that the generated code fits into the buffer
+
+// structure describing an operand as returned by extract_operand()
+typedef struct
+{
+    uint8_t  op_type;                   // operand type: register, address, immediate value
+    uint8_t  op_length;                 // operand length: 1, 2 or 4 bytes
+    uint8_t  op_base;                   // OP_TARGET: address register the address is relative to, NO_REG if none
+    uint8_t  op_index;                  // OP_TARGET: index register (0-7 = D0-D7, 8-15 = A0-A7) | INDEX_LONG, NO_REG if none
+    uint32_t op_value;                  // operand value (OP_TARGET: displacement, or the address itself if there is no base register)
+} Operand;
+
+// structure describing an instruction of the intermediate representation (IR) the opcode handlers
+// lower the instructions into, one flat array per TU (32 bytes per instruction, two per cache line)
+typedef struct
+{
+    uint8_t  ir_opcode;                 // IR_MOVE, IR_SUB, ...
+    uint8_t  ir_cond;                   // condition of IR_BRANCH / IR_SCC (680x0 condition code)
+    uint8_t  ir_flags;                  // IR_SETS_FLAGS, IR_USES_FLAGS, IR_FLAGS_LIVE, IR_CALL_*, IR_DEAD
+    uint16_t ir_reg_uses;               // guest registers read by the instruction...
+    uint16_t ir_reg_defs;               // ... and written by it (bits 0-7 = D0-D7, bits 8-15 = A0-A7)
+    Operand  ir_src;                    // source operand
+    Operand  ir_dst;                    // destination operand
+    const uint8_t *p_target;            // source address of the TU IR_BRANCH / IR_JUMP / IR_DBRA go to,
+                                        // or entry in the jump table a bound IR_LIB_CALL goes to (with the library base in ir_dst)
+} IrInsn;
+
+#define IR_MOVE         0               // dst = src
+#define IR_SUB          1               // dst = dst - src
+#define IR_TEST         2               // set flags according to src
+#define IR_LIB_CALL     3               // call library routine at A6 + src
+#define IR_RETURN       4               // return from subroutine
+#define IR_BRANCH       5               // jump to another TU if condition is met
+#define IR_JUMP         6               // jump to another TU
+#define IR_SCC          7               // set lowest byte of dst according to condition
+#define IR_DBRA         8               // decrement lower word of dst and jump to another TU unless it is -1
+#define IR_CALL         9               // push return address dst and jump to another TU, always followed by IR_JUMP to
+                                        // the return address
+// IR_JUMP and IR_CALL go to the address in src instead if it is an OP_TARGET operand (an indirect branch),
+// p_target is then the source address of the branch instruction itself
+
+#define IR_SETS_FLAGS   0x01            // instruction sets (or clobbers) the flags
+#define IR_USES_FLAGS   0x02            // instruction (or the code it jumps to) uses the flags
+#define IR_FLAGS_LIVE   0x04            // flags set by the instruction are used later
+#define IR_CALL_CONT    0x08            // IR_LIB_CALL continues a sequence of calls, A6 has been saved by the first one
+#define IR_CALL_OPEN    0x10            // IR_LIB_CALL is followed by one continuing the sequence, A6 stays saved
+#define IR_CALL_DIRECT  0x20            // IR_LIB_CALL has been bound to the entry of the routine in the jump table...
+#define IR_CALL_GUARD   0x40            // ... but A6 may not hold the library base, so it must be checked
+#define IR_DEAD         0x80            // instruction has been eliminated
+
+#define IR_ALL_REGS     0xffff
 
 // structure describing an opcode
 // TODO: adapt to naming convention
-typedef int (*OpcodeHandlerFunc)(uint16_t, const uint8_t **, uint8_t **);
+typedef int (*OpcodeHandlerFunc)(uint16_t, const uint8_t **, IrInsn **);
 typedef struct
 {
-    OpcodeHandlerFunc  opc_handler;     // handler function
+    OpcodeHandlerFunc  opc_handler;     // handler function (lowering the instruction into the IR)
     uint16_t opc_mask;                  // mask on opcode
     uint16_t opc_match;                 // what to match after masking
     uint16_t opc_ea_mask;               // allowed effective address modes
     bool     opc_terminal;              // terminal instruction in a translation unit
 } OpcodeInfo;
 
-// structure describing an operand as returned by extract_operand()
+// state of the lazy evaluation of the condition codes in the TU currently being translated
 typedef struct
 {
-    uint8_t  op_type;                   // operand type: register, address, immediate value
-    uint8_t  op_length;                 // operand length: 1, 2 or 4 bytes
-    uint32_t op_value;                  // operand value
-} Operand;
+    uint8_t  ccr_kind;                  // CCR_NATIVE, CCR_RESULT or CCR_CONST
+    uint8_t  ccr_reg;                   // data register holding the value that determines N and Z...
+    uint8_t  ccr_length;                // ... and its length (1, 2 or 4 bytes)
+    uint32_t ccr_value;                 // this value, if it is known at translation time (CCR_CONST)
+    bool     x_pending;                 // the X flag is in the CF and hasn't been written to memory yet
+} CcrState;
+
+#define CCR_NATIVE      0               // the x86 flags hold N, Z, V and C
+#define CCR_RESULT      1               // N and Z according to the value in ccr_reg, V and C cleared
+#define CCR_CONST       2               // ditto, and the value is known
+
+// pseudo x86 conditions for 680x0 conditions that can be evaluated at translation time
+#define COND_ALWAYS     0x10
+#define COND_NEVER      0x11
+
+// structure describing a relative jump from the TU currently being translated to another TU
+// (or a relative call to the entry of a library routine in a jump table)
+typedef struct
+{
+    uint8_t *p_field;                   // position of the 32-bit offset in the buffer
+    const uint8_t *p_target;            // source address of the TU the jump goes to (or address of the entry)
+} Fixup;
+
+// structure describing an entry of the shadow stack: a subroutine call in the translated code records
+// the return address it pushes onto the guest stack together with the address the translated code
+// continues at, so that RTS can jump there directly if it finds the same return address on the guest stack
+typedef struct
+{
+    uint32_t se_guest_ret;              // return address as on the guest stack (big-endian)
+    uint32_t se_reserved;
+    uint8_t  *p_host_ret;               // address of the translated code following the call
+} ShadowEntry;
+
+// layout of the memory area at SHADOW_STACK_ADDRESS (the translated code only accesses the lower 32 bits of the pointers)
+typedef struct
+{
+    ShadowEntry *p_top;                 // next free entry
+    uint8_t  *p_target;                 // where RTS or an indirect branch continues (host return address / code of the
+                                        // target, or the return / branch dispatcher)
+    uint32_t indirect_src;              // source address of the target of the last indirect branch not found in the cache
+    uint32_t reserved;                  // for the branch dispatcher (always 0, it pushes the address as 64-bit value)
+    const uint8_t *p_entry;             // source address of the TU the guest starts with, see setup_program()
+    ShadowEntry entries[SHADOW_STACK_SIZE];     // first entry never matches, second one is the return to the host
+} ShadowStack;
 
 #define OP_AREG         0
 #define OP_DREG         1
 #define OP_MEM          2
 #define OP_IMM          3
 #define OP_AREG_OFFSET  4
+#define OP_TARGET       5               // address only known at runtime (base register + index register + displacement)
+
+#define NO_REG          0xff            // OP_TARGET without base or index register
+#define INDEX_LONG      0x10            // OP_TARGET with the whole index register as index (only the sign-extended lower word otherwise)
+
+// number of executions after which a TU is translated again with tier 1, 0 disables tier 1
+extern uint32_t g_tier1_threshold;
+// translate TUs ahead of execution in a separate thread
+extern bool g_spec_translation;
+// access guest memory with MOVBE (set by setup_dispatchers() if the CPU supports it)
+extern bool g_use_movbe;
 
 // prototypes
+bool setup_dispatchers();
+const RuntimeSymbol *get_runtime_symbols(int *p_num_symbols);
 uint8_t *setup_tu(const uint8_t *p_m68k_code);
-uint8_t *translate_tu(const uint8_t *p_m68k_code);
+uint8_t *setup_program(const uint8_t *p_m68k_code);
+void reset_shadow_stack();
+uint8_t *translate_tu(const uint8_t *p_m68k_code, uint32_t entry_a6);
+uint8_t *optimize_tu(const uint8_t *p_m68k_code, uint32_t entry_a6);
+void register_jump_table(const uint8_t *p_start, const uint8_t *p_end);
+bool translate_program(int num_threads);
+bool start_spec_translation();
+void stop_spec_translation();
+void recover_from_translation_fault();
+void lock_translator();
+void unlock_translator();
 
 // test case table, will be used if translate.c is compiled as standalone program
 #if TEST
 static const uint8_t testcase_tbl[][2][MAX_INSTRUCTION_SIZE + 1] = {
-    // Motorola instruction encoding,                      Intel instruction encoding,
+    // Motorola instruction encoding,                      Intel instruction encoding (without MOVBE),
     // prefixed with number of bytes                       prefixed with number of bytes
-    {{4, 0x2c, 0x78, 0x00, 0x04},						   {7, 0x8b, 0x34, 0x25, 0x04, 0x00, 0x00, 0x00}},	        // movea.l 0x0004, a6 => mov esi, [0x00000004]
+    {{4, 0x2c, 0x78, 0x00, 0x04},						   {9, 0x8b, 0x34, 0x25, 0x04, 0x00, 0x00, 0x00, 0x0f, 0xce}},	// movea.l 0x0004, a6 => mov esi, [0x00000004]; bswap esi
     {{6, 0x28, 0x7c, 0xde, 0xad, 0xbe, 0xef},			   {5, 0xbf, 0xef, 0xbe, 0xad, 0xde}},	                    // movea.l #0xdeadbeef, a4 => mov edi, 0xdeadbeef
-    {{6, 0x2e, 0x79, 0xde, 0xad, 0xbe, 0xef},			   {7, 0x8b, 0x24, 0x25, 0xef, 0xbe, 0xad, 0xde}},	        // movea.l 0xdeadbeef, a7 => mov esp, [0xdeadbeef]
+    {{6, 0x2e, 0x79, 0xde, 0xad, 0xbe, 0xef},			   {9, 0x8b, 0x24, 0x25, 0xef, 0xbe, 0xad, 0xde, 0x0f, 0xcc}},	// movea.l 0xdeadbeef, a7 => mov esp, [0xdeadbeef]; bswap esp
     {{2, 0x70, 0x80},                                      {6, 0x41, 0xb8, 0x80, 0xff, 0xff, 0xff}},                // moveq.l 0x80, d0 => mov r8d, 0x80
     {{2, 0x72, 0x7f},                                      {6, 0x41, 0xb9, 0x7f, 0x00, 0x00, 0x00}},                // moveq.l 0x7f, d1 => mov r9d, 0x7f
-    {{6, 0x20, 0x39, 0x55, 0x55, 0xaa, 0xaa},              {8, 0x44, 0x8b, 0x04, 0x25, 0xaa, 0xaa, 0x55, 0x55}},    // move.l 0x5555aaaa, d0 => mov r8d, [0x5555aaaa]
+    {{6, 0x20, 0x39, 0x55, 0x55, 0xaa, 0xaa},              {11, 0x44, 0x8b, 0x04, 0x25, 0xaa, 0xaa, 0x55, 0x55, 0x41, 0x0f, 0xc8}},   // move.l 0x5555aaaa, d0 => mov r8d, [0x5555aaaa]; bswap r8d
     {{6, 0x22, 0x3c, 0x55, 0x55, 0xaa, 0xaa},              {6, 0x41, 0xb9, 0xaa, 0xaa, 0x55, 0x55}},                // move.l #0x5555aaaa, d1 => mov r9d, 0x5555aaaa
-    {{6, 0x23, 0xc1, 0x55, 0x55, 0xaa, 0xaa},              {8, 0x44, 0x89, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55}},    // move.l d1, 0x5555aaaa => mov [0x5555aaaa], r9d
+    {{6, 0x23, 0xc1, 0x55, 0x55, 0xaa, 0xaa},              {14, 0x41, 0x0f, 0xc9, 0x44, 0x89, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55, 0x41, 0x0f, 0xc9}},     // move.l d1, 0x5555aaaa => bswap r9d; mov [0x5555aaaa], r9d; bswap r9d
+    {{6, 0x30, 0x39, 0x55, 0x55, 0xaa, 0xaa},              {14, 0x66, 0x44, 0x8b, 0x04, 0x25, 0xaa, 0xaa, 0x55, 0x55, 0x66, 0x41, 0xc1, 0xc0, 0x08}},     // move.w 0x5555aaaa, d0 => mov r8w, [0x5555aaaa]; rol r8w, 8
+    {{6, 0x33, 0xc1, 0x55, 0x55, 0xaa, 0xaa},              {19, 0x66, 0x41, 0xc1, 0xc1, 0x08, 0x66, 0x44, 0x89, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55, 0x66, 0x41, 0xc1, 0xc1, 0x08}},   // move.w d1, 0x5555aaaa => rol r9w, 8; mov [0x5555aaaa], r9w; rol r9w, 8
+    {{6, 0x14, 0x39, 0x55, 0x55, 0xaa, 0xaa},              {8, 0x44, 0x8a, 0x14, 0x25, 0xaa, 0xaa, 0x55, 0x55}},    // move.b 0x5555aaaa, d2 => mov r10b, [0x5555aaaa]
+    {{6, 0x13, 0xc1, 0x55, 0x55, 0xaa, 0xaa},              {8, 0x44, 0x88, 0x0c, 0x25, 0xaa, 0xaa, 0x55, 0x55}},    // move.b d1, 0x5555aaaa => mov [0x5555aaaa], r9b
     {{2, 0x26, 0x02},                                      {3, 0x45, 0x89, 0xd3}},                                  // move.l d2, d3 => mov r11d, r10d
     {{2, 0x53, 0x82},                                      {4, 0x41, 0x83, 0xea, 0x01}},                            // subq.l #1, d2 => sub, r10d, 1
     {{2, 0x4a, 0x80},                                      {3, 0x45, 0x85, 0xc0}},                                  // tst.l d0 => test r8d, r8d
+    {{2, 0x57, 0xc1},                                      {8, 0x41, 0xb1, 0xff, 0x74, 0x03, 0x41, 0xb1, 0x00}},    // seq d1 => mov r9b, 0xff; je +3; mov r9b, 0
+    {{2, 0x50, 0xc2},                                      {3, 0x41, 0xb2, 0xff}},                                  // st d2 => mov r10b, 0xff
+    {{4, 0x4e, 0xae, 0xff, 0xe2},                          {7, 0x56, 0x83, 0xc6, 0xe2, 0xff, 0xd6, 0x5e}},        // jsr -30(a6) => push rsi; add esi, -30; call rsi; pop rsi
     {{4, 0x4e, 0xae, 0xfc, 0x4c},                          {10, 0x56, 0x81, 0xc6, 0x4c, 0xfc, 0xff, 0xff, 0xff, 0xd6, 0x5e}},    // jsr -948(a6) => push rsi; add esi, -948; call rsi; pop rsi
 };
 #endif
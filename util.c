@@ -6,6 +6,17 @@
 // 
 
 
+#define _GNU_SOURCE             // for memfd_create() and process_vm_readv()
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ucontext.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "util.h"
 
 
@@ -21,3 +32,239 @@ void logmsg(const char *fname, int lineno, const char *func, const char *level,
     va_end(args);
     printf("\n");
 }
+
+
+uint64_t get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// calculate hash of a block of data, the hash can be calculated incrementally over several
+// blocks by passing the result for the previous block as initial value (HASH_INIT for the first block)
+uint64_t hash_data(const void *p_data, size_t size, uint64_t hash)
+{
+    for (const uint8_t *p = p_data; p < (const uint8_t *) p_data + size; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+
+// calculate hash of a file
+bool hash_file(const char *p_fname, uint64_t *p_hash)
+{
+    int fd;
+    struct stat stat_info;
+    void *p_data;
+
+    if ((fd = open(p_fname, O_RDONLY)) == -1)
+        return false;
+    if (fstat(fd, &stat_info) == -1) {
+        close(fd);
+        return false;
+    }
+    if ((p_data = mmap(NULL, stat_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    *p_hash = hash_data(p_data, stat_info.st_size, HASH_INIT);
+    munmap(p_data, stat_info.st_size);
+    close(fd);
+    return true;
+}
+
+
+// create a memory area that is mapped twice: an executable view (at the given address if p_exec_addr
+// is not NULL) and a writable view (at an arbitrary address), so that code can be generated without
+// any mapping being writable and executable at the same time (W^X) and without changing protections
+// The views share the same pages, so address X in the executable view corresponds to address
+// X + (*pp_writable - executable view) in the writable view. If reserve_only is true, both views are
+// inaccessible until they get committed with commit_dual_mapping(). Returns the executable view or NULL.
+uint8_t *create_dual_mapping(void *p_exec_addr, size_t size, bool reserve_only, uint8_t **pp_writable)
+{
+    int fd;
+    uint8_t *p_exec_view;
+
+    if ((fd = memfd_create("vadm-code", MFD_CLOEXEC)) == -1)
+        return NULL;
+    // the file is sparse, so memory is only used for the pages that are actually touched
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((p_exec_view = mmap(p_exec_addr,
+                            size,
+                            reserve_only ? PROT_NONE : PROT_READ | PROT_EXEC,
+                            MAP_SHARED | MAP_NORESERVE | (p_exec_addr != NULL ? MAP_FIXED_NOREPLACE : 0),
+                            fd,
+                            0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if ((*pp_writable = mmap(NULL,
+                             size,
+                             reserve_only ? PROT_NONE : PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_NORESERVE,
+                             fd,
+                             0)) == MAP_FAILED) {
+        munmap(p_exec_view, size);
+        close(fd);
+        return NULL;
+    }
+    // the mappings keep the file alive
+    close(fd);
+    return p_exec_view;
+}
+
+
+// commit part of a memory area created with create_dual_mapping() and reserve_only = true
+bool commit_dual_mapping(uint8_t *p_exec_addr, uint8_t *p_writable_addr, size_t size)
+{
+    return (mprotect(p_exec_addr, size, PROT_READ | PROT_EXEC) == 0) &&
+           (mprotect(p_writable_addr, size, PROT_READ | PROT_WRITE) == 0);
+}
+
+
+// read a dword from an address that may not be mapped (process_vm_readv() fails with EFAULT
+// instead of raising SIGSEGV), returns false if it can't be read
+bool read_dword_safely(const void *p_addr, uint32_t *p_value)
+{
+    struct iovec local = {p_value, 4}, remote = {(void *) p_addr, 4};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 4;
+}
+
+
+// check if the page fault a SIGSEGV handler has been called for was caused by a write access (bit 1 of
+// the error code), with the context passed to the handler (REG_ERR is only available with _GNU_SOURCE,
+// and its register names clash with the ones in codegen.h, so this can't live in execute.c)
+bool is_write_fault(const void *p_context)
+{
+    return ((const ucontext_t *) p_context)->uc_mcontext.gregs[REG_ERR] & 2;
+}
+
+
+//
+// tracing, see trace_site_enabled()
+//
+typedef struct
+{
+    const uint8_t *p_site;              // address of the NOP in the executable view of generated code...
+    uint8_t *p_writable;                // ... and in the writable view
+    const uint8_t *p_target;            // address of the code it gets patched to call
+} GeneratedTraceSite;
+
+// sites in the C code, the linker provides the start and end of the section (weak symbols because
+// the section is missing in programs without any sites)
+extern const TraceSite __start_trace_sites[] __attribute__((weak));
+extern const TraceSite __stop_trace_sites[] __attribute__((weak));
+
+static GeneratedTraceSite *p_generated_sites = NULL;
+static size_t num_generated_sites = 0;
+static bool tracing_enabled = false;
+
+// write a trace site (at p_dest, which may be the writable view of p_site) according to the current state,
+// either the NOP or a JMP / CALL (opcode) with a 32-bit offset to its target
+static void write_trace_site(uint8_t *p_dest, const uint8_t *p_site, uint8_t opcode, const uint8_t *p_target)
+{
+    static const uint8_t nop[TRACE_SITE_SIZE] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
+    int32_t offset = p_target - (p_site + TRACE_SITE_SIZE);
+
+    if (tracing_enabled) {
+        p_dest[0] = opcode;
+        memcpy(p_dest + 1, &offset, sizeof(offset));
+    }
+    else
+        memcpy(p_dest, nop, TRACE_SITE_SIZE);
+}
+
+
+// enable / disable tracing by patching all trace sites
+// This also works from a signal handler while the guest is running: the only other thread (the
+// speculative translator) is kept idle via lock_translator(), so no code is executing a site while
+// it is being patched. Patching the sites in the C code needs the pages of the program text to be
+// writable and executable for a moment, so it fails on systems enforcing W^X for them.
+void set_tracing(bool enabled)
+{
+    uintptr_t page_mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+    bool warned = false;
+
+    tracing_enabled = enabled;
+    for (const TraceSite *p_site = __start_trace_sites; p_site < __stop_trace_sites; p_site++) {
+        // the code of the program is only writable while it is being patched
+        uint8_t *p_page = (uint8_t *) ((uintptr_t) p_site->p_site & page_mask);
+        size_t size = p_site->p_site + TRACE_SITE_SIZE - p_page;
+        if (mprotect(p_page, size, PROT_READ | PROT_WRITE | PROT_EXEC) == -1) {
+            if (!warned) {
+                WARN("could not make program text writable to patch trace sites, tracing in the C code stays %s: %s",
+                     enabled ? "disabled" : "enabled", strerror(errno));
+                warned = true;
+            }
+            continue;
+        }
+        write_trace_site((uint8_t *) p_site->p_site, p_site->p_site, 0xe9, p_site->p_target);   // JMP rel32
+        mprotect(p_page, size, PROT_READ | PROT_EXEC);
+    }
+    for (size_t i = 0; i < num_generated_sites; i++)
+        write_trace_site(p_generated_sites[i].p_writable, p_generated_sites[i].p_site, 0xe8, p_generated_sites[i].p_target);  // CALL rel32
+}
+
+
+bool is_tracing_enabled()
+{
+    return tracing_enabled;
+}
+
+
+// The registry of the sites in generated code is changed by the guest (e.g. when it opens a library)
+// and walked by set_tracing() in the handler for SIGUSR1 (see execute.c), which runs on the same
+// thread, so SIGUSR1 is blocked while the registry is changed.
+static void block_usr1(sigset_t *p_saved_sigmask)
+{
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigmask, p_saved_sigmask);
+}
+
+
+// write a trace site in generated code (TRACE_SITE_SIZE bytes at p_site, written through p_writable)
+// that calls p_target when tracing is enabled according to the current state, and register it,
+// returns false if it could not be registered (it is not patched then)
+bool add_trace_site(const uint8_t *p_site, uint8_t *p_writable, const uint8_t *p_target)
+{
+    GeneratedTraceSite *p_sites;
+    sigset_t saved_sigmask;
+    bool registered = false;
+
+    block_usr1(&saved_sigmask);
+    write_trace_site(p_writable, p_site, 0xe8, p_target);
+    if ((p_sites = realloc(p_generated_sites, (num_generated_sites + 1) * sizeof(GeneratedTraceSite))) != NULL) {
+        p_generated_sites = p_sites;
+        p_generated_sites[num_generated_sites++] = (GeneratedTraceSite) {p_site, p_writable, p_target};
+        registered = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved_sigmask, NULL);
+    return registered;
+}
+
+
+// unregister the trace sites in generated code between p_start and p_end (executable view),
+// because the code is going to be discarded
+void remove_trace_sites(const uint8_t *p_start, const uint8_t *p_end)
+{
+    sigset_t saved_sigmask;
+    size_t i = 0;
+
+    block_usr1(&saved_sigmask);
+    while (i < num_generated_sites) {
+        if ((p_generated_sites[i].p_site >= p_start) && (p_generated_sites[i].p_site < p_end))
+            p_generated_sites[i] = p_generated_sites[--num_generated_sites];
+        else
+            ++i;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved_sigmask, NULL);
+}
@@ -8,13 +8,50 @@
 #define UTIL_H_INCLUDED
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
-// logging macros
+// tracing: a trace site is a 5-byte NOP in the code that gets patched into a jump / call to the
+// code doing the tracing when tracing is enabled with set_tracing() (even in a running guest), so
+// tracing costs nothing while it is disabled
+// In C code, trace_site_enabled() is a trace site (listed in the section trace_sites) jumping to
+// the code for "true", in generated code, the sites are registered with add_trace_site().
+// Limitation: the sites in the C code are patched in the text of the program, which is writable and
+// executable while this happens, so tracing can't be enabled where W^X is enforced for the text (the
+// sites in generated code are patched through the writable view of the code, see create_dual_mapping()).
+#define TRACE_SITE_SIZE 5
+typedef struct
+{
+    const uint8_t *p_site;              // address of the NOP
+    const uint8_t *p_target;            // address of the code it gets patched to jump to
+} TraceSite;
+
+static inline __attribute__((always_inline)) bool trace_site_enabled()
+{
+    asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n"    // NOP DWORD PTR [RAX + RAX + 0]
+             ".pushsection trace_sites, \"aw\"\n"
+             ".balign 8\n"
+             ".quad 1b, %l0\n"
+             ".popsection\n"
+             : : : : enabled);
+    return false;
+enabled:
+    return true;
+}
+
+void set_tracing(bool enabled);
+bool is_tracing_enabled();
+bool add_trace_site(const uint8_t *p_site, uint8_t *p_writable, const uint8_t *p_target);
+void remove_trace_sites(const uint8_t *p_start, const uint8_t *p_end);
+
+// logging macros (DEBUG messages are only logged while tracing is enabled)
 void logmsg(const char *fname, int lineno, const char *func, const char *level, const char *fmtstr, ...);
+#define TRACE(fmtstr, ...) {if (trace_site_enabled()) logmsg(__FILE__, __LINE__, __func__, "TRACE", fmtstr, ##__VA_ARGS__);}
 #ifdef VERBOSE_LOGGING
-    #define DEBUG(fmtstr, ...) {logmsg(__FILE__, __LINE__, __func__, "DEBUG", fmtstr, ##__VA_ARGS__);}
+    #define DEBUG(fmtstr, ...) {if (trace_site_enabled()) logmsg(__FILE__, __LINE__, __func__, "DEBUG", fmtstr, ##__VA_ARGS__);}
 #else
     #define DEBUG(fmtstr, ...) {}
 #endif
@@ -23,4 +60,22 @@ void logmsg(const char *fname, int lineno, const char *func, const char *level,
 #define ERROR(fmtstr, ...) {logmsg(__FILE__, __LINE__, __func__, "ERROR", fmtstr, ##__VA_ARGS__);}
 #define CRIT(fmtstr, ...) {logmsg(__FILE__, __LINE__, __func__, "CRIT", fmtstr, ##__VA_ARGS__);}
 
+// time measurement (for the benchmarks)
+uint64_t get_time_ns();
+
+// hashing (64-bit FNV-1a)
+#define HASH_INIT 0xcbf29ce484222325
+uint64_t hash_data(const void *p_data, size_t size, uint64_t hash);
+bool hash_file(const char *p_fname, uint64_t *p_hash);
+
+// memory areas with separate executable and writable views
+uint8_t *create_dual_mapping(void *p_exec_addr, size_t size, bool reserve_only, uint8_t **pp_writable);
+bool commit_dual_mapping(uint8_t *p_exec_addr, uint8_t *p_writable_addr, size_t size);
+
+// reading memory that may not be mapped
+bool read_dword_safely(const void *p_addr, uint32_t *p_value);
+
+// signal handling
+bool is_write_fault(const void *p_context);
+
 #endif
@@ -6,6 +6,11 @@
 // 
 
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "execute.h"
 #include "loader.h"
 #include "tlcache.h"
@@ -14,28 +19,145 @@
 #include "util.h"
 
 
+#define MIN_CODE_CACHE_SIZE 8           // in KB, needs to hold the dispatcher and the largest possible TU
+
+
+static void print_usage()
+{
+    ERROR("usage: vadm [-a (translate program ahead of time into the persistent cache or an image, don't execute it)] "
+          "[-c <size of translation cache in KB>] [-i <image to execute the program from, nothing is translated>] "
+          "[-j <number of threads for -a>] [-o <image to save the program translated with -a to>] "
+          "[-p <directory for persistent translation cache>] [-s (translate code speculatively in a separate thread)] "
+          "[-t (enable tracing, toggled by SIGUSR1 while the guest is running)] <program to execute>");
+}
+
+
 int main(int argc, char **argv)
 {
     uint8_t *p_m68k_code_addr, *p_x86_code_addr;
     uint32_t m68k_code_size;
+    size_t code_cache_size = DEFAULT_CODE_CACHE_SIZE;
+    const char *p_cache_dir = NULL, *p_image_in = NULL, *p_image_out = NULL;
+    bool is_aot = false;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char cache_fname[PATH_MAX];
+    uint64_t program_hash;
+    int opt;
 
-    if (argc != 2) {
-        ERROR("usage: vadm <program to execute>");
+    while ((opt = getopt(argc, argv, "ac:i:j:o:p:st")) != -1) {
+        switch (opt) {
+            case 'a':
+                is_aot = true;
+                break;
+            case 'c':
+                code_cache_size = strtoul(optarg, NULL, 10);
+                if ((code_cache_size < MIN_CODE_CACHE_SIZE) || (code_cache_size > MAX_CODE_SIZE / 1024)) {
+                    ERROR("size of translation cache must be between %d and %d KB", MIN_CODE_CACHE_SIZE, MAX_CODE_SIZE / 1024);
+                    return 1;
+                }
+                code_cache_size *= 1024;
+                break;
+            case 'i':
+                p_image_in = optarg;
+                break;
+            case 'j':
+                num_threads = strtol(optarg, NULL, 10);
+                if ((num_threads < 1) || (num_threads > MAX_AOT_THREADS)) {
+                    ERROR("number of threads must be between 1 and %d", MAX_AOT_THREADS);
+                    return 1;
+                }
+                break;
+            case 'o':
+                p_image_out = optarg;
+                break;
+            case 'p':
+                p_cache_dir = optarg;
+                break;
+            case 's':
+                g_spec_translation = true;
+                break;
+            case 't':
+                set_tracing(true);
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    // -a saves the code either to the persistent cache or to an image (-o), -i only uses the image
+    if ((optind != argc - 1) ||
+        (is_aot && ((p_cache_dir == NULL) == (p_image_out == NULL))) || (!is_aot && (p_image_out != NULL)) ||
+        ((p_image_in != NULL) && (is_aot || (p_cache_dir != NULL)))) {
+        print_usage();
         return 1;
     }
     INFO("loading program...");
-    if (!load_program(argv[1], &p_m68k_code_addr, &m68k_code_size)) {
+    if (!load_program(argv[optind], &p_m68k_code_addr, &m68k_code_size)) {
         ERROR("loading program failed");
         return 1;
     }
     INFO("initializing translation cache and setting up first TU...");
-    if ((gp_tlcache = tc_init()) == NULL) {
+    if ((gp_tlcache = tc_init(code_cache_size)) == NULL) {
         ERROR("initializing translation cache failed")
+        return 1;
+    }
+    if (!setup_dispatchers()) {
+        ERROR("setting up dispatchers failed");
+        return 1;
+    }
+    if ((p_cache_dir != NULL) || (p_image_in != NULL) || (p_image_out != NULL)) {
+        if (!hash_file(argv[optind], &program_hash)) {
+            ERROR("calculating hash of program failed");
+            return 1;
+        }
     }
-    if ((p_x86_code_addr = setup_tu(p_m68k_code_addr)) == NULL) {
+    // use the code translated in a previous run of the same program, if there is any
+    if (p_cache_dir != NULL) {
+        snprintf(cache_fname, PATH_MAX, "%s/%016lx.tc", p_cache_dir, program_hash);
+        tc_attach_file(gp_tlcache, cache_fname, program_hash);
+    }
+    // The code in an image is mapped at the start of a page, right after the permanent part of the cache. It is
+    // translated without execution counters because it can't be translated again with tier 1 anyway.
+    else if ((p_image_in != NULL) || (p_image_out != NULL)) {
+        if (!tc_align_flushable(gp_tlcache)) {
+            ERROR("setting up translation cache for image failed");
+            return 1;
+        }
+        gp_tlcache->program_hash = program_hash;
+        g_tier1_threshold = 0;
+        if (p_image_in != NULL) {
+            int num_symbols;
+            const RuntimeSymbol *p_symbols = get_runtime_symbols(&num_symbols);
+            if (!tc_load_image(gp_tlcache, p_image_in, program_hash, p_symbols, num_symbols)) {
+                ERROR("loading image failed");
+                return 1;
+            }
+        }
+    }
+    if ((p_x86_code_addr = setup_program(p_m68k_code_addr)) == NULL) {
         ERROR("setting up TU failed");
         return 1;
     }
+    // translate everything now and only save the code, a later run with -p then loads it and only needs
+    // to translate the code that can't be found ahead of time (a run with -i doesn't translate anything)
+    if (is_aot) {
+        INFO("translating program ahead of time...");
+        if (num_threads > MAX_AOT_THREADS)
+            num_threads = MAX_AOT_THREADS;
+        else if (num_threads < 1)
+            num_threads = 1;
+        if (!translate_program(num_threads)) {
+            ERROR("translating program failed");
+            return 1;
+        }
+        tc_log_stats(gp_tlcache);
+        if (p_image_out != NULL) {
+            int num_symbols;
+            const RuntimeSymbol *p_symbols = get_runtime_symbols(&num_symbols);
+            return tc_save_image(gp_tlcache, p_image_out, p_symbols, num_symbols) ? 0 : 1;
+        }
+        return tc_save_file(gp_tlcache) ? 0 : 1;
+    }
     INFO("executing program...");
     if (!exec_program((int (*)()) p_x86_code_addr)) {
         ERROR("executing program failed");
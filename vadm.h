@@ -12,4 +12,7 @@
 // memory mapping there, and mmap(2) on Linux doesn't allow a mapping in the first 64KB anyway.
 #define ABS_EXEC_BASE 0x00300000
 
+// address of the X flag of the 680x0 (on the same page, after the base address of Exec library)
+#define X_FLAG_ADDRESS (ABS_EXEC_BASE + 8)
+
 #endif